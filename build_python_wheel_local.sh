@@ -8,11 +8,13 @@ cd build
 cmake -G Ninja .. -DCMAKE_BUILD_TYPE=Release \
                   -DCMAKE_CXX_FLAGS="-static-libgcc -static-libstdc++ -fPIC" \
                   -DCMAKE_EXE_LINKER_FLAGS="-static-libgcc -static-libstdc++" \
-                  -DCMAKE_SHARED_LINKER_FLAGS="-static-libgcc -static-libstdc++" 
+                  -DCMAKE_SHARED_LINKER_FLAGS="-static-libgcc -static-libstdc++" \
+                  -DBUILD_PYTHON_EXTENSION=ON
 
 ninja 
 cd ..
 cp build/bin/program-markers python_src/program_markers
+cp build/lib/_program_markers*.so python_src/program_markers
 cp setup.py.in setup.py
 sed -i "s~THIS_DIR~$(pwd)~g" setup.py
 python -m build
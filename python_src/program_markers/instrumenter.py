@@ -1,12 +1,19 @@
 from __future__ import annotations
 
-from dataclasses import replace
+import json
 from enum import Enum
 from functools import cache
-from itertools import dropwhile, takewhile
 from pathlib import Path
-
-from diopter.compiler import ClangTool, ClangToolMode, CompilerExe, SourceProgram
+from tempfile import NamedTemporaryFile
+from typing import Any
+
+from diopter.compiler import (
+    ClangTool,
+    ClangToolMode,
+    CompilerExe,
+    Language,
+    SourceProgram,
+)
 from program_markers.iprogram import InstrumentedProgram
 from program_markers.markers import (
     DCEMarker,
@@ -22,87 +29,73 @@ from program_markers.markers import (
 # e.g., instrumenter --info
 
 
-def __get_vr_macro_type_map(instrumented_code: str) -> dict[str, str]:
-    """Finds the variable type for each VRMarker instance
-    in the instrumented code.
+def __convert_variable_type(variable_type: str) -> str:
+    """Converts the canonical type of a VRMarker variable, as reported
+    by the instrumenter, into one of the types VRMarkers support.
     Args:
-        instrumented_code (str):
-            the output of the instrumenter (the variable types
-            of VRMarkers are parsed from the instrumented_code)
+        variable_type (str):
+            the canonical type from the instrumenter's manifest
     Returns:
-        dict[str,str]:
-            the variable type for each instance of VRMarkerX_
-            in the instrumented code
+        str:
+            the corresponding supported type
     """
-
-    def convert_variable_type(variable_type: str) -> str:
-        type_map = {
-            "_Bool": "bool",
-            "signed char": "char",
-            "uint8_t": "unsigned int",
-            "int8_t": "int",
-            "uint16_t": "unsigned short",
-            "int16_t": "short",
-            "uint32_t": "unsigned int",
-            "int32_t": "int",
-            "uint64_t": "unsigned long",
-            "int64_t": "long",
-        }
-        if variable_type in type_map:
-            variable_type = type_map[variable_type]
-        assert variable_type in [
-            "bool",
-            "char",
-            "short",
-            "int",
-            "long",
-            "long long",
-            "unsigned char",
-            "unsigned short",
-            "unsigned int",
-            "unsigned long",
-            "unsigned long long",
-        ], f"Unexpected variable type for VRMarker: {variable_type} in {line}"
-        return variable_type
-
-    macroprefix = VRMarker.macroprefix()
-    vr_macro_type_map = {}
-    for line in instrumented_code.splitlines():
-        if macroprefix not in line:
-            continue
-        line = line[line.index(macroprefix) :]
-        line = line[: line.find(")")]
-        macro = line.split("(")[0]
-        variable_type = convert_variable_type(
-            (line.split(",")[1].replace('"', "")).strip()
-        )
-        vr_macro_type_map[macro.replace(macroprefix, VRMarker.prefix())] = variable_type
-    return vr_macro_type_map
-
-
-def __str_to_marker(marker_macro: str, vr_macro_type_map: dict[str, str]) -> Marker:
-    """Converts the `marker_macro` string into a `Marker.
+    type_map = {
+        "_Bool": "bool",
+        "signed char": "char",
+        "uint8_t": "unsigned int",
+        "int8_t": "int",
+        "uint16_t": "unsigned short",
+        "int16_t": "short",
+        "uint32_t": "unsigned int",
+        "int32_t": "int",
+        "uint64_t": "unsigned long",
+        "int64_t": "long",
+    }
+    if variable_type in type_map:
+        variable_type = type_map[variable_type]
+    assert variable_type in [
+        "bool",
+        "char",
+        "short",
+        "int",
+        "long",
+        "long long",
+        "unsigned char",
+        "unsigned short",
+        "unsigned int",
+        "unsigned long",
+        "unsigned long long",
+    ], f"Unexpected variable type for VRMarker: {variable_type}"
+    return variable_type
+
+
+def __manifest_record_to_marker(record: dict[str, Any]) -> Marker:
+    """Converts a record of the instrumenter's JSON manifest into a `Marker`.
     Args:
-        marker_macro (str):
-            a marker in the form PrefixMarkerX_, e.g., DCEMarker32_.
-        vr_macro_type_map (dict[str,str]):
-            a mapping from VRMarker macros to their variable types
-            e.g., {"VRMarker0_": "int", "VRMarker1_": "short"}
+        record (dict[str, Any]):
+            a marker record, e.g., {"kind": "vr", "name": "VRMarker0_",
+            "type": "int", ...}
     Returns:
         Marker:
             a `Marker` object
     """
-    if marker_macro.startswith(DCEMarker.prefix()):
-        return DCEMarker.from_str(marker_macro)
+    if record["kind"] == "dce":
+        return DCEMarker.from_str(record["name"])
     else:
-        assert marker_macro.startswith(VRMarker.prefix()), marker_macro
-        return VRMarker.from_str(marker_macro, vr_macro_type_map[marker_macro])
+        assert record["kind"] == "vr", record
+        return VRMarker.from_str(
+            record["name"], __convert_variable_type(record["type"])
+        )
 
 
 class NoInstrumentationAddedError(Exception):
     pass
 
 
+class InstrumentationError(Exception):
+    pass
+
+
 @cache
 def get_instrumenter(
     instrumenter: ClangTool | None = None, clang: CompilerExe | None = None
@@ -129,46 +122,23 @@ def get_instrumenter(
     return instrumenter
 
 
-def parse_marker_names(instrumenter_output: str) -> list[str]:
-    markers_start = "//MARKERS START\n"
-    markers_end = "//MARKERS END\n"
-    lines: list[str] = list(
-        dropwhile(
-            lambda x: x.startswith(markers_start),
-            instrumenter_output.strip().splitlines(),
-        )
-    )
-    if not lines:
-        raise NoInstrumentationAddedError
-    return list(takewhile(lambda x: not x.startswith(markers_end), lines[1:]))[:-1]
-
-
 class InstrumenterMode(Enum):
     DCE = 0
     VR = 1
     DCE_AND_VR = 2
 
-
-def add_temporary_disable_directives(source: str, markers: list[Marker]) -> str:
-    temp_directives = ["//TEMP_DIRECTIVES_START\n"]
-    for marker in markers:
-        assert isinstance(marker, DCEMarker)
-        temp_directives.append(f"#define {marker.macro()}")
-    temp_directives.append("//TEMP_DIRECTIVES_END\n")
-    return "\n".join(temp_directives) + "\n" + source
-
-
-def remove_temporary_disable_directives(source: str) -> str:
-    lines = source.strip().splitlines()
-    pre_lines = list(
-        takewhile(lambda x: not x.startswith("//TEMP_DIRECTIVES_START"), lines)
-    )
-    post_lines = list(
-        dropwhile(
-            lambda x: not x.startswith("//TEMP_DIRECTIVES_END"), lines[len(pre_lines) :]
-        )
-    )
-    return "\n".join(pre_lines) + "\n" + "\n".join(post_lines)
+    def to_flag_value(self) -> str:
+        """The value of the instrumenter's --mode option for this mode.
+        In DCE_AND_VR mode both kinds of markers are added in a single pass
+        and share one ID space.
+        """
+        match self:
+            case InstrumenterMode.DCE:
+                return "dce"
+            case InstrumenterMode.VR:
+                return "vr"
+            case InstrumenterMode.DCE_AND_VR:
+                return "dce,vr"
 
 
 def instrument_program(
@@ -205,94 +175,86 @@ def instrument_program(
         flags.append("--ignore-functions-with-macros=0")
 
     def get_code_and_markers(mode: str) -> tuple[str, list[Marker]]:
-        result = instrumenter_resolved.run_on_program(
-            program,
-            flags + [f"--mode={mode}"],
-            ClangToolMode.CAPTURE_OUT_ERR_AND_READ_MODIFIED_FILED,
-            timeout=timeout,
-        )
-        assert result.modified_source_code
-        if not result.stdout:
-            raise NoInstrumentationAddedError
-        instrumented_code = result.modified_source_code
-        marker_names = parse_marker_names(result.stdout)
-        if mode == "vr":
-            vr_macro_type_map = __get_vr_macro_type_map(instrumented_code)
-        else:
-            vr_macro_type_map = {}
-
-        return instrumented_code, [
-            __str_to_marker(marker_name, vr_macro_type_map)
-            for marker_name in marker_names
-        ]
-
-    match mode:
-        case InstrumenterMode.DCE:
-            instrumented_code, markers = get_code_and_markers("dce")
-        case InstrumenterMode.VR:
-            instrumented_code, markers = get_code_and_markers("vr")
-        case InstrumenterMode.DCE_AND_VR:
+        with NamedTemporaryFile(suffix=".json") as manifest_file:
             result = instrumenter_resolved.run_on_program(
                 program,
-                flags + ["--mode=dce"],
+                flags + [f"--mode={mode}", f"--manifest={manifest_file.name}"],
                 ClangToolMode.CAPTURE_OUT_ERR_AND_READ_MODIFIED_FILED,
                 timeout=timeout,
             )
-            assert result.modified_source_code
-            if not result.stdout:
-                raise NoInstrumentationAddedError
-            dce_markers = [
-                __str_to_marker(name, {}) for name in parse_marker_names(result.stdout)
-            ]
-            program_dce = replace(
-                program,
-                code=add_temporary_disable_directives(
-                    result.modified_source_code, dce_markers
-                ),
-            )
-            result = instrumenter_resolved.run_on_program(
-                program_dce,
-                flags + ["--mode=vr"],
-                ClangToolMode.CAPTURE_OUT_ERR_AND_READ_MODIFIED_FILED,
-                timeout=timeout,
-            )
-            assert result.modified_source_code
-            if not result.stdout:
-                # XXX: I don't really nead to raise here,
-                # I can just ignore VRMarkers
-                raise NoInstrumentationAddedError
-            instrumented_code = remove_temporary_disable_directives(
-                result.modified_source_code
-            )
-            vr_macro_type_map = __get_vr_macro_type_map(instrumented_code)
-            vr_markers = list(
-                __str_to_marker(name, vr_macro_type_map)
-                for name in parse_marker_names(result.stdout)
-            )
-            if len(vr_markers) > 0 and len(dce_markers) > 0:
-                # There will be overlap between the two sets of marker ids
-                max_vr_id = max(vr_marker.id for vr_marker in vr_markers)
-                replacements = []
-                new_dce_markers = []
-                for dce_marker in dce_markers:
-                    old_macro = dce_marker.macro()
-                    old_id = dce_marker.id
-                    new_id = old_id + max_vr_id + 1
-                    new_marker = replace(
-                        dce_marker,
-                        id=new_id,
-                        name=dce_marker.name.replace(str(old_id), str(new_id)),
-                    )
-                    new_macro = new_marker.macro()
-                    replacements.append((old_macro, new_macro))
-                    new_dce_markers.append(new_marker)
-                dce_markers = new_dce_markers
-                for old_macro, new_macro in replacements:
-                    instrumented_code = instrumented_code.replace(
-                        old_macro, new_macro, 1
-                    )
-                markers = dce_markers + vr_markers
+            manifest = json.load(manifest_file)
+        assert result.modified_source_code
+        records = [
+            record
+            for file_manifest in manifest["files"]
+            for record in file_manifest["markers"]
+        ]
+        if not records:
+            raise NoInstrumentationAddedError
+        return result.modified_source_code, [
+            __manifest_record_to_marker(record) for record in records
+        ]
+
+    instrumented_code, markers = get_code_and_markers(mode.to_flag_value())
+    return __make_instrumented_program(program, instrumented_code, markers)
+
+
+def instrument_program_in_process(
+    program: SourceProgram,
+    ignore_functions_with_macros: bool = False,
+    mode: InstrumenterMode = InstrumenterMode.DCE,
+    resource_dir: Path | None = None,
+) -> InstrumentedProgram:
+    """Instrument a given program in the current process via the native
+    extension, i.e., without spawning the instrumenter or writing temporary
+    files. The GIL is released while instrumenting, so threads can instrument
+    programs in parallel.
 
+    Args:
+        program (Source):
+            The program to be instrumented.
+        ignore_functions_with_macros (bool):
+            Whether to ignore instrumenting functions that contain macro expansions
+        mode (InstrumenterMode):
+            Which markers to insert
+        resource_dir (Path | None):
+            The resource directory (clang -print-resource-dir) of the clang
+            version the extension was built with, it contains clang's builtin
+            headers. Defaults to the one the extension was built with
+    Returns:
+        InstrumentedProgram: The instrumented version of program
+    """
+    from program_markers._program_markers import instrument
+
+    flags = [f"-I{path}" for path in program.include_paths]
+    flags += [f"-isystem{path}" for path in program.system_include_paths]
+    flags += [f"-D{macro}" for macro in program.defined_macros]
+    flags += list(program.flags)
+    if resource_dir:
+        flags.append(f"-resource-dir={resource_dir}")
+
+    try:
+        instrumented_code, records = instrument(
+            program.code,
+            flags,
+            mode.to_flag_value(),
+            "input.c" if program.language == Language.C else "input.cpp",
+            ignore_functions_with_macros,
+        )
+    except RuntimeError as e:
+        raise InstrumentationError(str(e)) from e
+    if not records:
+        raise NoInstrumentationAddedError
+    return __make_instrumented_program(
+        program,
+        instrumented_code,
+        [__manifest_record_to_marker(record) for record in records],
+    )
+
+
+def __make_instrumented_program(
+    program: SourceProgram, instrumented_code: str, markers: list[Marker]
+) -> InstrumentedProgram:
     ee = EnableEmitter(FunctionCallDetectionStrategy())
     return InstrumentedProgram(
         code=instrumented_code,
@@ -38,3 +38,41 @@ def test_instrumentation() -> None:
     non_eliminated_markers = iprogram.find_non_eliminated_markers(gcc)
     assert set() == set(eliminated_markers)
     assert all_markers == set(non_eliminated_markers)
+
+
+def test_shared_marker_ids() -> None:
+    iprogram = instrument_program(
+        SourceProgram(
+            code="""
+    int foo(int a, int b){
+        if (a > b) {
+            b = a;
+        }
+        while (b > 0)
+            b--;
+        return b;
+    }
+
+    int bar(int c){
+        for (int i = 0; i < c; ++i)
+            c--;
+        return c;
+    }
+    """,
+            language=Language.C,
+        ),
+        mode=InstrumenterMode.DCE_AND_VR,
+    )
+
+    markers = iprogram.enabled_markers()
+    assert any(isinstance(marker, DCEMarker) for marker in markers)
+    assert any(isinstance(marker, VRMarker) for marker in markers)
+    # Both kinds of markers are numbered in one ID space and named after their
+    # IDs, the names in the code are those of the returned markers
+    assert sorted(marker.id for marker in markers) == list(range(len(markers)))
+    for marker in markers:
+        assert marker.name == f"{marker.prefix()}{marker.id}_"
+        assert marker.macro_without_arguments() in iprogram.code
+
+    gcc = get_system_gcc_O0()
+    assert set(markers) == set(iprogram.find_non_eliminated_markers(gcc))
@@ -0,0 +1,92 @@
+from concurrent.futures import ThreadPoolExecutor
+
+import pytest
+from diopter.compiler import Language, SourceProgram
+from program_markers.instrumenter import (
+    InstrumenterMode,
+    instrument_program,
+    instrument_program_in_process,
+)
+from program_markers.markers import DCEMarker, VRMarker
+
+from .utils import get_system_gcc_O0
+
+# The extension is only built with -DBUILD_PYTHON_EXTENSION=ON
+pytest.importorskip("program_markers._program_markers")
+
+CODE = """
+    #define ONE 1
+    int foo(int a){
+        if (a > 0)
+            return ONE;
+        return 0;
+    }
+    int bar(int a, int b){
+        if (a > b)
+            return a;
+        return b;
+    }
+    """
+
+
+def make_program() -> SourceProgram:
+    return SourceProgram(code=CODE, language=Language.C)
+
+
+@pytest.mark.parametrize(
+    "mode", [InstrumenterMode.DCE, InstrumenterMode.VR, InstrumenterMode.DCE_AND_VR]
+)
+def test_same_as_instrumenter(mode: InstrumenterMode) -> None:
+    iprogram = instrument_program_in_process(make_program(), mode=mode)
+    expected = instrument_program(make_program(), mode=mode)
+    assert iprogram.code == expected.code
+    assert iprogram.markers == expected.markers
+    gcc = get_system_gcc_O0()
+    assert set(iprogram.find_non_eliminated_markers(gcc)) == set(
+        expected.find_non_eliminated_markers(gcc)
+    )
+
+
+def test_ignore_functions_with_macros() -> None:
+    ignored = instrument_program_in_process(
+        make_program(), ignore_functions_with_macros=True
+    )
+    assert all(isinstance(marker, DCEMarker) for marker in ignored.markers)
+    assert len(ignored.markers) == 2
+    assert "ONE;" in ignored.code
+
+    # The setting only applies to its own call
+    iprogram = instrument_program_in_process(make_program())
+    assert len(iprogram.markers) == 4
+
+
+def test_no_marker_directives() -> None:
+    iprogram = instrument_program_in_process(make_program())
+    assert "#define DCEMARKERMACRO" not in iprogram.code
+    assert "MARKER_DIRECTIVES" not in iprogram.code
+    # Instrumenting in process does not change the settings of the tool
+    expected = instrument_program(make_program())
+    assert iprogram.code == expected.code
+
+
+def test_threads() -> None:
+    settings = [False, True] * 8
+    with ThreadPoolExecutor(max_workers=4) as executor:
+        iprograms = list(
+            executor.map(
+                lambda ignore: instrument_program_in_process(
+                    make_program(),
+                    ignore_functions_with_macros=ignore,
+                    mode=InstrumenterMode.DCE_AND_VR,
+                ),
+                settings,
+            )
+        )
+    for ignore, iprogram in zip(settings, iprograms):
+        expected = instrument_program(
+            make_program(),
+            ignore_functions_with_macros=ignore,
+            mode=InstrumenterMode.DCE_AND_VR,
+        )
+        assert iprogram.markers == expected.markers
+        assert any(isinstance(marker, VRMarker) for marker in iprogram.markers)
@@ -87,6 +87,30 @@ def test_instrumentation() -> None:
     assert set() == set(iprogram.find_eliminated_markers(gcc))
 
 
+def test_manifest_markers() -> None:
+    iprogram = instrument_program(
+        SourceProgram(
+            code="""
+    long foo(signed char c, long l){
+        if (c)
+            return 1;
+        return l;
+    }
+    """,
+            language=Language.C,
+        ),
+        mode=InstrumenterMode.VR,
+    )
+    # The markers and the types of their variables are read from the manifest,
+    # canonical types are mapped to the ones VRMarkers support
+    markers = iprogram.markers
+    assert all(isinstance(marker, VRMarker) for marker in markers)
+    assert sorted(marker.id for marker in markers) == list(range(len(markers)))
+    assert {marker.variable_type for marker in markers} == {"char", "long"}
+    for marker in markers:
+        assert marker.macro_without_arguments() in iprogram.code
+
+
 def test_disable_markers() -> None:
     iprogram = instrument_program(
         SourceProgram(
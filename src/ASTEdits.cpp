@@ -17,20 +17,58 @@ ASTEdit addMetadata(ASTEdit &&Edit, EditMetadataKind Kind) {
           -> EditMetadataKind { return Kind; });
 }
 
+std::string makeMarkerEditText(EditMetadataKind Kind, llvm::StringRef Text,
+                               size_t MarkerID) {
+  auto ID = std::to_string(MarkerID);
+  switch (Kind) {
+  case EditMetadataKind::MarkerCall:
+    return (Text + "\n\nDCEMARKERMACRO" + ID + "_\n\n").str();
+  case EditMetadataKind::NewElseBranch:
+    return (Text + "\n\n else {\nDCEMARKERMACRO" + ID + "_\n}\n\n").str();
+  case EditMetadataKind::VRMarker:
+    return ("VRMARKERMACRO" + ID + "_(" + Text + ")\n").str();
+  }
+  llvm_unreachable("markers::makeMarkerEditText: Unknown EditMetadataKind");
+}
+
 namespace {
 
-std::string GetFilenameFromRange(const CharSourceRange &R,
-                                 const SourceManager &SM) {
-  const std::pair<FileID, unsigned> DecomposedLocation =
-      SM.getDecomposedLoc(SM.getSpellingLoc(R.getBegin()));
-  const FileEntry *Entry = SM.getFileEntryForID(DecomposedLocation.first);
-  return std::string(Entry ? Entry->getName() : "");
+// The name of the function enclosing the root node of the match, i.e., the
+// statement the rule matched, not another bound node such as the variable of
+// a value range marker, which may be declared in an outer function.
+std::string GetEnclosingFunctionName(
+    const clang::ast_matchers::MatchFinder::MatchResult &Result) {
+  auto It = Result.Nodes.getMap().find(std::string(RewriteRule::RootID));
+  if (It == Result.Nodes.getMap().end())
+    return "";
+  for (auto Current = It->second;;) {
+    if (const auto *FD = Current.get<FunctionDecl>())
+      return FD->getQualifiedNameAsString();
+    auto Parents = Result.Context->getParents(Current);
+    if (Parents.empty())
+      return "";
+    Current = Parents[0];
+  }
+}
+
+unsigned
+GetMatchOffset(const clang::ast_matchers::MatchFinder::MatchResult &Result) {
+  auto It = Result.Nodes.getMap().find(std::string(RewriteRule::RootID));
+  if (It == Result.Nodes.getMap().end())
+    return 0;
+  auto Loc = It->second.getSourceRange().getBegin();
+  if (Loc.isInvalid())
+    return 0;
+  return Result.SourceManager->getFileOffset(
+      Result.SourceManager->getExpansionLoc(Loc));
 }
 
 } // namespace
 
 void RuleActionEditCollector::run(
     const clang::ast_matchers::MatchFinder::MatchResult &Result) {
+  ScopedPhaseTimer Timer(Times, Phase::EditCollection);
+  ++NumMatches;
   if (Result.Context->getDiagnostics().hasErrorOccurred()) {
     llvm::errs() << "An error has occured.\n";
     return;
@@ -65,44 +103,55 @@ void RuleActionEditCollector::run(
                                : nullptr;
 #endif
 
-    auto UpdateReplacements = [&](llvm::StringRef Text) {
-      Replacements.emplace_back(*SM, T.Range, Text);
-    };
-
+    Replacement R(*SM, T.Range, T.Replacement);
     if (!Metadata) {
-      UpdateReplacements(T.Replacement);
+      CollectedEdits.push_back({std::move(R), std::nullopt});
       continue;
     }
 
-    auto GetMarkerN = [&]() -> size_t & {
-      return FileToNumberMarkerDecls[GetFilenameFromRange(T.Range, *SM)];
-    };
+    auto Kind = *Metadata == EditMetadataKind::VRMarker ? MarkerKind::VR
+                                                        : MarkerKind::DCE;
+    auto &Markers = FileToMarkers[std::string(R.getFilePath())];
+    MarkerInfo Info{Kind,
+                    Markers.size(),
+                    R.getOffset(),
+                    0,
+                    0,
+                    GetEnclosingFunctionName(Result),
+                    "",
+                    "",
+                    Rank,
+                    GetMatchOffset(Result)};
+    if (Kind == MarkerKind::VR)
+      if (const auto *VD = Result.Nodes.getNodeAs<VarDecl>("var")) {
+        Info.Variable = VD->getNameAsString();
+        Info.Type = VD->getType()
+                        .getCanonicalType()
+                        .getUnqualifiedType()
+                        .getAsString();
+      }
+    Markers.push_back(std::move(Info));
+    CollectedEdits.push_back({std::move(R), *Metadata, Markers.size() - 1});
+  }
+}
 
-    switch (*Metadata) {
-    case EditMetadataKind::MarkerCall: {
-      auto N = GetMarkerN()++;
-      UpdateReplacements(T.Replacement + "\n\nDCEMARKERMACRO" +
-                         std::to_string(N) + "_\n\n");
-      break;
-    }
-    case EditMetadataKind::NewElseBranch: {
-      auto N = GetMarkerN()++;
-      UpdateReplacements(T.Replacement + std::string{"\n\n"} +
-                         " else {\nDCEMARKERMACRO" + std::to_string(N) +
-                         "_\n}" + +"\n\n");
-      break;
+void RuleActionEditCollector::runOnMatches(
+    clang::ast_matchers::internal::BoundNodesTreeBuilder &Matches,
+    ASTContext &Context) {
+  class Visitor
+      : public clang::ast_matchers::internal::BoundNodesTreeBuilder::Visitor {
+  public:
+    Visitor(RuleActionEditCollector &Collector, ASTContext &Context)
+        : Collector{Collector}, Context{Context} {}
+    void visitMatch(const BoundNodes &Nodes) override {
+      Collector.run(MatchFinder::MatchResult(Nodes, &Context));
     }
-    case EditMetadataKind::VRMarker: {
-      auto N = GetMarkerN()++;
-      UpdateReplacements("VRMARKERMACRO" + std::to_string(N) + "_(" +
-                         T.Replacement + ")\n");
-      break;
-    }
-    default:
-      llvm_unreachable("markers::detail::RuleActionEditCollector::run: "
-                       "Unknown EditMetadataKind");
-    };
-  }
+
+  private:
+    RuleActionEditCollector &Collector;
+    ASTContext &Context;
+  } MatchVisitor(*this, Context);
+  Matches.visitMatches(&MatchVisitor);
 }
 
 void RuleActionEditCollector::registerMatchers(
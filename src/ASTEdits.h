@@ -6,30 +6,89 @@
 #include <clang/Tooling/Transformer/RewriteRule.h>
 #include <clang/Tooling/Transformer/Stencil.h>
 
+#include <optional>
+
+#include "PhaseTimes.h"
+
 namespace markers {
 
 enum class EditMetadataKind { MarkerCall, NewElseBranch, VRMarker };
 
+enum class MarkerKind { DCE, VR };
+
+// A marker inserted by one of the rules
+struct MarkerInfo {
+  MarkerKind Kind;
+  size_t ID;
+  // The location in the original file where the marker is inserted. The line
+  // and column are only filled in for the main file of an instrumentation
+  // action.
+  unsigned Offset;
+  unsigned Line;
+  unsigned Column;
+  // The qualified name of the enclosing function.
+  std::string Function;
+  // Only for VR markers: the variable whose value range is tested and its
+  // canonical type.
+  std::string Variable;
+  std::string Type;
+  // The rank of the rule that inserted the marker and the offset of the node
+  // it matched: they order the markers inserted at the same offset when they
+  // are numbered by position.
+  size_t RuleRank = 0;
+  unsigned MatchOffset = 0;
+};
+
+// An edit of a rule. The text of the edits that insert markers is only
+// completed by makeMarkerEditText once the marker IDs are final.
+struct CollectedEdit {
+  clang::tooling::Replacement Replacement;
+  std::optional<EditMetadataKind> Metadata;
+  // The index of the inserted marker in the markers of the edited file.
+  size_t Marker = 0;
+};
+
+std::string makeMarkerEditText(EditMetadataKind Kind, llvm::StringRef Text,
+                               size_t MarkerID);
+
 clang::transformer::ASTEdit addMetadata(clang::transformer::ASTEdit &&Edit,
                                         EditMetadataKind Kind);
 
 class RuleActionEditCollector
     : public clang::ast_matchers::MatchFinder::MatchCallback {
 public:
+  // Name is the name of the function that makes the rule, under which the
+  // MatchFinder profiles it (--profile-matchers).
   RuleActionEditCollector(
-      clang::transformer::RewriteRule Rule,
-      std::vector<clang::tooling::Replacement> &Replacements,
-      std::map<std::string, size_t> &FileToNumberMarkerDecls)
-      : Rule{Rule}, Replacements{Replacements},
-        FileToNumberMarkerDecls{FileToNumberMarkerDecls} {}
+      clang::transformer::RewriteRule Rule, std::string Name, size_t Rank,
+      std::vector<CollectedEdit> &Edits,
+      std::map<std::string, std::vector<MarkerInfo>> &FileToMarkers)
+      : Rule{Rule}, Name{std::move(Name)}, Rank{Rank}, CollectedEdits{Edits},
+        FileToMarkers{FileToMarkers} {}
   void
   run(const clang::ast_matchers::MatchFinder::MatchResult &Result) override;
+  // Runs the rule on each match of Matches, whose bindings are those of the
+  // matcher of the rule, e.g., found by a RuleDispatcher.
+  void
+  runOnMatches(clang::ast_matchers::internal::BoundNodesTreeBuilder &Matches,
+               clang::ASTContext &Context);
   void registerMatchers(clang::ast_matchers::MatchFinder &Finder);
+  llvm::StringRef getID() const override { return Name; }
+  // Records the time spent in run() as Phase::EditCollection.
+  void setPhaseTimes(PhaseTimes *NewTimes) { Times = NewTimes; }
+  // The number of matches of the rule, i.e., of calls of run().
+  size_t getNumMatches() const { return NumMatches; }
+  void addNumMatches(size_t N) { NumMatches += N; }
+  void resetNumMatches() { NumMatches = 0; }
 
 private:
   clang::transformer::RewriteRule Rule;
-  std::vector<clang::tooling::Replacement> &Replacements;
-  std::map<std::string, size_t> &FileToNumberMarkerDecls;
+  std::string Name;
+  size_t Rank;
+  std::vector<CollectedEdit> &CollectedEdits;
+  std::map<std::string, std::vector<MarkerInfo>> &FileToMarkers;
+  PhaseTimes *Times = nullptr;
+  size_t NumMatches = 0;
 };
 
 } // namespace markers
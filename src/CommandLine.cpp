@@ -11,4 +11,105 @@ cl::opt<bool> NoPreprocessorDirectives(
              "stdout."),
     cl::cat(ProgramMarkersOptions), cl::init(false));
 
+cl::opt<DirectiveStyle> Directives(
+    "directive-style",
+    cl::desc("How the preprocessor directives that define the marker macros "
+             "are emitted (default: full)."),
+    cl::values(clEnumValN(DirectiveStyle::Full, "full",
+                          "An #if/#elif/#else block per marker."),
+               clEnumValN(DirectiveStyle::Compact, "compact",
+                          "Shared dispatch macros and a short entry per "
+                          "marker. The Disable and Unreachable macros of a "
+                          "marker must then be defined as 1, as -D does. "
+                          "C89 and C++98 inputs get the full directives.")),
+    cl::cat(ProgramMarkersOptions), cl::init(DirectiveStyle::Full));
+
+cl::opt<std::string> DirectivesOutput(
+    "directives-out",
+    cl::desc("Write the marker declarations and directives to this header "
+             "instead of inserting them at the top of the (single) source "
+             "path, which then only contains the marker macros, e.g., to "
+             "-include the header when compiling it (default: none)."),
+    cl::cat(ProgramMarkersOptions), cl::init(""));
+
+cl::opt<std::string> PreambleCacheDirectory(
+    "preamble-cache",
+    cl::desc("Precompile the leading #includes of each input into a PCH "
+             "stored in this directory and reuse it for every input (and "
+             "later run) with the same includes and compiler options. A PCH "
+             "is rebuilt when an included header changes (default: no "
+             "cache)."),
+    cl::cat(ProgramMarkersOptions), cl::init(""));
+
+cl::opt<bool> TimePhases(
+    "time-phases",
+    cl::desc("Report the time spent parsing, matching, collecting edits, "
+             "merging replacements, rewriting and writing files (default: "
+             "false)."),
+    cl::cat(ProgramMarkersOptions), cl::init(false));
+
+cl::opt<bool> PrintStats(
+    "print-stats",
+    cl::desc("Report the peak RSS, the size of the AST, the number of local "
+             "source location entries, the matches of each rule and the "
+             "number and size of the replacements (default: false)."),
+    cl::cat(ProgramMarkersOptions), cl::init(false));
+
+cl::opt<bool> ProfileMatchers(
+    "profile-matchers",
+    cl::desc("Report the time spent in the matchers of each rule and its "
+             "number of matches (default: false)."),
+    cl::cat(ProgramMarkersOptions), cl::init(false));
+
+cl::opt<unsigned> MatchThreads(
+    "match-threads",
+    cl::desc("Match the functions of each translation unit with this many "
+             "threads, 0 uses all cores. Every thread but the first parses the "
+             "translation unit again. The result is the same as with one "
+             "thread. Inputs parsed with a precompiled header, e.g., with "
+             "--preamble-cache, and runs with --print-stats or "
+             "--profile-matchers are matched with one thread (default: 1)."),
+    cl::cat(ProgramMarkersOptions), cl::init(1));
+
+cl::opt<MatchingEngine> Engine(
+    "engine",
+    cl::desc("How the rules find what to instrument, both engines insert the "
+             "same markers (default: visitor)."),
+    cl::values(clEnumValN(MatchingEngine::Visitor, "visitor",
+                          "Walk each function once to find the variables of "
+                          "the value range markers and match each statement "
+                          "of the DCE markers once by its kind."),
+               clEnumValN(MatchingEngine::Rules, "rules",
+                          "Only use the matchers of the transformer rules. "
+                          "Slower, kept as a reference for differential "
+                          "testing.")),
+    cl::cat(ProgramMarkersOptions), cl::init(MatchingEngine::Visitor));
+
+cl::opt<MarkerNumbering> Numbering(
+    "marker-numbering",
+    cl::desc("How the markers of a file are numbered (default: traversal)."),
+    cl::values(clEnumValN(MarkerNumbering::Traversal, "traversal",
+                          "In the order in which the rules match."),
+               clEnumValN(MarkerNumbering::Position, "position",
+                          "By the offset of the markers in the file, i.e., "
+                          "independently of the matching order.")),
+    cl::cat(ProgramMarkersOptions), cl::init(MarkerNumbering::Traversal));
+
+cl::opt<unsigned> MaxMarkers(
+    "max-markers",
+    cl::desc("Keep at most this many randomly chosen markers per file, 0 keeps "
+             "all of them (default: 0)."),
+    cl::cat(ProgramMarkersOptions), cl::init(0));
+
+cl::opt<double, false, ProbabilityParser> SampleRate(
+    "sample-rate",
+    cl::desc("Keep each marker with this probability (default: 1)."),
+    cl::cat(ProgramMarkersOptions), cl::init(1));
+
+cl::opt<unsigned> SampleSeed(
+    "seed",
+    cl::desc("The seed of --sample-rate and --max-markers, the same seed keeps "
+             "the same markers of the same program (default: 0)."),
+    cl::cat(ProgramMarkersOptions), cl::init(0));
+
 } // namespace markers
@@ -6,7 +6,37 @@ namespace cl = llvm::cl;
 
 namespace markers {
 
+enum class MarkerNumbering { Traversal, Position };
+enum class DirectiveStyle { Full, Compact };
+enum class MatchingEngine { Visitor, Rules };
+
+// Only accepts probabilities, i.e., numbers in [0, 1].
+struct ProbabilityParser : public cl::parser<double> {
+  ProbabilityParser(cl::Option &O) : cl::parser<double>(O) {}
+
+  bool parse(cl::Option &O, llvm::StringRef ArgName, llvm::StringRef Arg,
+             double &Value) {
+    if (cl::parser<double>::parse(O, ArgName, Arg, Value))
+      return true;
+    if (!(Value >= 0 && Value <= 1))
+      return O.error("'" + Arg + "' is not a probability in [0, 1]");
+    return false;
+  }
+};
+
 extern cl::OptionCategory ProgramMarkersOptions;
 extern cl::opt<bool> NoPreprocessorDirectives;
+extern cl::opt<DirectiveStyle> Directives;
+extern cl::opt<std::string> DirectivesOutput;
+extern cl::opt<std::string> PreambleCacheDirectory;
+extern cl::opt<bool> TimePhases;
+extern cl::opt<bool> PrintStats;
+extern cl::opt<bool> ProfileMatchers;
+extern cl::opt<unsigned> MatchThreads;
+extern cl::opt<MatchingEngine> Engine;
+extern cl::opt<MarkerNumbering> Numbering;
+extern cl::opt<unsigned> MaxMarkers;
+extern cl::opt<double, false, ProbabilityParser> SampleRate;
+extern cl::opt<unsigned> SampleSeed;
 
 } // namespace markers
@@ -0,0 +1,27 @@
+#include "ContextCache.h"
+
+#include <llvm/Support/ErrorHandling.h>
+
+namespace markers {
+
+namespace {
+
+thread_local ContextCaches *CurrentCaches = nullptr;
+
+} // namespace
+
+ContextCaches::ContextCaches(clang::ASTContext &Context)
+    : Context{Context}, Previous{CurrentCaches} {
+  CurrentCaches = this;
+}
+
+ContextCaches::~ContextCaches() { CurrentCaches = Previous; }
+
+ContextCaches &ContextCaches::of(clang::ASTContext &Context) {
+  if (!CurrentCaches || &CurrentCaches->Context != &Context)
+    llvm::report_fatal_error("the matchers ran without the ContextCaches of "
+                             "their ASTContext");
+  return *CurrentCaches;
+}
+
+} // namespace markers
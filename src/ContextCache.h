@@ -0,0 +1,46 @@
+#pragma once
+
+#include <clang/AST/ASTContext.h>
+#include <llvm/ADT/SmallVector.h>
+
+#include <memory>
+#include <utility>
+
+namespace markers {
+
+// The caches of the matchers for one ASTContext, e.g., the enclosing functions
+// of its statements. They are owned by the code that runs the matchers on the
+// context and are current for the calling thread while they live, so that the
+// matchers, which only see the context, find them without a lock and each
+// thread, e.g., of --all-tus or the python extension, has its own.
+class ContextCaches {
+public:
+  explicit ContextCaches(clang::ASTContext &Context);
+  ContextCaches(const ContextCaches &) = delete;
+  ContextCaches &operator=(const ContextCaches &) = delete;
+  ~ContextCaches();
+
+  // The current caches of Context, which must exist.
+  static ContextCaches &of(clang::ASTContext &Context);
+
+  // The T of the context, which is created from it when it is first needed.
+  template <typename T> T &get() {
+    static const char Key = 0;
+    for (const auto &[EntryKey, Entry] : Entries)
+      if (EntryKey == &Key)
+        return *static_cast<T *>(Entry.get());
+    auto Cache = std::make_shared<T>(Context);
+    Entries.emplace_back(&Key, Cache);
+    return *Cache;
+  }
+
+private:
+  clang::ASTContext &Context;
+  ContextCaches *Previous;
+  // The caches by the addresses of the keys of their types, there are only a
+  // few.
+  llvm::SmallVector<std::pair<const void *, std::shared_ptr<void>>, 4>
+      Entries;
+};
+
+} // namespace markers
@@ -0,0 +1,19 @@
+#include "DCEAndValueRangeInstrumenter.h"
+
+#include "DCEInstrumenter.h"
+#include "ValueRangeInstrumenter.h"
+
+namespace markers {
+
+DCEAndValueRangeInstrumenter::DCEAndValueRangeInstrumenter(
+    std::map<std::string, clang::tooling::Replacements> &FileToReplacements)
+    : Instrumenter{FileToReplacements} {
+  // The VR rules are registered first, so a statement's VRMarker gets a lower
+  // ID than the DCEMarkers inside it. The DCE edits are added last so that
+  // their text precedes the VRMarker text when both insert at one location,
+  // e.g., before the first statement of a case.
+  addRules(ValueRangeInstrumenter::makeRules());
+  addRules(DCEInstrumenter::makeRules(), DCEInstrumenter::makeDispatcher());
+}
+
+} // namespace markers
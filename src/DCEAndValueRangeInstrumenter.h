@@ -0,0 +1,15 @@
+#pragma once
+
+#include "Instrumenter.h"
+
+namespace markers {
+
+// Adds both DCEMarkers and VRMarkers in a single traversal, the two kinds of
+// markers share one ID space
+class DCEAndValueRangeInstrumenter : public Instrumenter {
+public:
+  DCEAndValueRangeInstrumenter(
+      std::map<std::string, clang::tooling::Replacements> &FileToReplacements);
+};
+
+} // namespace markers
@@ -1,13 +1,15 @@
 #include "DCEInstrumenter.h"
 
-#include <sstream>
-
 #include "CommandLine.h"
 #include "Matchers.h"
 #include "RangeSelectors.h"
 
+#include <tuple>
+
 using namespace clang;
 using namespace clang::ast_matchers;
+using clang::ast_matchers::internal::BindableMatcher;
+using clang::ast_matchers::internal::BoundNodesTreeBuilder;
 using namespace clang::tooling;
 using namespace clang::transformer;
 using namespace clang::transformer::detail;
@@ -44,7 +46,8 @@ EditGenerator InstrumentNonCStmt(std::string id) {
 auto handleIfStmt() {
   auto matcher =
       ifStmt(isNotInConstexprOrConstevalFunction(),
-             isNotInFunctionWithMacrosMatcher(), ConditionNotInMacroAndInMain(),
+             isNotInFunctionWithMacrosMatcher(), isInSelectedCode(),
+             ConditionNotInMacroAndInMain(),
              optionally(hasElse(
                  anyOf(compoundStmt(inMainAndNotMacro()).bind("celse"),
                        stmt(hasParent(ifStmt(ElseNotInMacroAndInMain())))
@@ -72,12 +75,14 @@ auto handleIfStmt() {
 auto handleDoWhile() {
   auto compoundMatcher =
       doStmt(isNotInConstexprOrConstevalFunction(),
-             isNotInFunctionWithMacrosMatcher(), inMainAndNotMacro(),
+             isNotInFunctionWithMacrosMatcher(), isInSelectedCode(),
+             inMainAndNotMacro(),
              hasBody(compoundStmt(inMainAndNotMacro()).bind("body")))
           .bind("dostmt");
   auto nonCompoundLoopMatcher =
       doStmt(isNotInConstexprOrConstevalFunction(),
-             isNotInFunctionWithMacrosMatcher(), DoAndWhileNotMacroAndInMain(),
+             isNotInFunctionWithMacrosMatcher(), isInSelectedCode(),
+             DoAndWhileNotMacroAndInMain(),
              hasBody(stmt().bind("body")))
           .bind("dostmt");
 
@@ -93,12 +98,14 @@ auto handleDoWhile() {
 auto handleFor() {
   auto compoundMatcher =
       forStmt(isNotInConstexprOrConstevalFunction(),
-              isNotInFunctionWithMacrosMatcher(), inMainAndNotMacro(),
+              isNotInFunctionWithMacrosMatcher(), isInSelectedCode(),
+              inMainAndNotMacro(),
               hasBody(compoundStmt(inMainAndNotMacro()).bind("body")))
           .bind("loop");
   auto nonCompoundLoopMatcher =
       forStmt(isNotInConstexprOrConstevalFunction(),
-              isNotInFunctionWithMacrosMatcher(), inMainAndNotMacro(),
+              isNotInFunctionWithMacrosMatcher(), isInSelectedCode(),
+              inMainAndNotMacro(),
               hasBody(stmt(inMainAndNotMacro()).bind("body")))
           .bind("loop");
   return applyFirst(
@@ -113,12 +120,14 @@ auto handleFor() {
 auto handleWhile() {
   auto compoundMatcher =
       whileStmt(isNotInConstexprOrConstevalFunction(),
-                isNotInFunctionWithMacrosMatcher(), inMainAndNotMacro(),
+                isNotInFunctionWithMacrosMatcher(), isInSelectedCode(),
+                inMainAndNotMacro(),
                 hasBody(compoundStmt(inMainAndNotMacro()).bind("body")))
           .bind("loop");
   auto nonCompoundLoopMatcher =
       whileStmt(isNotInConstexprOrConstevalFunction(),
-                isNotInFunctionWithMacrosMatcher(), inMainAndNotMacro(),
+                isNotInFunctionWithMacrosMatcher(), isInSelectedCode(),
+                inMainAndNotMacro(),
                 hasBody(stmt(inMainAndNotMacro()).bind("body")))
           .bind("loop");
   return applyFirst(
@@ -130,7 +139,8 @@ auto handleSwitchCase() {
   auto matcher =
       switchStmt(
           isNotInConstexprOrConstevalFunction(),
-          isNotInFunctionWithMacrosMatcher(), inMainAndNotMacro(),
+          isNotInFunctionWithMacrosMatcher(), isInSelectedCode(),
+          inMainAndNotMacro(),
           has(compoundStmt(has(switchCase(colonAndKeywordNotInMacroAndInMain())
                                    .bind("firstcase")))),
           forEachSwitchCase(switchCase(colonAndKeywordNotInMacroAndInMain(),
@@ -145,7 +155,8 @@ auto handleSwitch() {
   auto matcher =
       switchStmt(
           isNotInConstexprOrConstevalFunction(),
-          isNotInFunctionWithMacrosMatcher(), inMainAndNotMacro(),
+          isNotInFunctionWithMacrosMatcher(), isInSelectedCode(),
+          inMainAndNotMacro(),
           has(compoundStmt(has(switchCase(colonAndKeywordNotInMacroAndInMain())
                                    .bind("firstcase")))))
           .bind("stmt");
@@ -154,6 +165,183 @@ auto handleSwitch() {
   return makeRule(matcher, actions);
 }
 
+// Adds the bindings of the matcher of a rule when it matches Root with its
+// case Case, see buildMatchers. Null nodes are not bound.
+void addMatch(BoundNodesTreeBuilder &Matches, const Stmt &Root, size_t Case,
+              std::initializer_list<std::pair<StringRef, const Stmt *>> Nodes) {
+  BoundNodesTreeBuilder Match;
+  Match.setBinding(RewriteRule::RootID, DynTypedNode::create(Root));
+  Match.setBinding(("Tag" + Twine(Case)).str(), DynTypedNode::create(Root));
+  for (auto [ID, Node] : Nodes)
+    if (Node)
+      Match.setBinding(ID, DynTypedNode::create(*Node));
+  Matches.addMatch(Match);
+}
+
+// The matches of the rules without their shared checks. The cases of the
+// rules match the children as is, i.e., without ignoring implicit nodes.
+void matchIf(const IfStmt &If, const MainFileLocations &Locations,
+             BoundNodesTreeBuilder &Matches) {
+  const Stmt *Then = If.getThen();
+  if (!Then || !isConditionNotInMacroAndInMain(If, Locations))
+    return;
+  const Stmt *CThen = nullptr;
+  if (isa<CompoundStmt>(Then) && isInMainAndNotMacro(*Then, Locations))
+    std::swap(CThen, Then);
+  const Stmt *CElse = nullptr;
+  const Stmt *Else = nullptr;
+  if (const auto *E = If.getElse()) {
+    if (isa<CompoundStmt>(E) && isInMainAndNotMacro(*E, Locations))
+      CElse = E;
+    else if (isNotInMacroAndInMain(If.getElseLoc(), Locations))
+      Else = E;
+  }
+  addMatch(Matches, If, 0,
+           {{"ifstmt", &If},
+            {"cthen", CThen},
+            {"then", Then},
+            {"celse", CElse},
+            {"else", Else}});
+}
+
+void matchDo(const DoStmt &Do, const MainFileLocations &Locations,
+             BoundNodesTreeBuilder &Matches) {
+  const Stmt *Body = Do.getBody();
+  if (!Body)
+    return;
+  if (isInMainAndNotMacro(Do, Locations) && isa<CompoundStmt>(Body) &&
+      isInMainAndNotMacro(*Body, Locations))
+    addMatch(Matches, Do, 0, {{"dostmt", &Do}, {"body", Body}});
+  else if (isDoAndWhileNotMacroAndInMain(Do, Locations))
+    addMatch(Matches, Do, 1, {{"dostmt", &Do}, {"body", Body}});
+}
+
+// The for and while rules.
+template <typename LoopStmt>
+void matchLoop(const LoopStmt &Loop, const MainFileLocations &Locations,
+               BoundNodesTreeBuilder &Matches) {
+  const Stmt *Body = Loop.getBody();
+  if (!Body || !isInMainAndNotMacro(Loop, Locations) ||
+      !isInMainAndNotMacro(*Body, Locations))
+    return;
+  addMatch(Matches, Loop, isa<CompoundStmt>(Body) ? 0 : 1,
+           {{"loop", &Loop}, {"body", Body}});
+}
+
+// The first case of the body of Switch that the switch rules instrument.
+const SwitchCase *findFirstCase(const SwitchStmt &Switch,
+                                const MainFileLocations &Locations) {
+  const auto *Body = dyn_cast_or_null<CompoundStmt>(Switch.getBody());
+  if (!Body || !isInMainAndNotMacro(Switch, Locations))
+    return nullptr;
+  for (const auto *Child : Body->body())
+    if (const auto *Case = dyn_cast<SwitchCase>(Child))
+      if (isColonAndKeywordNotInMacroAndInMain(*Case, Locations))
+        return Case;
+  return nullptr;
+}
+
+void matchSwitch(const SwitchStmt &Switch,
+                 const MainFileLocations &Locations,
+                 BoundNodesTreeBuilder &Matches) {
+  if (const auto *FirstCase = findFirstCase(Switch, Locations))
+    addMatch(Matches, Switch, 0, {{"stmt", &Switch}, {"firstcase", FirstCase}});
+}
+
+void matchCases(const SwitchStmt &Switch,
+                const MainFileLocations &Locations,
+                BoundNodesTreeBuilder &Matches) {
+  const auto *FirstCase = findFirstCase(Switch, Locations);
+  if (!FirstCase)
+    return;
+  // In the order of forEachSwitchCase.
+  for (const auto *Case = Switch.getSwitchCaseList(); Case;
+       Case = Case->getNextSwitchCase())
+    if (Case != FirstCase &&
+        isColonAndKeywordNotInMacroAndInMain(*Case, Locations))
+      addMatch(Matches, Switch, 0,
+               {{"stmt", &Switch}, {"firstcase", FirstCase}, {"case", Case}});
+}
+
+// Matches each statement that a DCE rule can instrument once by its kind and
+// decides in code which rules match it, so that the checks that the rules
+// share are done once per statement instead of once per rule.
+class DCERuleDispatcher : public RuleDispatcher {
+public:
+  void registerMatchers(MatchFinder &Finder,
+                        Collectors RuleCollectors) override {
+    this->RuleCollectors = std::move(RuleCollectors);
+    auto IsEnabled = [&](RuleKind Kind) {
+      return llvm::any_of(this->RuleCollectors, [&](const auto &Collector) {
+        return Collector.first == Kind;
+      });
+    };
+    auto Add = [&](BindableMatcher<Stmt> Matcher) {
+      Finder.addMatcher(
+          traverse(TK_IgnoreUnlessSpelledInSource, Matcher.bind("node")),
+          this);
+    };
+    if (IsEnabled(RuleKind::If))
+      Add(ifStmt());
+    if (IsEnabled(RuleKind::While))
+      Add(whileStmt());
+    if (IsEnabled(RuleKind::For))
+      Add(forStmt());
+    if (IsEnabled(RuleKind::Do))
+      Add(doStmt());
+    if (IsEnabled(RuleKind::Switch) || IsEnabled(RuleKind::Case))
+      Add(switchStmt());
+  }
+
+  // The time of the DCE rules is profiled under this name.
+  StringRef getID() const override { return "DCERuleDispatcher"; }
+
+  void run(const MatchFinder::MatchResult &Result) override {
+    const auto *S = Result.Nodes.getNodeAs<Stmt>("node");
+    auto &Context = *Result.Context;
+    if (!S || !Checks.matches(*S, Context))
+      return;
+    const auto &Locations = getMainFileLocations(Context);
+    // In the order of the rules, as their matchers would run.
+    for (auto [Kind, Collector] : RuleCollectors) {
+      BoundNodesTreeBuilder Matches;
+      switch (Kind) {
+      case RuleKind::If:
+        if (const auto *If = dyn_cast<IfStmt>(S))
+          matchIf(*If, Locations, Matches);
+        break;
+      case RuleKind::While:
+        if (const auto *While = dyn_cast<WhileStmt>(S))
+          matchLoop(*While, Locations, Matches);
+        break;
+      case RuleKind::For:
+        if (const auto *For = dyn_cast<ForStmt>(S))
+          matchLoop(*For, Locations, Matches);
+        break;
+      case RuleKind::Do:
+        if (const auto *Do = dyn_cast<DoStmt>(S))
+          matchDo(*Do, Locations, Matches);
+        break;
+      case RuleKind::Switch:
+        if (const auto *Switch = dyn_cast<SwitchStmt>(S))
+          matchSwitch(*Switch, Locations, Matches);
+        break;
+      case RuleKind::Case:
+        if (const auto *Switch = dyn_cast<SwitchStmt>(S))
+          matchCases(*Switch, Locations, Matches);
+        break;
+      case RuleKind::VR:
+        break;
+      }
+      Collector->runOnMatches(Matches, Context);
+    }
+  }
+
+private:
+  SharedRuleChecks Checks;
+  Collectors RuleCollectors;
+};
+
 } // namespace
 
 std::string DCEInstrumenter::makeMarkerMacros(size_t MarkerID) {
@@ -167,67 +355,45 @@ std::string DCEInstrumenter::makeMarkerMacros(size_t MarkerID) {
          "();\n" + "void " + Marker + "(void);\n" + "#endif\n";
 }
 
-DCEInstrumenter::DCEInstrumenter(
-    std::map<std::string, clang::tooling::Replacements> &FileToReplacements)
-    : FileToReplacements{FileToReplacements},
-      Rules{{handleIfStmt(), Replacements, FileToNumberMarkerDecls},
-            {handleWhile(), Replacements, FileToNumberMarkerDecls},
-            {handleFor(), Replacements, FileToNumberMarkerDecls},
-            {handleDoWhile(), Replacements, FileToNumberMarkerDecls},
-            {handleSwitch(), Replacements, FileToNumberMarkerDecls},
-            {handleSwitchCase(), Replacements, FileToNumberMarkerDecls}} {}
-
-void DCEInstrumenter::applyReplacements() {
-  if (FileToReplacements.size() > 1)
-    llvm_unreachable("DCEInstrumenter only supports one file");
-  if (NoPreprocessorDirectives) {
-    for (const auto &[File, NumberMarkerDecls] : FileToNumberMarkerDecls) {
-      llvm::outs() << "//MARKERS START\n";
-      for (size_t i = 0; i < NumberMarkerDecls; ++i)
-        llvm::outs() << "DCEMarker" << i << "_\n";
-      llvm::outs() << "//MARKERS END\n";
-    }
-  } else
-    for (const auto &[File, NumberMarkerDecls] : FileToNumberMarkerDecls) {
-      std::stringstream ss;
-      auto gen = [i = 0]() mutable {
-        auto m = i++;
-        return makeMarkerMacros(m);
-      };
-      ss << "//MARKERS START\n";
-      std::generate_n(std::ostream_iterator<std::string>(ss), NumberMarkerDecls,
-                      gen);
-      ss << "//MARKERS END\n";
-      auto Decls = ss.str();
-      auto R = Replacement(File, 0, 0, Decls);
-      if (auto Err = FileToReplacements[File].add(R))
-        llvm_unreachable(llvm::toString(std::move(Err)).c_str());
-    }
+std::string DCEInstrumenter::makeCompactMarkerMacros(size_t MarkerID) {
+  auto ID = std::to_string(MarkerID);
+  return "void DCEMarker" + ID + "_(void);\n#define DCEMARKERMACRO" + ID +
+         "_ MARKERS_DCE(" + ID + ")\n";
+}
 
-  for (auto Rit = Replacements.rbegin(); Rit != Replacements.rend(); ++Rit) {
-    auto &R = *Rit;
-    auto &Replacements = FileToReplacements[std::string(R.getFilePath())];
-    auto Err = Replacements.add(R);
-    if (Err) {
-      auto NewOffset = Replacements.getShiftedCodePosition(R.getOffset());
-      auto NewLength =
-          Replacements.getShiftedCodePosition(R.getOffset() + R.getLength()) -
-          NewOffset;
-      if (NewLength == R.getLength()) {
-        R = Replacement(R.getFilePath(), NewOffset, NewLength,
-                        R.getReplacementText());
-        Replacements = Replacements.merge(tooling::Replacements(R));
-      } else {
-        llvm_unreachable(llvm::toString(std::move(Err)).c_str());
-      }
-    }
-  }
+std::string DCEInstrumenter::makeDispatchMacro() {
+  return "#define MARKERS_DCE(ID)"
+         " MARKERS_IF(MARKERS_IS_SET(DisableDCEMarker##ID##_), ;,"
+         " MARKERS_IF(MARKERS_IS_SET(UnreachableDCEMarker##ID##_),"
+         " __builtin_unreachable();, DCEMarker##ID##_();))\n";
+}
+
+RuleList DCEInstrumenter::makeRules() {
+  const std::tuple<RuleKind, const char *, RewriteRule (*)()> AllRules[] = {
+      {RuleKind::If, "handleIfStmt", handleIfStmt},
+      {RuleKind::While, "handleWhile", handleWhile},
+      {RuleKind::For, "handleFor", handleFor},
+      {RuleKind::Do, "handleDoWhile", handleDoWhile},
+      {RuleKind::Switch, "handleSwitch", handleSwitch},
+      {RuleKind::Case, "handleSwitchCase", handleSwitchCase},
+  };
+  RuleList Rules;
+  for (auto [Kind, Name, MakeRule] : AllRules)
+    if (isRuleEnabled(Kind))
+      Rules.push_back({Kind, Name, MakeRule()});
+  return Rules;
 }
 
-void DCEInstrumenter::registerMatchers(
-    clang::ast_matchers::MatchFinder &Finder) {
-  for (auto &Rule : Rules)
-    Rule.registerMatchers(Finder);
+std::unique_ptr<RuleDispatcher> DCEInstrumenter::makeDispatcher() {
+  if (Engine == MatchingEngine::Rules)
+    return nullptr;
+  return std::make_unique<DCERuleDispatcher>();
+}
+
+DCEInstrumenter::DCEInstrumenter(
+    std::map<std::string, clang::tooling::Replacements> &FileToReplacements)
+    : Instrumenter{FileToReplacements} {
+  addRules(makeRules(), makeDispatcher());
 }
 
 } // namespace markers
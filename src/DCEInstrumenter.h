@@ -1,26 +1,22 @@
 #pragma once
 
-#include "ASTEdits.h"
+#include "Instrumenter.h"
 
 namespace markers {
 
 // Adds DCEMarkers in places where control flow diverges
-class DCEInstrumenter {
+class DCEInstrumenter : public Instrumenter {
 public:
   DCEInstrumenter(
       std::map<std::string, clang::tooling::Replacements> &FileToReplacements);
-  DCEInstrumenter(DCEInstrumenter &&) = delete;
-  DCEInstrumenter(const DCEInstrumenter &) = delete;
-
-  void registerMatchers(clang::ast_matchers::MatchFinder &Finder);
-  void applyReplacements();
 
   static std::string makeMarkerMacros(size_t MarkerID);
-
-private:
-  std::map<std::string, clang::tooling::Replacements> &FileToReplacements;
-  std::vector<RuleActionEditCollector> Rules;
-  std::vector<clang::tooling::Replacement> Replacements;
-  std::map<std::string, size_t> FileToNumberMarkerDecls;
+  // The entry of the marker in the compact directives and the shared macro
+  // that these entries expand to (--directive-style=compact).
+  static std::string makeCompactMarkerMacros(size_t MarkerID);
+  static std::string makeDispatchMacro();
+  static RuleList makeRules();
+  // Finds the matches of the rules for --engine=visitor, null otherwise.
+  static std::unique_ptr<RuleDispatcher> makeDispatcher();
 };
 } // namespace markers
@@ -0,0 +1,277 @@
+#include "IncrementalInstrumentation.h"
+
+#include <clang/AST/RecursiveASTVisitor.h>
+#include <clang/ASTMatchers/ASTMatchFinder.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Lex/Lexer.h>
+#include <clang/Lex/Preprocessor.h>
+#include <clang/Rewrite/Core/Rewriter.h>
+#include <clang/Serialization/PCHContainerOperations.h>
+#include <llvm/ADT/SetVector.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <optional>
+
+#include "CommandLine.h"
+#include "ContextCache.h"
+#include "Matchers.h"
+#include "TraversalScope.h"
+
+using namespace clang;
+using namespace clang::ast_matchers;
+
+namespace markers {
+
+namespace {
+
+// Collects the declarations that the expressions of a declaration refer to and
+// that its types name.
+class UsedDeclCollector : public RecursiveASTVisitor<UsedDeclCollector> {
+public:
+  bool shouldVisitTemplateInstantiations() const { return false; }
+
+  bool VisitDeclRefExpr(DeclRefExpr *E) {
+    Used.insert(E->getDecl());
+    return true;
+  }
+  bool VisitMemberExpr(MemberExpr *E) {
+    Used.insert(E->getMemberDecl());
+    return true;
+  }
+  bool VisitTypedefTypeLoc(TypedefTypeLoc TL) {
+    Used.insert(TL.getTypedefNameDecl());
+    return true;
+  }
+  bool VisitTagTypeLoc(TagTypeLoc TL) {
+    Used.insert(TL.getDecl());
+    return true;
+  }
+
+  llvm::SetVector<const NamedDecl *> Used;
+};
+
+// What the instrumentation of D, spelled in Range, depends on besides its own
+// text: the definitions of the macros that its text, or these definitions,
+// name and the canonical types of the declarations outside of D that it uses.
+std::string getDependencies(Decl &D, CharSourceRange Range, ASTUnit &AST) {
+  auto &SM = AST.getSourceManager();
+  auto &PP = AST.getPreprocessor();
+  const auto &LangOpts = AST.getLangOpts();
+  std::string Dependencies;
+  llvm::raw_string_ostream OS(Dependencies);
+
+  llvm::SmallPtrSet<const IdentifierInfo *, 32> Seen;
+  llvm::SmallVector<const IdentifierInfo *, 32> Worklist;
+  auto AddIdentifier = [&](const IdentifierInfo *II) {
+    if (II && Seen.insert(II).second)
+      Worklist.push_back(II);
+  };
+  auto [FID, Begin] = SM.getDecomposedLoc(Range.getBegin());
+  auto End = SM.getFileOffset(Range.getEnd());
+  auto Text = SM.getBufferData(FID);
+  Lexer RawLexer(SM.getLocForStartOfFile(FID), LangOpts, Text.begin(),
+                 Text.begin() + Begin, Text.end());
+  while (true) {
+    Token Tok;
+    RawLexer.LexFromRawLexer(Tok);
+    if (Tok.is(tok::eof) || SM.getFileOffset(Tok.getLocation()) >= End)
+      break;
+    if (Tok.is(tok::raw_identifier))
+      AddIdentifier(PP.getIdentifierInfo(Tok.getRawIdentifier()));
+  }
+  while (!Worklist.empty()) {
+    const auto *II = Worklist.pop_back_val();
+    const auto *MI =
+        PP.getMacroDefinitionAtLoc(II, Range.getBegin()).getMacroInfo();
+    if (!MI)
+      continue;
+    OS << "#define " << II->getName() << " "
+       << Lexer::getSourceText(
+              CharSourceRange::getTokenRange(MI->getDefinitionLoc(),
+                                             MI->getDefinitionEndLoc()),
+              SM, LangOpts)
+       << "\n";
+    for (const auto &Tok : MI->tokens())
+      AddIdentifier(Tok.getIdentifierInfo());
+  }
+
+  UsedDeclCollector Collector;
+  Collector.TraverseDecl(&D);
+  for (const auto *Used : Collector.Used) {
+    if (SM.isPointWithin(SM.getExpansionLoc(Used->getLocation()),
+                         Range.getBegin(), Range.getEnd()))
+      continue;
+    OS << Used->getDeclKindName() << " " << Used->getQualifiedNameAsString();
+    if (const auto *VD = dyn_cast<ValueDecl>(Used))
+      OS << " " << VD->getType().getCanonicalType().getAsString();
+    else if (const auto *TD = dyn_cast<TypedefNameDecl>(Used))
+      OS << " " << TD->getUnderlyingType().getCanonicalType().getAsString();
+    OS << "\n";
+  }
+  OS.flush();
+  return Dependencies;
+}
+
+} // namespace
+
+struct IncrementalInstrumenter::CachedDecl {
+  // The offset of the declaration in the version in which it was matched.
+  unsigned Offset;
+  std::map<std::string, tooling::Replacements> Unused;
+  std::unique_ptr<Instrumenter> Instr;
+};
+
+IncrementalInstrumenter::IncrementalInstrumenter(std::string FileName,
+                                                 std::vector<std::string> Args,
+                                                 InstrumenterMode Mode)
+    : FileName{std::move(FileName)}, Args{std::move(Args)}, Mode{Mode},
+      DiagnosticsOS{Diagnostics},
+      DiagnosticPrinter{std::make_unique<TextDiagnosticPrinter>(
+          DiagnosticsOS, new DiagnosticOptions())},
+      Diags{CompilerInstance::createDiagnostics(new DiagnosticOptions(),
+                                                DiagnosticPrinter.get(),
+                                                /*ShouldOwnClient=*/false)},
+      PCHContainerOps{std::make_shared<PCHContainerOperations>()},
+      IgnoreFunctionsWithMacros{getIgnoreFunctionsWithMacros()} {}
+
+IncrementalInstrumenter::~IncrementalInstrumenter() = default;
+
+void IncrementalInstrumenter::reset() {
+  AST.reset();
+  Cache.clear();
+  NextMarkerID = 0;
+}
+
+bool IncrementalInstrumenter::isFor(llvm::StringRef OtherFileName,
+                                    llvm::ArrayRef<std::string> OtherArgs,
+                                    InstrumenterMode OtherMode) const {
+  return FileName == OtherFileName && Args == OtherArgs && Mode == OtherMode;
+}
+
+llvm::Expected<InstrumentedFile>
+IncrementalInstrumenter::instrument(llvm::StringRef Code) {
+  if (IgnoreFunctionsWithMacros != getIgnoreFunctionsWithMacros()) {
+    IgnoreFunctionsWithMacros = getIgnoreFunctionsWithMacros();
+    Cache.clear();
+  }
+
+  Diagnostics.clear();
+  auto MakeError = [&](llvm::StringRef Message) {
+    DiagnosticsOS.flush();
+    return llvm::make_error<llvm::StringError>(
+        Diagnostics.empty() ? Message : Diagnostics,
+        llvm::inconvertibleErrorCode());
+  };
+
+  // The ASTUnit takes the ownership of the remapped buffers.
+  ASTUnit::RemappedFile Remapped{
+      FileName,
+      llvm::MemoryBuffer::getMemBufferCopy(Code, FileName).release()};
+  bool Failed = false;
+  if (!AST) {
+    std::vector<const char *> CommandLine{"program-markers", "-fsyntax-only"};
+    for (const auto &Arg : Args)
+      CommandLine.push_back(Arg.c_str());
+    CommandLine.push_back(FileName.c_str());
+    // ASTUnit ignores the -resource-dir in the arguments, the resource
+    // directory is thus passed explicitly.
+    AST.reset(ASTUnit::LoadFromCommandLine(
+        CommandLine.data(), CommandLine.data() + CommandLine.size(),
+        PCHContainerOps, Diags, getResourceDirectory(Args),
+        /*OnlyLocalDecls=*/false, CaptureDiagsKind::None, Remapped,
+        /*RemappedFilesKeepOriginalName=*/true,
+        /*PrecompilePreambleAfterNParses=*/1));
+    Failed = !AST;
+  } else {
+    Failed = AST->Reparse(PCHContainerOps, Remapped);
+  }
+  if (Failed || AST->getDiagnostics().hasErrorOccurred())
+    return MakeError("instrumentation failed");
+
+  auto &Context = AST->getASTContext();
+  auto &SM = AST->getSourceManager();
+  auto MainFileID = SM.getMainFileID();
+  auto Text = SM.getBufferData(MainFileID);
+  ContextCaches Caches(Context);
+  restrictTraversalScopeToMainFile(Context);
+  restrictTraversalScopeToEligibleFunctions(Context);
+
+  std::map<std::string, tooling::Replacements> FileToReplacements;
+  auto Instr = makeInstrumenter(Mode, FileToReplacements);
+  std::map<std::string, std::unique_ptr<CachedDecl>> NewCache;
+  NumMatched = NumReused = 0;
+  // With --lines, the markers of a declaration depend on its lines.
+  auto KeyHasLines = !getSelectedLines().empty();
+  for (auto *D : Context.getTraversalScope()) {
+    auto Range = Lexer::makeFileCharRange(
+        CharSourceRange::getTokenRange(D->getSourceRange()), SM,
+        AST->getLangOpts());
+    std::optional<std::string> Key;
+    unsigned Begin = 0, End = 0;
+    if (Range.isValid()) {
+      Begin = SM.getFileOffset(Range.getBegin());
+      End = SM.getFileOffset(Range.getEnd());
+      Key = Text.substr(Begin, End - Begin).str() + '\0' +
+            getDependencies(*D, Range, *AST);
+      if (KeyHasLines)
+        *Key += '\0' + std::to_string(SM.getLineNumber(MainFileID, Begin)) +
+                '-' + std::to_string(SM.getLineNumber(MainFileID, End));
+    }
+
+    if (Key)
+      if (auto It = Cache.find(*Key); It != Cache.end()) {
+        auto &Cached = It->second;
+        Instr->appendMoved(*Cached->Instr,
+                           static_cast<long>(Begin) - Cached->Offset);
+        NewCache[*Key] = std::move(Cached);
+        Cache.erase(It);
+        ++NumReused;
+        continue;
+      }
+
+    auto Matched = std::make_unique<CachedDecl>();
+    Matched->Offset = Begin;
+    Matched->Instr = makeInstrumenter(Mode, Matched->Unused);
+    MatchFinder Finder;
+    Matched->Instr->registerMatchers(Finder);
+    matchStatements(Finder, D, Context);
+    NextMarkerID += Matched->Instr->numberMarkers(NextMarkerID);
+    Instr->appendMoved(*Matched->Instr, 0);
+    ++NumMatched;
+    // The edits are reused when the declaration moves, which is only correct
+    // for edits within the declaration, e.g., not in the macros it expands.
+    if (Key && !NewCache.count(*Key) && Matched->Instr->editsWithin(Begin, End))
+      NewCache[*Key] = std::move(Matched);
+  }
+  Cache = std::move(NewCache);
+
+  Instr->sortMarkersByID();
+  Instr->setDirectiveStyle(getDirectiveStyle(AST->getLangOpts()));
+  Instr->applyReplacements();
+  Rewriter Rewrite(SM, AST->getLangOpts());
+  for (const auto &[File, Replaces] : FileToReplacements)
+    if (!tooling::applyAllReplacements(Replaces, Rewrite))
+      return MakeError("failed to apply the markers");
+
+  InstrumentedFile Result;
+  Result.File = FileName;
+  if (const auto *Buffer = Rewrite.getRewriteBufferFor(MainFileID))
+    Result.Code = std::string(Buffer->begin(), Buffer->end());
+  else
+    Result.Code = Text.str();
+  if (const auto *MainFile = SM.getFileEntryForID(MainFileID)) {
+    Result.Markers = Instr->getMarkerNames(std::string(MainFile->getName()));
+    Result.Manifest = Instr->getMarkers(std::string(MainFile->getName()));
+    if (!DirectivesOutput.empty())
+      Result.Directives =
+          Instr->getMarkerDirectives(std::string(MainFile->getName()));
+  }
+  for (auto &Marker : Result.Manifest) {
+    Marker.Line = SM.getLineNumber(MainFileID, Marker.Offset);
+    Marker.Column = SM.getColumnNumber(MainFileID, Marker.Offset);
+  }
+  return std::move(Result);
+}
+
+} // namespace markers
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <clang/Basic/Diagnostic.h>
+#include <clang/Frontend/ASTUnit.h>
+#include <clang/Frontend/TextDiagnosticPrinter.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Instrumentation.h"
+
+namespace markers {
+
+// Re-instruments successive versions of one program, e.g., in the loop of a
+// reducer or a mutator. The program is kept in a reparsable ASTUnit whose
+// preamble (the leading #includes) is precompiled once, and only the
+// top-level declarations that changed since the previous version are matched
+// again. A declaration is compared by its text, by the definitions of the
+// macros it names, by the canonical types of the declarations it uses and,
+// with --lines, by its lines. The edits of the unchanged declarations are
+// reused and their markers keep their IDs, new markers get IDs that were never
+// used before.
+class IncrementalInstrumenter {
+public:
+  IncrementalInstrumenter(std::string FileName, std::vector<std::string> Args,
+                          InstrumenterMode Mode);
+  ~IncrementalInstrumenter();
+
+  // Instruments Code as the next version of the program. On failure the error
+  // message contains the compiler diagnostics.
+  llvm::Expected<InstrumentedFile> instrument(llvm::StringRef Code);
+  // Forgets the previous versions, the next version is parsed and matched
+  // from scratch and its markers are numbered from 0.
+  void reset();
+
+  // Whether this instrumenter was created with these arguments.
+  bool isFor(llvm::StringRef FileName, llvm::ArrayRef<std::string> Args,
+             InstrumenterMode Mode) const;
+
+  // The number of top-level declarations that the last call matched and
+  // reused.
+  unsigned getNumMatched() const { return NumMatched; }
+  unsigned getNumReused() const { return NumReused; }
+
+private:
+  struct CachedDecl;
+
+  std::string FileName;
+  std::vector<std::string> Args;
+  InstrumenterMode Mode;
+
+  std::string Diagnostics;
+  llvm::raw_string_ostream DiagnosticsOS;
+  std::unique_ptr<clang::TextDiagnosticPrinter> DiagnosticPrinter;
+  llvm::IntrusiveRefCntPtr<clang::DiagnosticsEngine> Diags;
+  std::shared_ptr<clang::PCHContainerOperations> PCHContainerOps;
+  std::unique_ptr<clang::ASTUnit> AST;
+
+  // The declarations of the previous version, keyed by their text and their
+  // dependencies.
+  std::map<std::string, std::unique_ptr<CachedDecl>> Cache;
+  // The rules, and thus the cached edits, depend on this setting.
+  bool IgnoreFunctionsWithMacros;
+  // The ID of the next new marker, which only grows until reset(), so the IDs
+  // of a long session get large and sparse.
+  size_t NextMarkerID = 0;
+  unsigned NumMatched = 0;
+  unsigned NumReused = 0;
+};
+
+} // namespace markers
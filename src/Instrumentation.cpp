@@ -0,0 +1,407 @@
+#include "Instrumentation.h"
+
+#include <clang/AST/ASTConsumer.h>
+#include <clang/ASTMatchers/ASTMatchFinder.h>
+#include <clang/Basic/DiagnosticFrontend.h>
+#include <clang/Driver/Driver.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/FrontendAction.h>
+#include <clang/Frontend/TextDiagnosticPrinter.h>
+#include <clang/Rewrite/Core/Rewriter.h>
+#include <clang/Tooling/Core/Replacement.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <optional>
+
+#include "CommandLine.h"
+#include "ContextCache.h"
+#include "DCEAndValueRangeInstrumenter.h"
+#include "DCEInstrumenter.h"
+#include "Matchers.h"
+#include "PreambleCache.h"
+#include "ShardedMatching.h"
+#include "TraversalScope.h"
+#include "ValueRangeInstrumenter.h"
+
+using namespace clang;
+using namespace clang::ast_matchers;
+
+namespace markers {
+
+namespace {
+
+// The in-memory sources are never removed from the file system, so the file
+// manager is recreated after this many of them.
+constexpr unsigned FilesPerFileManager = 1000;
+
+class InstrumentationConsumer : public ASTConsumer {
+public:
+  // Instruments with Shared, if it is not null, and otherwise with a fresh
+  // instrumenter. Preamble is the original preamble of the main file if it
+  // was blanked out by usePreamblePCH.
+  InstrumentationConsumer(CompilerInstance &CI, InstrumenterMode Mode,
+                          Instrumenter *Shared,
+                          const InstrumentedFileConsumer &Consumer,
+                          std::string Preamble)
+      : CI{CI}, Mode{Mode},
+        OwnedInstr{Shared ? nullptr
+                          : makeInstrumenter(Mode, FileToReplacements)},
+        Instr{Shared ? *Shared : *OwnedInstr}, Consumer{Consumer},
+        Preamble{std::move(Preamble)} {
+    Instr.clear();
+    if (TimePhases) {
+      Times = &Result.Times;
+      // The AST is parsed between the creation of the consumer and the call
+      // of HandleTranslationUnit.
+      ParseTimer.emplace(Times, Phase::Parse);
+    }
+    Instr.setPhaseTimes(Times);
+  }
+
+  void HandleTranslationUnit(ASTContext &Context) override {
+    ParseTimer.reset();
+    ContextCaches Caches(Context);
+    {
+      ScopedPhaseTimer Timer(Times, Phase::Matching);
+      restrictTraversalScopeToMainFile(Context);
+      restrictTraversalScopeToEligibleFunctions(Context);
+      if (ProfileMatchers) {
+        matchProfiled(Context);
+      } else if (MatchThreads != 1 && !PrintStats) {
+        matchSharded(CI, Context, MatchThreads, Mode, Instr);
+      } else {
+        MatchFinder Finder;
+        Instr.registerMatchers(Finder);
+        Finder.matchAST(Context);
+      }
+    }
+    // The edits are collected during matching.
+    if (Times)
+      Times->subtract(Phase::Matching, Times->get(Phase::EditCollection));
+    auto &Diags = Context.getDiagnostics();
+    if (Diags.hasErrorOccurred())
+      return;
+
+    {
+      ScopedPhaseTimer Timer(Times, Phase::ReplacementMerging);
+      Instr.sampleMarkers(SampleRate, SampleSeed, MaxMarkers);
+      if (Numbering == MarkerNumbering::Position)
+        Instr.numberMarkersByPosition();
+      Instr.setDirectiveStyle(getDirectiveStyle(Context.getLangOpts()));
+      Instr.applyReplacements();
+    }
+    if (PrintStats) {
+      collectASTStats(Context, Result.Stats);
+      for (const auto &[Rule, NumMatches] : Instr.getNumMatchesPerRule())
+        Result.Stats.RuleMatches[Rule] = NumMatches;
+      for (const auto &[File, Replaces] : Instr.getReplacements()) {
+        Result.Stats.NumReplacements += Replaces.size();
+        for (const auto &R : Replaces)
+          Result.Stats.ReplacementBytes += R.getReplacementText().size();
+      }
+    }
+
+    std::optional<ScopedPhaseTimer> RewritingTimer;
+    RewritingTimer.emplace(Times, Phase::Rewriting);
+    auto &SM = Context.getSourceManager();
+    Rewriter Rewrite(SM, Context.getLangOpts());
+    for (const auto &[File, Replaces] : Instr.getReplacements())
+      if (!tooling::applyAllReplacements(Replaces, Rewrite)) {
+        Diags.Report(Diags.getCustomDiagID(
+            DiagnosticsEngine::Error, "failed to apply the markers to '%0'"))
+            << File;
+        return;
+      }
+
+    auto MainFileID = SM.getMainFileID();
+    if (!Preamble.empty())
+      Rewrite.ReplaceText(SM.getLocForStartOfFile(MainFileID), Preamble.size(),
+                          Preamble);
+    const auto *MainFile = SM.getFileEntryForID(MainFileID);
+    if (!MainFile)
+      return;
+    Result.File = std::string(MainFile->tryGetRealPathName());
+    if (Result.File.empty())
+      Result.File = std::string(MainFile->getName());
+    if (const auto *Buffer = Rewrite.getRewriteBufferFor(MainFileID))
+      Result.Code = std::string(Buffer->begin(), Buffer->end());
+    else
+      Result.Code = std::string(SM.getBufferData(MainFileID));
+    Result.Markers = Instr.getMarkerNames(std::string(MainFile->getName()));
+    Result.Manifest = Instr.getMarkers(std::string(MainFile->getName()));
+    if (!DirectivesOutput.empty())
+      Result.Directives =
+          Instr.getMarkerDirectives(std::string(MainFile->getName()));
+    for (auto &Marker : Result.Manifest) {
+      Marker.Line = SM.getLineNumber(MainFileID, Marker.Offset);
+      Marker.Column = SM.getColumnNumber(MainFileID, Marker.Offset);
+    }
+    RewritingTimer.reset();
+    if (PrintStats)
+      Result.Stats.PeakRSS = getPeakRSS();
+    Consumer(std::move(Result));
+  }
+
+private:
+  // Matches with the profile of the MatchFinder, which covers one call of
+  // matchAST.
+  void matchProfiled(ASTContext &Context) {
+    llvm::StringMap<llvm::TimeRecord> Records;
+    MatchFinder::MatchFinderOptions Options;
+    Options.CheckProfiling.emplace(Records);
+    {
+      MatchFinder Finder(std::move(Options));
+      Instr.registerMatchers(Finder);
+      Finder.matchAST(Context);
+    }
+    for (const auto &Record : Records)
+      Result.Profile.Entries[Record.getKey().str()].Time += Record.getValue();
+    for (const auto &[Name, NumMatches] : Instr.getNumMatchesPerHandler())
+      Result.Profile.Entries[Name].NumMatches += NumMatches;
+  }
+
+  CompilerInstance &CI;
+  InstrumenterMode Mode;
+  std::map<std::string, tooling::Replacements> FileToReplacements;
+  std::unique_ptr<Instrumenter> OwnedInstr;
+  Instrumenter &Instr;
+  const InstrumentedFileConsumer &Consumer;
+  std::string Preamble;
+  InstrumentedFile Result;
+  PhaseTimes *Times = nullptr;
+  std::optional<ScopedPhaseTimer> ParseTimer;
+};
+
+class InstrumentationAction : public ASTFrontendAction {
+public:
+  InstrumentationAction(InstrumenterMode Mode, Instrumenter *Shared,
+                        const InstrumentedFileConsumer &Consumer,
+                        bool UsePreambleCache)
+      : Mode{Mode}, Shared{Shared}, Consumer{Consumer},
+        UsePreambleCache{UsePreambleCache} {}
+
+protected:
+  bool BeginInvocation(CompilerInstance &CI) override {
+    if (UsePreambleCache && !PreambleCacheDirectory.empty())
+      if (auto Original = usePreamblePCH(CI, PreambleCacheDirectory))
+        Preamble = std::move(*Original);
+    return true;
+  }
+
+  std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI,
+                                                 StringRef) override {
+    return std::make_unique<InstrumentationConsumer>(CI, Mode, Shared,
+                                                     Consumer, Preamble);
+  }
+
+private:
+  InstrumenterMode Mode;
+  Instrumenter *Shared;
+  const InstrumentedFileConsumer &Consumer;
+  bool UsePreambleCache;
+  std::string Preamble;
+};
+
+// Forwards the diagnostics to Forward, except the errors of loading a PCH,
+// which are only recorded.
+class PCHErrorFilter : public DiagnosticConsumer {
+public:
+  explicit PCHErrorFilter(DiagnosticConsumer &Forward) : Forward{Forward} {}
+
+  void BeginSourceFile(const LangOptions &LangOpts,
+                       const Preprocessor *PP) override {
+    Forward.BeginSourceFile(LangOpts, PP);
+  }
+  void EndSourceFile() override { Forward.EndSourceFile(); }
+  void finish() override { Forward.finish(); }
+
+  void HandleDiagnostic(DiagnosticsEngine::Level Level,
+                        const Diagnostic &Info) override {
+    auto ID = Info.getID();
+    if (Level >= DiagnosticsEngine::Error &&
+        ((ID >= diag::DIAG_START_SERIALIZATION && ID < diag::DIAG_START_LEX) ||
+         ID == diag::err_fe_unable_to_load_pch)) {
+      PCHFailed = true;
+      return;
+    }
+    DiagnosticConsumer::HandleDiagnostic(Level, Info);
+    Forward.HandleDiagnostic(Level, Info);
+  }
+
+  bool hasPCHFailed() const { return PCHFailed; }
+
+private:
+  DiagnosticConsumer &Forward;
+  bool PCHFailed = false;
+};
+
+class InstrumentationActionFactory : public tooling::FrontendActionFactory {
+public:
+  InstrumentationActionFactory(InstrumenterMode Mode, Instrumenter *Shared,
+                               InstrumentedFileConsumer Consumer,
+                               bool UsePreambleCache = true)
+      : Mode{Mode}, Shared{Shared}, Consumer{std::move(Consumer)},
+        UsePreambleCache{UsePreambleCache} {}
+
+  std::unique_ptr<FrontendAction> create() override {
+    return std::make_unique<InstrumentationAction>(Mode, Shared, Consumer,
+                                                   UsePreambleCache);
+  }
+
+  // With --preamble-cache, a file whose preamble PCH cannot be loaded, e.g.,
+  // as it was replaced while in use, is parsed again without it.
+  bool runInvocation(std::shared_ptr<CompilerInvocation> Invocation,
+                     FileManager *Files,
+                     std::shared_ptr<PCHContainerOperations> PCHContainerOps,
+                     DiagnosticConsumer *DiagConsumer) override {
+    if (!UsePreambleCache || PreambleCacheDirectory.empty())
+      return FrontendActionFactory::runInvocation(
+          std::move(Invocation), Files, std::move(PCHContainerOps),
+          DiagConsumer);
+
+    std::optional<TextDiagnosticPrinter> Printer;
+    if (!DiagConsumer)
+      DiagConsumer = &Printer.emplace(llvm::errs(),
+                                      &Invocation->getDiagnosticOpts());
+    PCHErrorFilter Filter(*DiagConsumer);
+    bool Success = FrontendActionFactory::runInvocation(
+        std::make_shared<CompilerInvocation>(*Invocation), Files,
+        PCHContainerOps, &Filter);
+    if (!Filter.hasPCHFailed())
+      return Success;
+    return InstrumentationActionFactory(Mode, Shared, Consumer,
+                                        /*UsePreambleCache=*/false)
+        .runInvocation(std::move(Invocation), Files,
+                       std::move(PCHContainerOps), DiagConsumer);
+  }
+
+private:
+  InstrumenterMode Mode;
+  Instrumenter *Shared;
+  InstrumentedFileConsumer Consumer;
+  bool UsePreambleCache;
+};
+
+} // namespace
+
+std::unique_ptr<Instrumenter> makeInstrumenter(
+    InstrumenterMode Mode,
+    std::map<std::string, tooling::Replacements> &FileToReplacements) {
+  switch (Mode) {
+  case InstrumenterMode::DCE:
+    return std::make_unique<DCEInstrumenter>(FileToReplacements);
+  case InstrumenterMode::VR:
+    return std::make_unique<ValueRangeInstrumenter>(FileToReplacements);
+  case InstrumenterMode::DCEAndVR:
+    return std::make_unique<DCEAndValueRangeInstrumenter>(FileToReplacements);
+  }
+  llvm_unreachable("Unknown InstrumenterMode");
+}
+
+std::optional<InstrumenterMode> parseInstrumenterMode(llvm::StringRef Name) {
+  if (Name == "dce")
+    return InstrumenterMode::DCE;
+  if (Name == "vr")
+    return InstrumenterMode::VR;
+  if (Name == "dce,vr")
+    return InstrumenterMode::DCEAndVR;
+  return std::nullopt;
+}
+
+std::unique_ptr<tooling::FrontendActionFactory>
+newInstrumentationActionFactory(InstrumenterMode Mode,
+                                InstrumentedFileConsumer Consumer) {
+  return std::make_unique<InstrumentationActionFactory>(Mode, nullptr,
+                                                        std::move(Consumer));
+}
+
+std::unique_ptr<tooling::FrontendActionFactory>
+newInstrumentationActionFactory(InstrumenterMode Mode, Instrumenter &Instr,
+                                InstrumentedFileConsumer Consumer) {
+  return std::make_unique<InstrumentationActionFactory>(Mode, &Instr,
+                                                        std::move(Consumer));
+}
+
+std::string getResourceDirectory(llvm::ArrayRef<std::string> Args) {
+  for (size_t I = 0; I < Args.size(); ++I) {
+    StringRef Arg = Args[I];
+    if (Arg.consume_front("-resource-dir="))
+      return Arg.str();
+    if (Arg == "-resource-dir" && I + 1 < Args.size())
+      return Args[I + 1];
+  }
+  static int StaticSymbol;
+  auto NextToExecutable = driver::Driver::GetResourcesPath(
+      llvm::sys::fs::getMainExecutable("program-markers", &StaticSymbol));
+  if (llvm::sys::fs::is_directory(NextToExecutable))
+    return NextToExecutable;
+  return PROGRAM_MARKERS_RESOURCE_DIR;
+}
+
+CodeInstrumenter::CodeInstrumenter() { resetFileManager(); }
+
+void CodeInstrumenter::resetFileManager() {
+  InMemoryFS = new llvm::vfs::InMemoryFileSystem;
+  llvm::IntrusiveRefCntPtr<llvm::vfs::OverlayFileSystem> OverlayFS =
+      new llvm::vfs::OverlayFileSystem(llvm::vfs::getRealFileSystem());
+  OverlayFS->pushOverlay(InMemoryFS);
+  Files = new FileManager(FileSystemOptions(), OverlayFS);
+}
+
+llvm::Expected<InstrumentedFile>
+CodeInstrumenter::instrument(llvm::StringRef Code, llvm::StringRef FileName,
+                             llvm::ArrayRef<std::string> Args,
+                             InstrumenterMode Mode,
+                             const CodeInstrumenterOptions &Options) {
+  if (NumInstrumented != 0 && NumInstrumented % FilesPerFileManager == 0)
+    resetFileManager();
+
+  // The file manager caches file entries by path, every source thus gets a
+  // fresh one.
+  auto Path = ("/program-markers/" + llvm::Twine(NumInstrumented++) + "/" +
+               llvm::sys::path::filename(FileName))
+                  .str();
+  InMemoryFS->addFile(Path, 0,
+                      llvm::MemoryBuffer::getMemBufferCopy(Code, Path));
+
+  // Unlike ClangTool, ToolInvocation does not add the resource directory, the
+  // builtin headers, e.g., <stddef.h>, are not found without it.
+  std::vector<std::string> CommandLine{
+      "program-markers", "-fsyntax-only",
+      "-resource-dir=" + getResourceDirectory(Args)};
+  CommandLine.insert(CommandLine.end(), Args.begin(), Args.end());
+  CommandLine.push_back(Path);
+
+  // The rules read the setting when they are created and when they run.
+  ScopedIgnoreFunctionsWithMacros IgnoreFunctionsWithMacros(
+      Options.IgnoreFunctionsWithMacros.value_or(
+          getIgnoreFunctionsWithMacros()));
+  auto &Reused = Instrumenters[{Mode, getIgnoreFunctionsWithMacros()}];
+  if (!Reused.Instr)
+    Reused.Instr = makeInstrumenter(Mode, Reused.FileToReplacements);
+  Reused.Instr->setNoPreprocessorDirectives(Options.NoPreprocessorDirectives);
+  std::optional<InstrumentedFile> Result;
+  auto Factory = newInstrumentationActionFactory(
+      Mode, *Reused.Instr,
+      [&](InstrumentedFile File) { Result = std::move(File); });
+
+  std::string Diagnostics;
+  llvm::raw_string_ostream DiagnosticsOS(Diagnostics);
+  IntrusiveRefCntPtr<DiagnosticOptions> DiagOpts = new DiagnosticOptions();
+  TextDiagnosticPrinter DiagnosticPrinter(DiagnosticsOS, &*DiagOpts);
+  // The factory, unlike a single action, falls back to parsing without the
+  // preamble PCH.
+  tooling::ToolInvocation Invocation(std::move(CommandLine), Factory.get(),
+                                     Files.get());
+  Invocation.setDiagnosticConsumer(&DiagnosticPrinter);
+  if (!Invocation.run() || !Result) {
+    DiagnosticsOS.flush();
+    return llvm::make_error<llvm::StringError>(
+        Diagnostics.empty() ? "instrumentation failed" : Diagnostics,
+        llvm::inconvertibleErrorCode());
+  }
+  Result->File = std::string(FileName);
+  return std::move(*Result);
+}
+
+} // namespace markers
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <clang/Basic/FileManager.h>
+#include <clang/Tooling/Tooling.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/VirtualFileSystem.h>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "ASTEdits.h"
+#include "Instrumenter.h"
+#include "PhaseTimes.h"
+#include "Statistics.h"
+
+namespace markers {
+
+enum class InstrumenterMode { DCE, VR, DCEAndVR };
+
+// Parses "dce", "vr" or "dce,vr".
+std::optional<InstrumenterMode> parseInstrumenterMode(llvm::StringRef Name);
+
+std::unique_ptr<Instrumenter> makeInstrumenter(
+    InstrumenterMode Mode,
+    std::map<std::string, clang::tooling::Replacements> &FileToReplacements);
+
+// The instrumented main file of one translation unit.
+struct InstrumentedFile {
+  std::string File;
+  std::string Code;
+  std::vector<std::string> Markers;
+  // The details of each marker, ordered by ID.
+  std::vector<MarkerInfo> Manifest;
+  // The directives of the markers, only set with --directives-out, in which
+  // case they are not part of Code.
+  std::string Directives;
+  // Only recorded with --time-phases.
+  PhaseTimes Times;
+  // Only recorded with --print-stats.
+  InstrumentationStats Stats;
+  // Only recorded with --profile-matchers.
+  MatcherProfile Profile;
+};
+
+using InstrumentedFileConsumer = std::function<void(InstrumentedFile)>;
+
+// Each action created by this factory instruments the main file of its
+// translation unit with a fresh instrumenter, i.e., marker IDs are per file,
+// and passes the result to Consumer. The actions share no state and can run
+// concurrently (e.g., via an AllTUsToolExecutor), in which case Consumer must
+// be thread-safe.
+std::unique_ptr<clang::tooling::FrontendActionFactory>
+newInstrumentationActionFactory(InstrumenterMode Mode,
+                                InstrumentedFileConsumer Consumer);
+
+// Like the above, but all actions reuse Instr, which must have been created
+// for Mode, instead of building the rules for every translation unit. The
+// actions must thus not run concurrently.
+std::unique_ptr<clang::tooling::FrontendActionFactory>
+newInstrumentationActionFactory(InstrumenterMode Mode, Instrumenter &Instr,
+                                InstrumentedFileConsumer Consumer);
+
+// The resource directory, which holds the builtin headers of clang, for a
+// compilation with Args: the one of the arguments, else the one next to the
+// executable, as done by ClangTool, if it exists, and else the one of the
+// clang the instrumenter was built with.
+std::string getResourceDirectory(llvm::ArrayRef<std::string> Args);
+
+// The settings of a single CodeInstrumenter::instrument call, unset ones take
+// the value of their command line option.
+struct CodeInstrumenterOptions {
+  std::optional<bool> IgnoreFunctionsWithMacros;
+  std::optional<bool> NoPreprocessorDirectives;
+};
+
+// Instruments source code held in memory. The file manager, and with it the
+// cached state of the included headers, and the rules of each mode are shared
+// by all calls, so one CodeInstrumenter should be reused for many programs.
+class CodeInstrumenter {
+public:
+  CodeInstrumenter();
+
+  // Instruments Code as the contents of a file named FileName (which selects
+  // the language), compiled with Args. On failure the error message contains
+  // the compiler diagnostics.
+  llvm::Expected<InstrumentedFile>
+  instrument(llvm::StringRef Code, llvm::StringRef FileName,
+             llvm::ArrayRef<std::string> Args, InstrumenterMode Mode,
+             const CodeInstrumenterOptions &Options = {});
+
+private:
+  void resetFileManager();
+
+  llvm::IntrusiveRefCntPtr<llvm::vfs::InMemoryFileSystem> InMemoryFS;
+  llvm::IntrusiveRefCntPtr<clang::FileManager> Files;
+  unsigned NumInstrumented = 0;
+
+  struct ReusedInstrumenter {
+    std::map<std::string, clang::tooling::Replacements> FileToReplacements;
+    std::unique_ptr<Instrumenter> Instr;
+  };
+  // The rules depend on the mode and on IgnoreFunctionsWithMacros (the other
+  // filters of Matchers.h are only set on the command line).
+  std::map<std::pair<InstrumenterMode, bool>, ReusedInstrumenter> Instrumenters;
+};
+
+} // namespace markers
@@ -0,0 +1,380 @@
+#include "Instrumenter.h"
+
+#include <algorithm>
+#include <numeric>
+#include <tuple>
+
+#include <llvm/Support/xxhash.h>
+
+#include "CommandLine.h"
+#include "DCEInstrumenter.h"
+#include "ValueRangeInstrumenter.h"
+
+using namespace clang;
+using namespace clang::tooling;
+
+namespace markers {
+
+std::string makeMarkerName(MarkerKind Kind, size_t MarkerID) {
+  switch (Kind) {
+  case MarkerKind::DCE:
+    return "DCEMarker" + std::to_string(MarkerID) + "_";
+  case MarkerKind::VR:
+    return "VRMarker" + std::to_string(MarkerID) + "_";
+  }
+  llvm_unreachable("Unknown MarkerKind");
+}
+
+std::string makeMarkerDirectives(MarkerKind Kind, size_t MarkerID) {
+  switch (Kind) {
+  case MarkerKind::DCE:
+    return DCEInstrumenter::makeMarkerMacros(MarkerID);
+  case MarkerKind::VR:
+    return ValueRangeInstrumenter::makeMarkerMacros(MarkerID);
+  }
+  llvm_unreachable("Unknown MarkerKind");
+}
+
+DirectiveStyle getDirectiveStyle(const clang::LangOptions &LangOpts) {
+  if (Directives == DirectiveStyle::Compact && !LangOpts.C99 &&
+      !LangOpts.CPlusPlus11)
+    return DirectiveStyle::Full;
+  return Directives;
+}
+
+std::string makeMarkerDirectiveBlock(const std::vector<MarkerInfo> &Markers,
+                                     DirectiveStyle Style) {
+  std::string Block = "//MARKERS START\n";
+  if (Style == DirectiveStyle::Full) {
+    for (const auto &Marker : Markers)
+      Block += makeMarkerDirectives(Marker.Kind, Marker.ID);
+    return Block + "//MARKERS END\n";
+  }
+
+  // MARKERS_IS_SET(X) is 1 if X is defined as 1 and 0 otherwise: the probe
+  // only expands to two arguments, moving the 1 into the second position, if
+  // X expands to 1.
+  Block += "#define MARKERS_CAT_(A, B) A##B\n"
+           "#define MARKERS_CAT(A, B) MARKERS_CAT_(A, B)\n"
+           "#define MARKERS_SECOND_(A, B, ...) B\n"
+           "#define MARKERS_PROBE_1 ~, 1\n"
+           "#define MARKERS_IS_SET_(X) MARKERS_SECOND_(X, 0, ~)\n"
+           "#define MARKERS_IS_SET(X) "
+           "MARKERS_IS_SET_(MARKERS_CAT(MARKERS_PROBE_, X))\n"
+           "#define MARKERS_IF_0(T, F) F\n"
+           "#define MARKERS_IF_1(T, F) T\n"
+           "#define MARKERS_IF(C, T, F) MARKERS_CAT(MARKERS_IF_, C)(T, F)\n";
+  auto HasKind = [&](MarkerKind Kind) {
+    return std::any_of(Markers.begin(), Markers.end(),
+                       [&](const MarkerInfo &M) { return M.Kind == Kind; });
+  };
+  if (HasKind(MarkerKind::DCE))
+    Block += DCEInstrumenter::makeDispatchMacro();
+  if (HasKind(MarkerKind::VR))
+    Block += ValueRangeInstrumenter::makeDispatchMacro();
+  for (const auto &Marker : Markers)
+    Block += Marker.Kind == MarkerKind::DCE
+                 ? DCEInstrumenter::makeCompactMarkerMacros(Marker.ID)
+                 : ValueRangeInstrumenter::makeCompactMarkerMacros(Marker.ID);
+  return Block + "//MARKERS END\n";
+}
+
+llvm::json::Value toJSON(const MarkerInfo &Info) {
+  llvm::json::Object Object{
+      {"kind", Info.Kind == MarkerKind::DCE ? "dce" : "vr"},
+      {"id", static_cast<int64_t>(Info.ID)},
+      {"name", makeMarkerName(Info.Kind, Info.ID)},
+      {"offset", Info.Offset},
+      {"line", Info.Line},
+      {"column", Info.Column},
+      {"function", Info.Function}};
+  if (Info.Kind == MarkerKind::VR) {
+    Object["variable"] = Info.Variable;
+    Object["type"] = Info.Type;
+  }
+  return Object;
+}
+
+namespace {
+
+// The finalizer of SplitMix64, whose output is stable across platforms and
+// runs, unlike llvm::hash_combine.
+uint64_t mix(uint64_t X) {
+  X = (X ^ (X >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  X = (X ^ (X >> 27)) * 0x94d049bb133111ebULL;
+  return X ^ (X >> 31);
+}
+
+// A uniform number in [0, 1) determined by Seed and the position of Marker.
+double sampleKey(uint64_t Seed, const MarkerInfo &Marker) {
+  auto Key = mix(Seed);
+  for (uint64_t Field : {uint64_t{Marker.Offset}, uint64_t{Marker.RuleRank},
+                         uint64_t{Marker.MatchOffset},
+                         llvm::xxHash64(Marker.Variable)})
+    Key = mix(Key ^ Field);
+  return (Key >> 11) * 0x1.0p-53;
+}
+
+// Orders the markers of a file by their position. Only markers with the same
+// fields compare equal, so the order of distinct markers does not depend on
+// the order in which they were collected.
+bool isBeforeInPosition(const MarkerInfo &A, const MarkerInfo &B) {
+  auto Key = [](const MarkerInfo &M) {
+    return std::tie(M.Offset, M.RuleRank, M.MatchOffset, M.Kind, M.Variable,
+                    M.Type, M.Function);
+  };
+  return Key(A) < Key(B);
+}
+
+} // namespace
+
+Instrumenter::Instrumenter(
+    std::map<std::string, clang::tooling::Replacements> &FileToReplacements)
+    : FileToReplacements{FileToReplacements}, Style{Directives} {}
+
+void Instrumenter::addRules(RuleList NewRules,
+                            std::unique_ptr<RuleDispatcher> Dispatcher) {
+  auto &Edits = EditGroups.emplace_back();
+  auto Begin = Rules.size();
+  for (auto &NewRule : NewRules) {
+    Rules.emplace_back(std::move(NewRule.Rule), std::move(NewRule.Name),
+                       Rules.size(), Edits, FileToMarkers);
+    RuleKinds.push_back(NewRule.Kind);
+  }
+  RuleGroups.push_back({Begin, Rules.size(), std::move(Dispatcher)});
+}
+
+std::vector<std::string>
+Instrumenter::getMarkerNames(const std::string &File) const {
+  std::vector<std::string> Names;
+  auto It = FileToMarkers.find(File);
+  if (It == FileToMarkers.end())
+    return Names;
+  for (const auto &Marker : It->second)
+    Names.push_back(makeMarkerName(Marker.Kind, Marker.ID));
+  return Names;
+}
+
+std::vector<MarkerInfo>
+Instrumenter::getMarkers(const std::string &File) const {
+  auto It = FileToMarkers.find(File);
+  if (It == FileToMarkers.end())
+    return {};
+  return It->second;
+}
+
+std::string Instrumenter::getMarkerDirectives(const std::string &File) const {
+  return makeMarkerDirectiveBlock(getMarkers(File), Style);
+}
+
+void Instrumenter::appendMoved(const Instrumenter &Other, long Delta) {
+  assert(EditGroups.size() == Other.EditGroups.size() &&
+         "Instrumenters of different modes");
+  std::map<std::string, size_t> FileToFirstMarker;
+  for (const auto &[File, Markers] : Other.FileToMarkers) {
+    auto &OwnMarkers = FileToMarkers[File];
+    FileToFirstMarker[File] = OwnMarkers.size();
+    for (auto Marker : Markers) {
+      Marker.Offset += Delta;
+      Marker.MatchOffset += Delta;
+      OwnMarkers.push_back(std::move(Marker));
+    }
+  }
+  for (size_t I = 0; I < EditGroups.size(); ++I)
+    for (auto Edit : Other.EditGroups[I]) {
+      const auto &R = Edit.Replacement;
+      auto File = std::string(R.getFilePath());
+      Edit.Replacement = Replacement(File, R.getOffset() + Delta, R.getLength(),
+                                     R.getReplacementText());
+      if (Edit.Metadata)
+        Edit.Marker += FileToFirstMarker[File];
+      EditGroups[I].push_back(std::move(Edit));
+    }
+}
+
+void Instrumenter::reorderMarkers(const std::string &File,
+                                  const std::vector<size_t> &Order) {
+  auto &Markers = FileToMarkers[File];
+  std::vector<MarkerInfo> Reordered;
+  std::vector<size_t> NewIndex(Markers.size());
+  for (auto I : Order) {
+    NewIndex[I] = Reordered.size();
+    Reordered.push_back(std::move(Markers[I]));
+  }
+  Markers = std::move(Reordered);
+
+  for (auto &Edits : EditGroups)
+    for (auto &Edit : Edits)
+      if (Edit.Metadata && Edit.Replacement.getFilePath() == File)
+        Edit.Marker = NewIndex[Edit.Marker];
+}
+
+void Instrumenter::sampleMarkers(double SampleRate, uint64_t Seed,
+                                 size_t MaxMarkers) {
+  if (SampleRate >= 1 && MaxMarkers == 0)
+    return;
+  for (auto &[File, Markers] : FileToMarkers) {
+    std::vector<std::pair<double, size_t>> Candidates;
+    for (size_t I = 0; I < Markers.size(); ++I)
+      if (auto Key = sampleKey(Seed, Markers[I]); Key < SampleRate)
+        Candidates.emplace_back(Key, I);
+    if (MaxMarkers != 0 && Candidates.size() > MaxMarkers) {
+      std::nth_element(Candidates.begin(), Candidates.begin() + MaxMarkers,
+                       Candidates.end());
+      Candidates.resize(MaxMarkers);
+    }
+
+    std::vector<bool> Keep(Markers.size());
+    for (auto [Key, I] : Candidates)
+      Keep[I] = true;
+    for (auto &Edits : EditGroups)
+      for (auto &Edit : Edits) {
+        const auto &R = Edit.Replacement;
+        if (!Edit.Metadata || R.getFilePath() != File || Keep[Edit.Marker])
+          continue;
+        // A VR edit only consists of the marker.
+        if (*Edit.Metadata == EditMetadataKind::VRMarker)
+          Edit.Replacement =
+              Replacement(R.getFilePath(), R.getOffset(), R.getLength(), "");
+        Edit.Metadata.reset();
+      }
+
+    std::vector<size_t> Order;
+    for (size_t I = 0; I < Markers.size(); ++I)
+      if (Keep[I])
+        Order.push_back(I);
+    reorderMarkers(File, Order);
+    for (size_t I = 0; I < Markers.size(); ++I)
+      Markers[I].ID = I;
+  }
+}
+
+void Instrumenter::numberMarkersByPosition() {
+  for (auto &[File, Markers] : FileToMarkers) {
+    std::vector<size_t> Order(Markers.size());
+    std::iota(Order.begin(), Order.end(), 0);
+    std::stable_sort(Order.begin(), Order.end(), [&](size_t L, size_t R) {
+      return isBeforeInPosition(Markers[L], Markers[R]);
+    });
+    reorderMarkers(File, Order);
+    for (size_t I = 0; I < Markers.size(); ++I)
+      Markers[I].ID = I;
+  }
+}
+
+size_t Instrumenter::numberMarkers(size_t FirstID) {
+  auto ID = FirstID;
+  for (auto &[File, Markers] : FileToMarkers)
+    for (auto &Marker : Markers)
+      Marker.ID = ID++;
+  return ID - FirstID;
+}
+
+void Instrumenter::sortMarkersByID() {
+  for (auto &[File, Markers] : FileToMarkers) {
+    std::vector<size_t> Order(Markers.size());
+    std::iota(Order.begin(), Order.end(), 0);
+    std::sort(Order.begin(), Order.end(), [&](size_t L, size_t R) {
+      return Markers[L].ID < Markers[R].ID;
+    });
+    reorderMarkers(File, Order);
+  }
+}
+
+std::map<std::string, size_t> Instrumenter::getNumMatchesPerRule() const {
+  std::map<std::string, size_t> NumMatches;
+  for (size_t I = 0; I < Rules.size(); ++I)
+    NumMatches[getRuleName(RuleKinds[I]).str()] += Rules[I].getNumMatches();
+  return NumMatches;
+}
+
+std::map<std::string, size_t> Instrumenter::getNumMatchesPerHandler() const {
+  std::map<std::string, size_t> NumMatches;
+  for (const auto &Rule : Rules)
+    NumMatches[Rule.getID().str()] += Rule.getNumMatches();
+  return NumMatches;
+}
+
+bool Instrumenter::editsWithin(unsigned Begin, unsigned End) const {
+  for (const auto &Edits : EditGroups)
+    for (const auto &Edit : Edits) {
+      const auto &R = Edit.Replacement;
+      if (R.getOffset() < Begin || R.getOffset() + R.getLength() > End)
+        return false;
+    }
+  return true;
+}
+
+void Instrumenter::applyReplacements() {
+  if (FileToReplacements.size() > 1)
+    llvm_unreachable("Instrumenter only supports one file");
+
+  if (!NoDirectives.value_or(NoPreprocessorDirectives) &&
+      DirectivesOutput.empty())
+    for (const auto &[File, Markers] : FileToMarkers) {
+      auto R =
+          Replacement(File, 0, 0, makeMarkerDirectiveBlock(Markers, Style));
+      if (auto Err = FileToReplacements[File].add(R))
+        llvm_unreachable(llvm::toString(std::move(Err)).c_str());
+    }
+
+  for (auto Git = EditGroups.rbegin(); Git != EditGroups.rend(); ++Git)
+    for (auto Rit = Git->rbegin(); Rit != Git->rend(); ++Rit) {
+      auto R = Rit->Replacement;
+      auto File = std::string(R.getFilePath());
+      if (Rit->Metadata)
+        R = Replacement(
+            File, R.getOffset(), R.getLength(),
+            makeMarkerEditText(*Rit->Metadata, R.getReplacementText(),
+                               FileToMarkers[File][Rit->Marker].ID));
+      // E.g., the edits of the markers dropped by sampleMarkers.
+      if (R.getLength() == 0 && R.getReplacementText().empty())
+        continue;
+      auto &Replacements = FileToReplacements[File];
+      auto Err = Replacements.add(R);
+      if (Err) {
+        auto NewOffset = Replacements.getShiftedCodePosition(R.getOffset());
+        auto NewLength = Replacements.getShiftedCodePosition(R.getOffset() +
+                                                             R.getLength()) -
+                         NewOffset;
+        if (NewLength == R.getLength()) {
+          llvm::consumeError(std::move(Err));
+          R = Replacement(R.getFilePath(), NewOffset, NewLength,
+                          R.getReplacementText());
+          Replacements = Replacements.merge(tooling::Replacements(R));
+        } else {
+          llvm_unreachable(llvm::toString(std::move(Err)).c_str());
+        }
+      }
+    }
+}
+
+void Instrumenter::clear() {
+  for (auto &Edits : EditGroups)
+    Edits.clear();
+  FileToMarkers.clear();
+  FileToReplacements.clear();
+  for (auto &Rule : Rules)
+    Rule.resetNumMatches();
+}
+
+void Instrumenter::setPhaseTimes(PhaseTimes *Times) {
+  for (auto &Rule : Rules)
+    Rule.setPhaseTimes(Times);
+}
+
+void Instrumenter::registerMatchers(clang::ast_matchers::MatchFinder &Finder) {
+  for (auto &Group : RuleGroups) {
+    if (!Group.Dispatcher) {
+      for (size_t I = Group.Begin; I < Group.End; ++I)
+        Rules[I].registerMatchers(Finder);
+      continue;
+    }
+    RuleDispatcher::Collectors Collectors;
+    for (size_t I = Group.Begin; I < Group.End; ++I)
+      Collectors.emplace_back(RuleKinds[I], &Rules[I]);
+    Group.Dispatcher->registerMatchers(Finder, std::move(Collectors));
+  }
+}
+
+} // namespace markers
@@ -0,0 +1,158 @@
+#pragma once
+
+#include "ASTEdits.h"
+#include "CommandLine.h"
+#include "Matchers.h"
+
+#include <llvm/Support/JSON.h>
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <optional>
+
+namespace markers {
+
+// A rule of an instrumenter, the --rules it is selected by and the name of the
+// function that makes it.
+struct InstrumenterRule {
+  RuleKind Kind;
+  std::string Name;
+  clang::transformer::RewriteRule Rule;
+};
+using RuleList = std::vector<InstrumenterRule>;
+
+std::string makeMarkerName(MarkerKind Kind, size_t MarkerID);
+
+std::string makeMarkerDirectives(MarkerKind Kind, size_t MarkerID);
+
+// The --directive-style of a translation unit in the language LangOpts. The
+// compact style needs variadic macros and empty macro arguments, so C89 and
+// C++98 fall back to the full style.
+DirectiveStyle getDirectiveStyle(const clang::LangOptions &LangOpts);
+
+// The block of directives that defines the macros of Markers in Style. The
+// compact style defines the shared macros once and then a short entry per
+// marker, whose macro tests whether the Disable and Unreachable macros of the
+// marker are defined (as 1) when it is expanded instead of in an #if block of
+// its own.
+std::string makeMarkerDirectiveBlock(const std::vector<MarkerInfo> &Markers,
+                                     DirectiveStyle Style);
+
+llvm::json::Value toJSON(const MarkerInfo &Info);
+
+// Decides in code which rules of a group match a node and with which bindings,
+// instead of with the matchers of the rules (--engine=visitor). The matches
+// are passed to the collectors of the rules, so the edits are the same.
+class RuleDispatcher : public clang::ast_matchers::MatchFinder::MatchCallback {
+public:
+  // The collectors of the enabled rules of the group, in their order.
+  using Collectors =
+      std::vector<std::pair<RuleKind, RuleActionEditCollector *>>;
+
+  // Registers the matchers of the nodes that the rules can match, with the
+  // dispatcher as their callback.
+  virtual void registerMatchers(clang::ast_matchers::MatchFinder &Finder,
+                                Collectors RuleCollectors) = 0;
+};
+
+// Common parent of the DCE and VR instrumenters: it owns the rules, collects
+// their edits during matching and turns them into replacements. All rules
+// share one marker ID space per file.
+class Instrumenter {
+public:
+  Instrumenter(
+      std::map<std::string, clang::tooling::Replacements> &FileToReplacements);
+  Instrumenter(Instrumenter &&) = delete;
+  Instrumenter(const Instrumenter &) = delete;
+  virtual ~Instrumenter() = default;
+
+  void registerMatchers(clang::ast_matchers::MatchFinder &Finder);
+  void applyReplacements();
+  // Forgets the collected edits, markers and replacements, so that the rules
+  // can be reused for another translation unit.
+  void clear();
+  const std::map<std::string, clang::tooling::Replacements> &
+  getReplacements() const {
+    return FileToReplacements;
+  }
+  // Records the time spent collecting the edits of the matches.
+  void setPhaseTimes(PhaseTimes *Times);
+  // Overrides --no-preprocessor-directives for the following calls of
+  // applyReplacements, std::nullopt restores the command line option.
+  void setNoPreprocessorDirectives(std::optional<bool> Value) {
+    NoDirectives = Value;
+  }
+  // The style of the directives of the following calls of applyReplacements
+  // and getMarkerDirectives (default: --directive-style).
+  void setDirectiveStyle(DirectiveStyle NewStyle) { Style = NewStyle; }
+
+  // The names of the markers inserted in File, ordered by their IDs.
+  std::vector<std::string> getMarkerNames(const std::string &File) const;
+  // The markers inserted in File, ordered by their IDs.
+  std::vector<MarkerInfo> getMarkers(const std::string &File) const;
+  // The directive block of the markers inserted in File.
+  std::string getMarkerDirectives(const std::string &File) const;
+
+  // Appends the edits and markers collected by Other, which must have been
+  // created for the same mode, moved by Delta bytes. The markers keep their
+  // IDs. Used to reuse the edits of unchanged code.
+  void appendMoved(const Instrumenter &Other, long Delta);
+
+  // Keeps each marker with probability SampleRate and then, if there are more
+  // than MaxMarkers (0: no limit) in a file, a random subset of MaxMarkers.
+  // The choice only depends on Seed and the position of the marker, not on the
+  // matching order. The kept markers are renumbered in their order, the edits
+  // of the dropped ones are kept without the marker, e.g., the braces around
+  // a branch are still inserted.
+  void sampleMarkers(double SampleRate, uint64_t Seed, size_t MaxMarkers);
+
+  // Renumbers the markers of each file by their offset, then by the rank of
+  // their rule and then by their other fields, e.g., the variables of the VR
+  // markers of one statement, so that the IDs do not depend on the order in
+  // which the matches were found (--marker-numbering=position).
+  void numberMarkersByPosition();
+  // Numbers all markers consecutively from FirstID, in the order of the files
+  // and of their collection, and returns the number of markers.
+  size_t numberMarkers(size_t FirstID);
+  // Orders the markers of each file by their IDs, e.g., after appendMoved.
+  void sortMarkersByID();
+
+  // The number of matches of each rule, by the name of the rule.
+  std::map<std::string, size_t> getNumMatchesPerRule() const;
+  // The number of matches of each rule, by the name of its function.
+  std::map<std::string, size_t> getNumMatchesPerHandler() const;
+
+  // Whether all edits are in [Begin, End) of their file.
+  bool editsWithin(unsigned Begin, unsigned End) const;
+
+protected:
+  // Adds a group of rules. Edits of groups added later are merged first,
+  // i.e., when they insert at the same location their text comes first. With
+  // a Dispatcher, the matchers of the rules are not registered.
+  void addRules(RuleList NewRules,
+                std::unique_ptr<RuleDispatcher> Dispatcher = nullptr);
+
+private:
+  // Reorders the markers of File such that the I-th marker is the Order[I]-th
+  // one before.
+  void reorderMarkers(const std::string &File,
+                      const std::vector<size_t> &Order);
+
+  std::map<std::string, clang::tooling::Replacements> &FileToReplacements;
+  std::vector<RuleActionEditCollector> Rules;
+  std::vector<RuleKind> RuleKinds;
+  // The rules [Begin, End) of each group and its dispatcher, if any.
+  struct RuleGroup {
+    size_t Begin;
+    size_t End;
+    std::unique_ptr<RuleDispatcher> Dispatcher;
+  };
+  std::vector<RuleGroup> RuleGroups;
+  std::deque<std::vector<CollectedEdit>> EditGroups;
+  std::map<std::string, std::vector<MarkerInfo>> FileToMarkers;
+  std::optional<bool> NoDirectives;
+  DirectiveStyle Style;
+};
+
+} // namespace markers
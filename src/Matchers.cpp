@@ -1,6 +1,16 @@
 #include "Matchers.h"
 
 #include "CommandLine.h"
+#include "ContextCache.h"
+
+#include <clang/AST/ParentMapContext.h>
+#include <clang/AST/DeclFriend.h>
+#include <clang/AST/DeclTemplate.h>
+#include <llvm/ADT/DenseMap.h>
+
+#include <algorithm>
+#include <map>
+#include <optional>
 
 using namespace clang::ast_matchers;
 
@@ -14,23 +24,462 @@ cl::opt<bool>
                                        "that contain macros (default: false)."),
                               cl::init(false), cl::cat(ProgramMarkersOptions));
 
+// Only accepts valid regular expressions.
+struct RegexParser : public cl::parser<std::string> {
+  RegexParser(cl::Option &O) : cl::parser<std::string>(O) {}
+
+  bool parse(cl::Option &O, StringRef ArgName, StringRef Arg,
+             std::string &Value) {
+    std::string Error;
+    if (!llvm::Regex(Arg).isValid(Error))
+      return O.error("invalid regular expression '" + Arg + "': " + Error);
+    Value = Arg.str();
+    return false;
+  }
+};
+
+// Parses <file>:<first>-<last>.
+struct LineRangeParser : public cl::basic_parser<LineRange> {
+  LineRangeParser(cl::Option &O) : cl::basic_parser<LineRange>(O) {}
+
+  bool parse(cl::Option &O, StringRef ArgName, StringRef Arg,
+             LineRange &Range) {
+    auto [File, Lines] = Arg.rsplit(':');
+    auto [First, Last] = Lines.split('-');
+    if (File.empty() || First.getAsInteger(10, Range.First) ||
+        Last.getAsInteger(10, Range.Last) || Range.First > Range.Last)
+      return O.error("'" + Arg + "' is not of the form <file>:<first>-<last>");
+    Range.File = File.str();
+    return false;
+  }
+
+  StringRef getValueName() const override { return "file:first-last"; }
+};
+
+cl::opt<std::string, false, RegexParser> Functions(
+    "functions",
+    cl::desc("Only instrument the functions whose qualified name fully "
+             "matches this regular expression (default: all functions)."),
+    cl::value_desc("regex"), cl::cat(ProgramMarkersOptions));
+
+cl::list<LineRange, bool, LineRangeParser> Lines(
+    "lines",
+    cl::desc("Only instrument the statements that begin in these lines, can "
+             "be repeated (default: all lines)."),
+    cl::cat(ProgramMarkersOptions));
+
+cl::list<RuleKind> Rules(
+    "rules", cl::CommaSeparated,
+    cl::desc("Only apply these rules (default: all rules of the mode)."),
+    cl::values(clEnumValN(RuleKind::If, "if", "if statements"),
+               clEnumValN(RuleKind::While, "while", "while loops"),
+               clEnumValN(RuleKind::For, "for", "for loops"),
+               clEnumValN(RuleKind::Do, "do", "do-while loops"),
+               clEnumValN(RuleKind::Switch, "switch",
+                          "the first case of switch statements"),
+               clEnumValN(RuleKind::Case, "case",
+                          "the other cases of switch statements"),
+               clEnumValN(RuleKind::VR, "vr", "value range markers")),
+    cl::cat(ProgramMarkersOptions));
+
+// The sorted start locations of the macro expansions of a translation unit.
+class MacroExpansionIndex {
+public:
+  explicit MacroExpansionIndex(const SourceManager &SM) {
+    for (unsigned I = 0, E = SM.local_sloc_entry_size(); I != E; ++I) {
+      const auto &Entry = SM.getLocalSLocEntry(I);
+      if (!Entry.isExpansion())
+        continue;
+      const auto &ExpInfo = Entry.getExpansion();
+      if (ExpInfo.isMacroBodyExpansion() || ExpInfo.isMacroArgExpansion() ||
+          ExpInfo.isFunctionMacroExpansion())
+        Starts.push_back(ExpInfo.getExpansionLocStart().getRawEncoding());
+    }
+    llvm::sort(Starts);
+  }
+
+  // Whether an expansion starts strictly between Begin and End. Locations are
+  // compared by their encoding, as SourceLocation does.
+  bool containsExpansions(SourceLocation Begin, SourceLocation End) const {
+    auto Start = std::upper_bound(Starts.begin(), Starts.end(),
+                                  Begin.getRawEncoding());
+    return Start != Starts.end() && *Start < End.getRawEncoding();
+  }
+
+private:
+  std::vector<SourceLocation::UIntTy> Starts;
+};
+
+// The caches of the matchers for one translation unit: the properties of its
+// functions, each computed when it is first needed, and the functions among
+// the ancestors of its nodes, which hasAncestor(functionDecl(...)) would
+// otherwise walk up to for every statement and rule.
+class TranslationUnitCache {
+public:
+  explicit TranslationUnitCache(ASTContext &Context) : Context{Context} {}
+
+  bool hasProperty(const FunctionDecl &FD, FunctionProperty Property) {
+    uint8_t Bit = 1u << static_cast<unsigned>(Property);
+    auto &[Known, Values] = Properties[&FD];
+    if (!(Known & Bit)) {
+      Known |= Bit;
+      if (computeProperty(FD, Property))
+        Values |= Bit;
+    }
+    return Values & Bit;
+  }
+
+  bool anyHasProperty(const FunctionList &Functions,
+                      FunctionProperty Property) {
+    return llvm::any_of(Functions, [&](const FunctionDecl *FD) {
+      return hasProperty(*FD, Property);
+    });
+  }
+
+  FunctionList getEnclosingFunctions(const DynTypedNode &Node) {
+    // The parents, and thus the ancestors, depend on the traversal kind.
+    auto &Cache =
+        EnclosingFunctions[Context.getParentMapContext().getTraversalKind()];
+    auto Lookup = [&](const DynTypedNode &N) -> const FunctionList * {
+      auto It = Cache.find(N.getMemoizationData());
+      return It != Cache.end() ? &It->second : nullptr;
+    };
+    auto AddIfFunction = [](FunctionList List, const DynTypedNode &N) {
+      if (const auto *FD = N.get<FunctionDecl>())
+        if (!llvm::is_contained(List, FD))
+          List.push_back(FD);
+      return List;
+    };
+
+    if (const auto *Cached = Lookup(Node))
+      return *Cached;
+    // Walks up from Node to the first ancestor that is cached or does not
+    // have exactly one parent, Enclosing then encloses the last node of Chain.
+    llvm::SmallVector<DynTypedNode, 16> Chain;
+    FunctionList Enclosing;
+    for (auto Current = Node;;) {
+      if (const auto *Cached = Lookup(Current)) {
+        Enclosing = AddIfFunction(*Cached, Current);
+        break;
+      }
+      Chain.push_back(Current);
+      auto Parents = Context.getParentMapContext().getParents(Current);
+      if (Parents.size() == 1) {
+        Current = Parents[0];
+        continue;
+      }
+      for (const auto &Parent : Parents)
+        for (const auto *FD :
+             AddIfFunction(getEnclosingFunctions(Parent), Parent))
+          if (!llvm::is_contained(Enclosing, FD))
+            Enclosing.push_back(FD);
+      break;
+    }
+    for (size_t I = Chain.size(); I-- > 0;) {
+      // Nodes without memoization data, e.g., TypeLocs, are not cached.
+      if (const auto *Key = Chain[I].getMemoizationData())
+        Cache[Key] = Enclosing;
+      if (I > 0)
+        Enclosing = AddIfFunction(std::move(Enclosing), Chain[I]);
+    }
+    return Enclosing;
+  }
+
+private:
+  bool computeProperty(const FunctionDecl &FD, FunctionProperty Property) {
+    switch (Property) {
+    case FunctionProperty::Any:
+      return true;
+    case FunctionProperty::NotConstexprOrConsteval:
+      return !FD.isConstexpr() && !FD.isConsteval();
+    case FunctionProperty::WithoutMacroExpansions:
+      if (!Index)
+        Index.emplace(Context.getSourceManager());
+      return !Index->containsExpansions(FD.getBeginLoc(), FD.getEndLoc());
+    case FunctionProperty::Selected:
+      if (Functions.empty())
+        return true;
+      if (!SelectedFunctions)
+        SelectedFunctions.emplace("^(" + Functions + ")$");
+      return SelectedFunctions->match(FD.getQualifiedNameAsString());
+    }
+    llvm_unreachable("Unknown FunctionProperty");
+  }
+
+  ASTContext &Context;
+  std::optional<MacroExpansionIndex> Index;
+  std::optional<llvm::Regex> SelectedFunctions;
+  // The properties that are known and those that hold.
+  llvm::DenseMap<const FunctionDecl *, std::pair<uint8_t, uint8_t>> Properties;
+  std::map<TraversalKind, llvm::DenseMap<const void *, FunctionList>>
+      EnclosingFunctions;
+};
+
+// Finds the functions of a declaration until each of the Missing properties
+// holds for one of them. Only the declaration contexts are searched, not the
+// statements: the closure classes of lambdas, local classes and blocks are
+// children of the function, block or class that contains them, so the call
+// operators of lambdas and the methods of local classes are found without
+// walking the bodies. Template instantiations are not searched, as the rules
+// only match the code that is spelled in the source. The lambdas in the
+// default arguments of a namespace scope function are not found, their
+// closure classes are siblings of the function.
+class FunctionPropertyFinder {
+public:
+  FunctionPropertyFinder(TranslationUnitCache &Cache,
+                         llvm::SmallVector<FunctionProperty, 3> Missing)
+      : Cache{Cache}, Missing{std::move(Missing)} {}
+
+  // Returns false once all properties were found.
+  bool find(const Decl *D) {
+    if (const auto *Friend = dyn_cast<FriendDecl>(D))
+      D = Friend->getFriendDecl();
+    if (const auto *Template = dyn_cast_or_null<TemplateDecl>(D))
+      D = Template->getTemplatedDecl();
+    if (!D)
+      return true;
+    if (const auto *FD = dyn_cast<FunctionDecl>(D)) {
+      llvm::erase_if(Missing, [&](FunctionProperty Property) {
+        return Cache.hasProperty(*FD, Property);
+      });
+      if (Missing.empty())
+        return false;
+    }
+    if (const auto *DC = dyn_cast<DeclContext>(D))
+      for (const auto *Child : DC->noload_decls())
+        if (!find(Child))
+          return false;
+    return true;
+  }
+
+  bool foundAll() const { return Missing.empty(); }
+
+private:
+  TranslationUnitCache &Cache;
+  llvm::SmallVector<FunctionProperty, 3> Missing;
+};
+
+// Set by ScopedIgnoreFunctionsWithMacros for the calls of the current thread.
+thread_local std::optional<bool> IgnoreFunctionsWithMacrosOverride;
+
 } // namespace
 
 void setIgnoreFunctionsWithMacros(bool val) { IgnoreFunctionsWithMacros = val; }
 
-MatcherType0 isNotInFunctionWithMacrosMatcher() {
-  if (not IgnoreFunctionsWithMacros)
-    return hasAncestor(functionDecl());
-  return hasAncestor(functionDecl(unless(containsMacroExpansions())));
+bool getIgnoreFunctionsWithMacros() {
+  return IgnoreFunctionsWithMacrosOverride ? *IgnoreFunctionsWithMacrosOverride
+                                           : IgnoreFunctionsWithMacros;
+}
+
+ScopedIgnoreFunctionsWithMacros::ScopedIgnoreFunctionsWithMacros(bool Value)
+    : Previous{IgnoreFunctionsWithMacrosOverride} {
+  IgnoreFunctionsWithMacrosOverride = Value;
+}
+
+ScopedIgnoreFunctionsWithMacros::~ScopedIgnoreFunctionsWithMacros() {
+  IgnoreFunctionsWithMacrosOverride = Previous;
+}
+
+clang::ast_matchers::internal::Matcher<Stmt>
+isNotInFunctionWithMacrosMatcher() {
+  if (not getIgnoreFunctionsWithMacros())
+    return isInFunctionWith(FunctionProperty::Any);
+  return isInFunctionWith(FunctionProperty::WithoutMacroExpansions);
+}
+
+bool functionContainsMacroExpansions(const FunctionDecl &FD,
+                                     ASTContext &Context) {
+  auto &Cache = ContextCaches::of(Context).get<TranslationUnitCache>();
+  return !Cache.hasProperty(FD, FunctionProperty::WithoutMacroExpansions);
+}
+
+bool hasEnclosingFunctionWith(const Stmt &S, FunctionProperty Property,
+                              ASTContext &Context) {
+  auto &Cache = ContextCaches::of(Context).get<TranslationUnitCache>();
+  return Cache.anyHasProperty(
+      Cache.getEnclosingFunctions(DynTypedNode::create(S)), Property);
+}
+
+FunctionList getEnclosingFunctions(const Stmt &S, ASTContext &Context) {
+  return ContextCaches::of(Context)
+      .get<TranslationUnitCache>()
+      .getEnclosingFunctions(DynTypedNode::create(S));
+}
+
+bool isRuleEnabled(RuleKind Kind) {
+  return Rules.empty() || llvm::is_contained(Rules, Kind);
+}
+
+llvm::StringRef getRuleName(RuleKind Kind) {
+  switch (Kind) {
+  case RuleKind::If:
+    return "if";
+  case RuleKind::While:
+    return "while";
+  case RuleKind::For:
+    return "for";
+  case RuleKind::Do:
+    return "do";
+  case RuleKind::Switch:
+    return "switch";
+  case RuleKind::Case:
+    return "case";
+  case RuleKind::VR:
+    return "vr";
+  }
+  llvm_unreachable("Unknown RuleKind");
+}
+
+bool isLocInLineRanges(const std::vector<LineRange> &Ranges,
+                       const SourceManager &SM, SourceLocation Loc) {
+  auto Line = SM.getExpansionLineNumber(Loc);
+  auto File = SM.getFilename(Loc);
+  for (const auto &Range : Ranges)
+    if (Range.First <= Line && Line <= Range.Last &&
+        (File == Range.File || File.endswith("/" + Range.File)))
+      return true;
+  return false;
+}
+
+std::vector<LineRange> getSelectedLines() {
+  return std::vector<LineRange>(Lines.begin(), Lines.end());
+}
+
+clang::ast_matchers::internal::Matcher<Stmt> isInSelectedCode() {
+  clang::ast_matchers::internal::Matcher<Stmt> Matcher = anything();
+  if (!Functions.empty())
+    Matcher = allOf(Matcher, isInFunctionWith(FunctionProperty::Selected));
+  if (!Lines.empty())
+    Matcher = allOf(Matcher, beginsInLineRanges(std::vector<LineRange>(
+                                 Lines.begin(), Lines.end())));
+  return Matcher;
+}
+
+clang::ast_matchers::internal::Matcher<Stmt>
+isNotInConstexprOrConstevalFunction() {
+  return isInFunctionWith(FunctionProperty::NotConstexprOrConsteval);
+}
+
+SharedRuleChecks::SharedRuleChecks()
+    : Macros{getIgnoreFunctionsWithMacros()
+                 ? FunctionProperty::WithoutMacroExpansions
+                 : FunctionProperty::Any},
+      SelectFunctions{!Functions.empty()},
+      Lines(markers::Lines.begin(), markers::Lines.end()) {}
+
+bool SharedRuleChecks::matches(const Stmt &S, ASTContext &Context) const {
+  // The enclosing functions are looked up once for all checks.
+  auto &Cache = ContextCaches::of(Context).get<TranslationUnitCache>();
+  auto Functions = Cache.getEnclosingFunctions(DynTypedNode::create(S));
+  if (!Cache.anyHasProperty(Functions,
+                            FunctionProperty::NotConstexprOrConsteval) ||
+      !Cache.anyHasProperty(Functions, Macros))
+    return false;
+  if (SelectFunctions &&
+      !Cache.anyHasProperty(Functions, FunctionProperty::Selected))
+    return false;
+  const auto &SM = Context.getSourceManager();
+  return Lines.empty() ||
+         isLocInLineRanges(Lines, SM, SM.getExpansionLoc(S.getBeginLoc()));
+}
+
+bool SharedRuleChecks::mayMatchIn(Decl &D, ASTContext &Context) const {
+  llvm::SmallVector<FunctionProperty, 3> Required{
+      FunctionProperty::NotConstexprOrConsteval, Macros};
+  if (SelectFunctions)
+    Required.push_back(FunctionProperty::Selected);
+  // The closure class of a lambda in the initializer of a namespace scope
+  // variable is a sibling of the variable, which is thus kept in C++.
+  const auto *Var = dyn_cast<VarDecl>(&D);
+  if (const auto *Template = dyn_cast<VarTemplateDecl>(&D))
+    Var = Template->getTemplatedDecl();
+  if (Var && Var->hasInit() && Context.getLangOpts().CPlusPlus)
+    return true;
+  FunctionPropertyFinder Finder(
+      ContextCaches::of(Context).get<TranslationUnitCache>(),
+      std::move(Required));
+  Finder.find(&D);
+  return Finder.foundAll();
+}
+
+MainFileLocations::MainFileLocations(ASTContext &Context)
+    : SM{Context.getSourceManager()} {
+  auto Classify = [](const SrcMgr::FileInfo &File) {
+    // With line markers, e.g., in preprocessed files, isInMainFile depends on
+    // the line of the location.
+    if (File.hasLineDirectives())
+      return FileKind::LineDirectives;
+    return File.getIncludeLoc().isInvalid() ? FileKind::InMain
+                                            : FileKind::NotInMain;
+  };
+  for (unsigned I = 0, E = SM.local_sloc_entry_size(); I != E; ++I) {
+    const auto &Entry = SM.getLocalSLocEntry(I);
+    if (!Entry.isFile())
+      continue;
+    FileStarts.push_back(Entry.getOffset());
+    FileKinds.push_back(Classify(Entry.getFile()));
+  }
+  LocalEnd = SM.getNextLocalOffset();
+  auto Main = SM.getMainFileID();
+  MainBegin = SM.getLocForStartOfFile(Main).getRawEncoding();
+  // The end of file location is part of the file.
+  MainEnd = SM.getLocForEndOfFile(Main).getRawEncoding() + 1;
+  MainKind = Classify(SM.getSLocEntry(Main).getFile());
+}
+
+bool MainFileLocations::contains(SourceLocation Loc) const {
+  if (Loc.isInvalid())
+    return false;
+  if (Loc.isMacroID())
+    return SM.isInMainFile(SM.getExpansionLoc(Loc));
+  // The encoding of a file location is its offset.
+  auto Offset = Loc.getRawEncoding();
+  FileKind Kind;
+  if (MainBegin <= Offset && Offset < MainEnd) {
+    Kind = MainKind;
+  } else if (Offset < LocalEnd) {
+    auto Next = std::upper_bound(FileStarts.begin(), FileStarts.end(), Offset);
+    Kind = FileKinds[Next - FileStarts.begin() - 1];
+  } else {
+    // Loaded from a PCH or a module.
+    return SM.isInMainFile(Loc);
+  }
+  if (Kind == FileKind::LineDirectives)
+    return SM.isInMainFile(Loc);
+  return Kind == FileKind::InMain;
+}
+
+const MainFileLocations &getMainFileLocations(ASTContext &Context) {
+  return ContextCaches::of(Context).get<MainFileLocations>();
+}
+
+bool isNotInMacroAndInMain(SourceLocation Loc,
+                           const MainFileLocations &Locations) {
+  return !Loc.isMacroID() && Locations.contains(Loc);
+}
+
+bool isConditionNotInMacroAndInMain(const IfStmt &If,
+                                    const MainFileLocations &Locations) {
+  return isNotInMacroAndInMain(If.getRParenLoc(), Locations) &&
+         isNotInMacroAndInMain(If.getLParenLoc(), Locations) &&
+         isNotInMacroAndInMain(If.getIfLoc(), Locations);
+}
+
+bool isDoAndWhileNotMacroAndInMain(const DoStmt &Do,
+                                   const MainFileLocations &Locations) {
+  return isNotInMacroAndInMain(Do.getDoLoc(), Locations) &&
+         isNotInMacroAndInMain(Do.getWhileLoc(), Locations);
 }
 
-MatcherType1 isNotInConstexprOrConstevalFunction() {
-  return hasAncestor(
-      functionDecl(unless(isConstexpr()), unless(isConsteval())));
+bool isColonAndKeywordNotInMacroAndInMain(const SwitchCase &Case,
+                                          const MainFileLocations &Locations) {
+  return isNotInMacroAndInMain(Case.getColonLoc(), Locations) &&
+         isNotInMacroAndInMain(Case.getKeywordLoc(), Locations);
 }
 
-MatcherType2 inMainAndNotMacro() {
-  return allOf(notInMacro(), isExpansionInMainFile());
+bool isInMainAndNotMacro(const Stmt &S, const MainFileLocations &Locations) {
+  return !S.getBeginLoc().isMacroID() && !S.getEndLoc().isMacroID() &&
+         Locations.contains(S.getBeginLoc());
 }
 
 } // namespace markers
@@ -1,11 +1,35 @@
 #pragma once
 
 #include <clang/ASTMatchers/ASTMatchers.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Support/Regex.h>
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
 
 using namespace clang;
 
 namespace markers {
 
+// The rules that can be selected with --rules.
+enum class RuleKind { If, While, For, Do, Switch, Case, VR };
+
+bool isRuleEnabled(RuleKind Kind);
+// The name of the rule in --rules.
+llvm::StringRef getRuleName(RuleKind Kind);
+
+// A range of lines of the files whose path is File or ends with /File.
+struct LineRange {
+  std::string File;
+  unsigned First;
+  unsigned Last;
+};
+
+bool isLocInLineRanges(const std::vector<LineRange> &Ranges,
+                       const SourceManager &SM, SourceLocation Loc);
+
 AST_MATCHER(FunctionDecl, isDefined) {
   (void)Finder;
   (void)Builder;
@@ -30,98 +54,168 @@ AST_MATCHER(Stmt, notInMacro) {
   return !Node.getBeginLoc().isMacroID() && !Node.getEndLoc().isMacroID();
 }
 
+// Classifies the locations of a translation unit as in its main file or not,
+// as SourceManager::isInMainFile does for their expansion locations. The file
+// entries of the translation unit are classified once, so that a location in
+// a file is classified by its offset instead of by looking up its FileID among
+// all entries, including the macro expansions, and then its file.
+class MainFileLocations {
+public:
+  explicit MainFileLocations(ASTContext &Context);
+  bool contains(SourceLocation Loc) const;
+
+private:
+  enum class FileKind : uint8_t { InMain, NotInMain, LineDirectives };
+
+  const SourceManager &SM;
+  // The offsets of the main file, which most locations are in.
+  SourceLocation::UIntTy MainBegin;
+  SourceLocation::UIntTy MainEnd;
+  FileKind MainKind;
+  // The offsets at which the local file entries start, and their kinds.
+  std::vector<SourceLocation::UIntTy> FileStarts;
+  std::vector<FileKind> FileKinds;
+  SourceLocation::UIntTy LocalEnd;
+};
+
+// The MainFileLocations of the translation unit of Context, created when it
+// is first needed. Like all caches of the matchers, it is kept in the current
+// ContextCaches of Context, which the code running the matchers creates.
+const MainFileLocations &getMainFileLocations(ASTContext &Context);
+
+// The location checks of the rules, used by their matchers and by the DCE
+// dispatcher (--engine=visitor).
+bool isNotInMacroAndInMain(SourceLocation Loc,
+                           const MainFileLocations &Locations);
+bool isConditionNotInMacroAndInMain(const IfStmt &If,
+                                    const MainFileLocations &Locations);
+bool isDoAndWhileNotMacroAndInMain(const DoStmt &Do,
+                                   const MainFileLocations &Locations);
+bool isColonAndKeywordNotInMacroAndInMain(const SwitchCase &Case,
+                                          const MainFileLocations &Locations);
+bool isInMainAndNotMacro(const Stmt &S, const MainFileLocations &Locations);
+
 AST_MATCHER(IfStmt, ConditionNotInMacroAndInMain) {
   (void)Builder;
-  auto RParenLoc = Node.getRParenLoc();
-  auto LParenLoc = Node.getLParenLoc();
-  auto IfLoc = Node.getIfLoc();
-  const auto &SM = Finder->getASTContext().getSourceManager();
-
-  if (RParenLoc.isMacroID() || !SM.isInMainFile(SM.getExpansionLoc(RParenLoc)))
-    return false;
-
-  if (LParenLoc.isMacroID() || !SM.isInMainFile(SM.getExpansionLoc(LParenLoc)))
-    return false;
-  return !IfLoc.isMacroID() && SM.isInMainFile(SM.getExpansionLoc(IfLoc));
+  return isConditionNotInMacroAndInMain(
+      Node, getMainFileLocations(Finder->getASTContext()));
 }
 
 AST_MATCHER(IfStmt, ElseNotInMacroAndInMain) {
   (void)Builder;
-  auto ElseLoc = Node.getElseLoc();
-  const auto &SM = Finder->getASTContext().getSourceManager();
-  return !ElseLoc.isMacroID() && SM.isInMainFile(SM.getExpansionLoc(ElseLoc));
+  return isNotInMacroAndInMain(Node.getElseLoc(),
+                               getMainFileLocations(Finder->getASTContext()));
 }
 
+// Whether a macro expansion starts within the function.
+bool functionContainsMacroExpansions(const FunctionDecl &FD,
+                                     ASTContext &Context);
+
 AST_MATCHER(FunctionDecl, containsMacroExpansions) {
   (void)Builder;
-  const auto &SM = Finder->getASTContext().getSourceManager();
-  auto StartLoc = Node.getBeginLoc();
-  auto EndLoc = Node.getEndLoc();
-  for (unsigned I = 0, E = SM.local_sloc_entry_size(); I != E; ++I) {
-    const auto &Entry = SM.getLocalSLocEntry(I);
-    if (!Entry.isExpansion())
-      continue;
-    const auto &ExpInfo = Entry.getExpansion();
-    if (ExpInfo.isMacroBodyExpansion() || ExpInfo.isMacroArgExpansion() ||
-        ExpInfo.isFunctionMacroExpansion()) {
-      auto Loc = Entry.getExpansion().getExpansionLocStart();
-      if (StartLoc < Loc && Loc < EndLoc)
-        return true;
-    }
-  }
-  return false;
+  return functionContainsMacroExpansions(Node, Finder->getASTContext());
+}
+
+// The properties of the functions enclosing a statement that the rules check.
+enum class FunctionProperty {
+  Any,
+  NotConstexprOrConsteval,
+  WithoutMacroExpansions,
+  // The name is selected by --functions.
+  Selected
+};
+
+// Whether a function among the ancestors of S has the property, as
+// hasAncestor(functionDecl(...)) would check. The functions enclosing each
+// statement and their properties are cached in the ContextCaches of Context.
+bool hasEnclosingFunctionWith(const Stmt &S, FunctionProperty Property,
+                              ASTContext &Context);
+
+AST_MATCHER_P(Stmt, isInFunctionWith, FunctionProperty, Property) {
+  (void)Builder;
+  return hasEnclosingFunctionWith(Node, Property, Finder->getASTContext());
 }
 
+using FunctionList = llvm::SmallVector<const FunctionDecl *, 2>;
+
+// The functions among the ancestors of S, the outermost first.
+FunctionList getEnclosingFunctions(const Stmt &S, ASTContext &Context);
+
 AST_MATCHER(DoStmt, DoAndWhileNotMacroAndInMain) {
   (void)Builder;
-  const auto &SM = Finder->getASTContext().getSourceManager();
-  const auto &DoLoc = Node.getDoLoc();
-  const auto &WhileLoc = Node.getWhileLoc();
-  return !Node.getDoLoc().isMacroID() && !Node.getWhileLoc().isMacroID() &&
-         SM.isInMainFile(SM.getExpansionLoc(DoLoc)) &&
-         SM.isInMainFile(SM.getExpansionLoc(WhileLoc));
+  return isDoAndWhileNotMacroAndInMain(
+      Node, getMainFileLocations(Finder->getASTContext()));
 }
 
 AST_MATCHER(SwitchCase, colonAndKeywordNotInMacroAndInMain) {
   (void)Builder;
-  auto ColonLoc = Node.getColonLoc();
-  auto KeywordLoc = Node.getKeywordLoc();
+  return isColonAndKeywordNotInMacroAndInMain(
+      Node, getMainFileLocations(Finder->getASTContext()));
+}
+
+// Neither end of the statement is in a macro and it is in the main file.
+AST_MATCHER(Stmt, inMainAndNotMacro) {
+  (void)Builder;
+  return isInMainAndNotMacro(Node,
+                             getMainFileLocations(Finder->getASTContext()));
+}
+
+AST_MATCHER_P(Stmt, beginsInLineRanges, std::vector<LineRange>, Ranges) {
+  (void)Builder;
   const auto &SM = Finder->getASTContext().getSourceManager();
-  return !ColonLoc.isMacroID() && !KeywordLoc.isMacroID() &&
-         SM.isInMainFile(SM.getExpansionLoc(ColonLoc)) &&
-         SM.isInMainFile(SM.getExpansionLoc(KeywordLoc));
+  return isLocInLineRanges(Ranges, SM, SM.getExpansionLoc(Node.getBeginLoc()));
 }
 
 using namespace clang::ast_matchers;
 
-using MatcherType0 =
-    class clang::ast_matchers::internal::ArgumentAdaptingMatcherFuncAdaptor<
-        clang::ast_matchers::internal::HasAncestorMatcher, clang::Decl,
-        clang::ast_matchers::internal::TypeList<
-            clang::Decl, clang::NestedNameSpecifierLoc, clang::Stmt,
-            clang::TypeLoc, clang::Attr>>;
-
 void setIgnoreFunctionsWithMacros(bool val);
-
-MatcherType0 isNotInFunctionWithMacrosMatcher();
-
-using MatcherType1 =
-    class clang::ast_matchers::internal::ArgumentAdaptingMatcherFuncAdaptor<
-        clang::ast_matchers::internal::HasAncestorMatcher, clang::Decl,
-        clang::ast_matchers::internal::TypeList<
-            clang::Decl, clang::NestedNameSpecifierLoc, clang::Stmt,
-            clang::TypeLoc, clang::Attr>>;
-
-MatcherType1 isNotInConstexprOrConstevalFunction();
-
-using MatcherType2 =
-    class clang::ast_matchers::internal::VariadicOperatorMatcher<
-        clang::ast_matchers::internal::Matcher<clang::Stmt>,
-        clang::ast_matchers::internal::PolymorphicMatcher<
-            clang::ast_matchers::internal::matcher_isExpansionInMainFileMatcher,
-            void(clang::ast_matchers::internal::TypeList<
-                 clang::Decl, clang::Stmt, clang::TypeLoc>)>>;
-
-MatcherType2 inMainAndNotMacro();
+bool getIgnoreFunctionsWithMacros();
+
+// Overrides the setting of setIgnoreFunctionsWithMacros for the rules that
+// the current thread creates and runs while it lives, e.g., during a single
+// CodeInstrumenter::instrument call.
+class ScopedIgnoreFunctionsWithMacros {
+public:
+  explicit ScopedIgnoreFunctionsWithMacros(bool Value);
+  ScopedIgnoreFunctionsWithMacros(const ScopedIgnoreFunctionsWithMacros &) =
+      delete;
+  ~ScopedIgnoreFunctionsWithMacros();
+
+private:
+  std::optional<bool> Previous;
+};
+
+clang::ast_matchers::internal::Matcher<clang::Stmt>
+isNotInFunctionWithMacrosMatcher();
+
+clang::ast_matchers::internal::Matcher<clang::Stmt>
+isNotInConstexprOrConstevalFunction();
+
+// Restricts the rules to the functions of --functions and the lines of
+// --lines.
+clang::ast_matchers::internal::Matcher<clang::Stmt> isInSelectedCode();
+// The line ranges of --lines, empty if all lines are selected.
+std::vector<LineRange> getSelectedLines();
+
+// The checks that all rules share, isNotInConstexprOrConstevalFunction,
+// isNotInFunctionWithMacrosMatcher and isInSelectedCode, without matchers.
+// The settings are read when it is created, as when the rules are created.
+class SharedRuleChecks {
+public:
+  SharedRuleChecks();
+  bool matches(const Stmt &S, ASTContext &Context) const;
+  // Whether the checks may pass for a statement of D, i.e., whether the
+  // functions of D, including its lambdas and local classes, have the
+  // properties that the checks require. It only looks at the properties of
+  // the functions and their declaration contexts, not at their bodies, and
+  // keeps the variables with initializers in C++, whose lambdas are not
+  // children of the variable. The lines are not considered.
+  bool mayMatchIn(Decl &D, ASTContext &Context) const;
+
+private:
+  FunctionProperty Macros;
+  bool SelectFunctions;
+  std::vector<LineRange> Lines;
+};
 
 } // namespace markers
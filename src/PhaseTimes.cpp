@@ -0,0 +1,98 @@
+#include "PhaseTimes.h"
+
+#include <llvm/Support/Format.h>
+
+namespace markers {
+
+llvm::StringRef getPhaseName(Phase P) {
+  switch (P) {
+  case Phase::Parse:
+    return "parse";
+  case Phase::Matching:
+    return "matching";
+  case Phase::EditCollection:
+    return "edit_collection";
+  case Phase::ReplacementMerging:
+    return "replacement_merging";
+  case Phase::Rewriting:
+    return "rewriting";
+  case Phase::Writing:
+    return "writing";
+  }
+  llvm_unreachable("Unknown Phase");
+}
+
+void PhaseTimes::add(Phase P, const llvm::TimeRecord &Time) {
+  Times[static_cast<size_t>(P)] += Time;
+}
+
+void PhaseTimes::subtract(Phase P, const llvm::TimeRecord &Time) {
+  Times[static_cast<size_t>(P)] -= Time;
+}
+
+const llvm::TimeRecord &PhaseTimes::get(Phase P) const {
+  return Times[static_cast<size_t>(P)];
+}
+
+PhaseTimes &PhaseTimes::operator+=(const PhaseTimes &Other) {
+  for (size_t I = 0; I < NumPhases; ++I)
+    Times[I] += Other.Times[I];
+  return *this;
+}
+
+void PhaseTimes::print(llvm::raw_ostream &OS, llvm::StringRef Title) const {
+  llvm::TimeRecord Total;
+  for (const auto &Time : Times)
+    Total += Time;
+
+  OS << "===" << std::string(73, '-') << "===\n";
+  OS.indent(Title.size() < 80 ? (80 - Title.size()) / 2 : 0) << Title << "\n";
+  OS << "===" << std::string(73, '-') << "===\n";
+  OS << llvm::format("  Total Execution Time: %5.4f seconds (%5.4f wall "
+                     "clock)\n\n",
+                     Total.getProcessTime(), Total.getWallTime());
+  OS << "   ---User Time---   --System Time--   --User+System--   ---Wall "
+        "Time---  --- Name ---\n";
+  // Unlike TimeRecord::print, zero columns are kept to match the header.
+  auto PrintRow = [&](const llvm::TimeRecord &Time, llvm::StringRef Name) {
+    auto PrintColumn = [&](double Value, double TotalValue) {
+      OS << llvm::format("  %8.4f (%5.1f%%)", Value,
+                         TotalValue ? Value * 100 / TotalValue : 0.0);
+    };
+    PrintColumn(Time.getUserTime(), Total.getUserTime());
+    PrintColumn(Time.getSystemTime(), Total.getSystemTime());
+    PrintColumn(Time.getProcessTime(), Total.getProcessTime());
+    PrintColumn(Time.getWallTime(), Total.getWallTime());
+    OS << "  " << Name << "\n";
+  };
+  for (size_t I = 0; I < NumPhases; ++I)
+    PrintRow(Times[I], getPhaseName(static_cast<Phase>(I)));
+  PrintRow(Total, "Total");
+  OS << "\n";
+}
+
+llvm::json::Object PhaseTimes::toJSON() const {
+  llvm::json::Object Object;
+  for (size_t I = 0; I < NumPhases; ++I)
+    Object[getPhaseName(static_cast<Phase>(I))] =
+        llvm::json::Object{{"wall", Times[I].getWallTime()},
+                           {"user", Times[I].getUserTime()},
+                           {"system", Times[I].getSystemTime()}};
+  return Object;
+}
+
+ScopedPhaseTimer::ScopedPhaseTimer(PhaseTimes *Times, Phase P)
+    : Times{Times}, P{P} {
+  if (Times)
+    Start = llvm::TimeRecord::getCurrentTime(/*Start=*/true);
+}
+
+ScopedPhaseTimer::~ScopedPhaseTimer() {
+  if (!Times)
+    return;
+  auto Time = llvm::TimeRecord::getCurrentTime(/*Start=*/false);
+  Time -= Start;
+  Times->add(P, Time);
+}
+
+} // namespace markers
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/Timer.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <array>
+
+namespace markers {
+
+enum class Phase {
+  Parse,
+  Matching,
+  EditCollection,
+  ReplacementMerging,
+  Rewriting,
+  Writing
+};
+
+constexpr size_t NumPhases = static_cast<size_t>(Phase::Writing) + 1;
+
+llvm::StringRef getPhaseName(Phase P);
+
+// The time spent in each phase of instrumenting one or more files
+class PhaseTimes {
+public:
+  void add(Phase P, const llvm::TimeRecord &Time);
+  void subtract(Phase P, const llvm::TimeRecord &Time);
+  const llvm::TimeRecord &get(Phase P) const;
+  PhaseTimes &operator+=(const PhaseTimes &Other);
+
+  // Prints a table in the style of llvm::TimerGroup.
+  void print(llvm::raw_ostream &OS, llvm::StringRef Title) const;
+  llvm::json::Object toJSON() const;
+
+private:
+  std::array<llvm::TimeRecord, NumPhases> Times;
+};
+
+// Adds the time between its construction and destruction to a phase, does
+// nothing if Times is null.
+class ScopedPhaseTimer {
+public:
+  ScopedPhaseTimer(PhaseTimes *Times, Phase P);
+  ScopedPhaseTimer(const ScopedPhaseTimer &) = delete;
+  ~ScopedPhaseTimer();
+
+private:
+  PhaseTimes *Times;
+  Phase P;
+  llvm::TimeRecord Start;
+};
+
+} // namespace markers
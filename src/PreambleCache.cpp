@@ -0,0 +1,265 @@
+#include "PreambleCache.h"
+
+#include <clang/Frontend/FrontendActions.h>
+#include <clang/Frontend/Utils.h>
+#include <clang/Lex/Lexer.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/Chrono.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/SHA1.h>
+#include <llvm/Support/raw_ostream.h>
+
+using namespace clang;
+
+namespace markers {
+
+namespace {
+
+// Rewrites the preamble into a stand-alone header: comments and blank lines
+// are dropped, so that programs which only differ in their leading comments
+// share a PCH, and quoted includes that are found next to the main file are
+// replaced with their absolute path.
+std::string makePreambleHeader(CompilerInstance &CI, StringRef Preamble,
+                               StringRef MainDirectory) {
+  // The lexer requires a null terminated buffer.
+  std::string Buffer{Preamble};
+  Lexer RawLexer(SourceLocation(), CI.getLangOpts(), Buffer.data(),
+                 Buffer.data(), Buffer.data() + Buffer.size());
+
+  std::string Header;
+  llvm::raw_string_ostream OS(Header);
+  const char *LineStart = nullptr;
+  const char *LineEnd = nullptr;
+  bool IsInclude = false;
+  std::string IncludedFile;
+  auto FlushLine = [&]() {
+    if (!LineStart)
+      return;
+    if (!IncludedFile.empty())
+      OS << "#include \"" << IncludedFile << "\"\n";
+    else
+      OS << StringRef(LineStart, LineEnd - LineStart) << "\n";
+    LineStart = nullptr;
+    IsInclude = false;
+    IncludedFile.clear();
+  };
+
+  Token Tok;
+  unsigned TokenInLine = 0;
+  while (true) {
+    RawLexer.LexFromRawLexer(Tok);
+    if (Tok.is(tok::eof))
+      break;
+    const char *TokEnd = RawLexer.getBufferLocation();
+    const char *TokStart = TokEnd - Tok.getLength();
+    if (Tok.isAtStartOfLine() || !LineStart) {
+      FlushLine();
+      LineStart = TokStart;
+      TokenInLine = 0;
+    }
+    LineEnd = TokEnd;
+
+    if (TokenInLine == 1 && Tok.is(tok::raw_identifier))
+      IsInclude = Tok.getRawIdentifier() == "include" ||
+                  Tok.getRawIdentifier() == "import";
+    else if (TokenInLine == 2 && IsInclude && Tok.is(tok::string_literal)) {
+      auto Name = StringRef(TokStart, Tok.getLength()).drop_front().drop_back();
+      llvm::SmallString<256> Candidate(MainDirectory);
+      llvm::sys::path::append(Candidate, Name);
+      if (CI.getFileManager().getVirtualFileSystem().exists(Candidate))
+        IncludedFile = std::string(Candidate);
+    }
+    ++TokenInLine;
+  }
+  FlushLine();
+  return OS.str();
+}
+
+std::string makeKey(CompilerInstance &CI, StringRef Header) {
+  std::string Key;
+  llvm::raw_string_ostream OS(Key);
+  // Covers the clang version, target and language options and macros.
+  OS << CI.getInvocation().getModuleHash() << "\n";
+  for (const auto &Entry : CI.getHeaderSearchOpts().UserEntries)
+    OS << static_cast<unsigned>(Entry.Group) << Entry.IsFramework << Entry.Path
+       << "\n";
+  for (const auto &Include : CI.getPreprocessorOpts().Includes)
+    OS << "include " << Include << "\n";
+  for (const auto &Include : CI.getPreprocessorOpts().MacroIncludes)
+    OS << "imacros " << Include << "\n";
+  OS << Header;
+  return llvm::toHex(llvm::SHA1::hash(llvm::arrayRefFromStringRef(OS.str())),
+                     /*LowerCase=*/true);
+}
+
+bool writeFileAtomically(StringRef Path, StringRef Contents) {
+  llvm::SmallString<256> TempPath;
+  int FD;
+  if (llvm::sys::fs::createUniqueFile(Path + ".tmp%%%%%%%%", FD, TempPath))
+    return false;
+  {
+    llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+    OS << Contents;
+    OS.close();
+    if (OS.has_error()) {
+      OS.clear_error();
+      llvm::sys::fs::remove(TempPath);
+      return false;
+    }
+  }
+  if (llvm::sys::fs::rename(TempPath, Path)) {
+    llvm::sys::fs::remove(TempPath);
+    return false;
+  }
+  return true;
+}
+
+// Collects the headers included by the preamble, including system headers.
+class PreambleDependencies : public DependencyCollector {
+public:
+  bool needSystemDependencies() override { return true; }
+};
+
+// A line "<size> <modification time> <path>" per file.
+std::string makeDependencyList(ArrayRef<std::string> Files,
+                               llvm::vfs::FileSystem &FS) {
+  std::string List;
+  llvm::raw_string_ostream OS(List);
+  for (const auto &File : Files) {
+    auto Status = FS.status(File);
+    if (!Status)
+      return "";
+    OS << Status->getSize() << " "
+       << llvm::sys::toTimeT(Status->getLastModificationTime()) << " " << File
+       << "\n";
+  }
+  return OS.str();
+}
+
+// Whether the files in the dependency list at Path are unchanged, i.e., still
+// have the same size and modification time as when the PCH was built.
+bool areDependenciesUnchanged(StringRef Path, llvm::vfs::FileSystem &FS) {
+  auto List = llvm::MemoryBuffer::getFile(Path);
+  if (!List)
+    return false;
+  llvm::SmallVector<StringRef, 32> Lines;
+  (*List)->getBuffer().split(Lines, '\n', /*MaxSplit=*/-1,
+                             /*KeepEmpty=*/false);
+  if (Lines.empty())
+    return false;
+  for (auto Line : Lines) {
+    auto [Size, Rest] = Line.split(' ');
+    auto [ModificationTime, File] = Rest.split(' ');
+    auto Status = FS.status(File);
+    if (!Status || Size != std::to_string(Status->getSize()) ||
+        ModificationTime !=
+            std::to_string(
+                llvm::sys::toTimeT(Status->getLastModificationTime())))
+      return false;
+  }
+  return true;
+}
+
+// Builds the PCH and returns the dependency list of the files it includes, or
+// an empty string on failure.
+std::string buildPCH(CompilerInstance &CI, StringRef HeaderPath,
+                     StringRef PCHPath) {
+  auto Invocation = std::make_shared<CompilerInvocation>(CI.getInvocation());
+  auto &FrontendOpts = Invocation->getFrontendOpts();
+  auto Kind = FrontendOpts.Inputs.front().getKind();
+  FrontendOpts.Inputs = {FrontendInputFile(HeaderPath, Kind)};
+  // The output is written to a temporary file first and then renamed, i.e.,
+  // concurrent builds of the same PCH are harmless.
+  FrontendOpts.OutputFile = std::string(PCHPath);
+  FrontendOpts.ProgramAction = frontend::GeneratePCH;
+
+  CompilerInstance Clang(CI.getPCHContainerOperations());
+  Clang.setInvocation(std::move(Invocation));
+  // Errors in the preamble are reported by the actual compilation.
+  Clang.createDiagnostics(new IgnoringDiagConsumer, /*ShouldOwnClient=*/true);
+  Clang.setFileManager(new FileManager(
+      CI.getFileSystemOpts(), CI.getFileManager().getVirtualFileSystemPtr()));
+  Clang.createSourceManager(Clang.getFileManager());
+  auto Dependencies = std::make_shared<PreambleDependencies>();
+  Clang.addDependencyCollector(Dependencies);
+  GeneratePCHAction Action;
+  if (!Clang.ExecuteAction(Action) ||
+      Clang.getDiagnostics().hasErrorOccurred())
+    return "";
+
+  auto &Files = Clang.getFileManager();
+  std::vector<std::string> Included;
+  for (const auto &File : Dependencies->getDependencies()) {
+    llvm::SmallString<256> Path(File);
+    Files.makeAbsolutePath(Path);
+    Included.push_back(std::string(Path));
+  }
+  return makeDependencyList(Included, Files.getVirtualFileSystem());
+}
+
+} // namespace
+
+std::optional<std::string> usePreamblePCH(CompilerInstance &CI,
+                                          StringRef CacheDirectory) {
+  const auto &Inputs = CI.getFrontendOpts().Inputs;
+  if (Inputs.size() != 1 || !Inputs.front().isFile() ||
+      !CI.getPreprocessorOpts().ImplicitPCHInclude.empty())
+    return std::nullopt;
+
+  auto &Files = CI.getFileManager();
+  auto MainPath = Inputs.front().getFile();
+  auto Buffer = Files.getBufferForFile(MainPath);
+  if (!Buffer)
+    return std::nullopt;
+  auto Code = (*Buffer)->getBuffer();
+  auto Bounds = Lexer::ComputePreamble(Code, CI.getLangOpts());
+  if (Bounds.Size == 0)
+    return std::nullopt;
+
+  llvm::SmallString<256> MainDirectory(llvm::sys::path::parent_path(MainPath));
+  Files.makeAbsolutePath(MainDirectory);
+  auto Preamble = Code.take_front(Bounds.Size);
+  auto Header = makePreambleHeader(CI, Preamble, MainDirectory);
+  if (Header.empty())
+    return std::nullopt;
+
+  auto Key = makeKey(CI, Header);
+  llvm::SmallString<256> HeaderPath(CacheDirectory);
+  llvm::sys::path::append(HeaderPath, Key + ".h");
+  llvm::SmallString<256> PCHPath(CacheDirectory);
+  llvm::sys::path::append(PCHPath, Key + ".pch");
+  llvm::SmallString<256> DependenciesPath(CacheDirectory);
+  llvm::sys::path::append(DependenciesPath, Key + ".deps");
+  // The dependency list is written after the PCH, a PCH without one is
+  // incomplete and rebuilt.
+  if (!llvm::sys::fs::exists(PCHPath) ||
+      !areDependenciesUnchanged(DependenciesPath,
+                                Files.getVirtualFileSystem())) {
+    if (llvm::sys::fs::create_directories(CacheDirectory))
+      return std::nullopt;
+    if (!llvm::sys::fs::exists(HeaderPath) &&
+        !writeFileAtomically(HeaderPath, Header))
+      return std::nullopt;
+    auto Dependencies = buildPCH(CI, HeaderPath, PCHPath);
+    if (Dependencies.empty() ||
+        !writeFileAtomically(DependenciesPath, Dependencies))
+      return std::nullopt;
+  }
+
+  // The preamble is in the PCH, parsing it again would, e.g., redefine the
+  // types of headers without include guards.
+  std::string Blanked(Code);
+  for (size_t I = 0; I < Bounds.Size; ++I)
+    if (Blanked[I] != '\n' && Blanked[I] != '\r')
+      Blanked[I] = ' ';
+  auto &PPOpts = CI.getPreprocessorOpts();
+  PPOpts.ImplicitPCHInclude = std::string(PCHPath);
+  PPOpts.addRemappedFile(
+      MainPath,
+      llvm::MemoryBuffer::getMemBufferCopy(Blanked, MainPath).release());
+  return std::string(Preamble);
+}
+
+} // namespace markers
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <clang/Frontend/CompilerInstance.h>
+#include <llvm/ADT/StringRef.h>
+
+#include <optional>
+#include <string>
+
+namespace markers {
+
+// Precompiles the preamble of CI's main file, i.e., its leading preprocessor
+// directives such as #includes, into a PCH stored in CacheDirectory and sets
+// up CI to parse the main file with it. The PCHs are keyed by the directives
+// (without comments), the compiler options and the files of quoted includes
+// found next to the main file, so they are shared by all translation units
+// with the same key, also across processes. A PCH is rebuilt when the size or
+// modification time of one of the files it includes changes.
+//
+// The PCH is included implicitly and the preamble is blanked out in the main
+// file, i.e., its characters other than line breaks are replaced by spaces,
+// so that the offsets and lines of the main file do not change.
+//
+// Returns the original preamble, which the instrumented code must keep, or
+// nothing if the main file has no preamble or it could not be precompiled.
+std::optional<std::string> usePreamblePCH(clang::CompilerInstance &CI,
+                                          llvm::StringRef CacheDirectory);
+
+} // namespace markers
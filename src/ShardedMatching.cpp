@@ -0,0 +1,212 @@
+#include "ShardedMatching.h"
+
+#include <clang/AST/ASTConsumer.h>
+#include <clang/ASTMatchers/ASTMatchFinder.h>
+#include <clang/Frontend/FrontendAction.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/Threading.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "ContextCache.h"
+#include "Matchers.h"
+#include "TraversalScope.h"
+
+using namespace clang;
+using namespace clang::ast_matchers;
+
+namespace markers {
+
+namespace {
+
+// Splits Decls into at most NumShards contiguous shards of roughly equal
+// source size.
+std::vector<std::vector<Decl *>> makeShards(const std::vector<Decl *> &Decls,
+                                            unsigned NumShards,
+                                            const SourceManager &SM) {
+  std::vector<unsigned> Offsets;
+  for (auto *D : Decls) {
+    auto Loc = D->getBeginLoc();
+    if (Loc.isValid())
+      Offsets.push_back(SM.getFileOffset(SM.getExpansionLoc(Loc)));
+    else
+      Offsets.push_back(Offsets.empty() ? 0 : Offsets.back());
+  }
+  Offsets.push_back(SM.getBufferData(SM.getMainFileID()).size());
+
+  std::vector<size_t> Sizes;
+  size_t TotalSize = 0;
+  for (size_t I = 0; I < Decls.size(); ++I) {
+    Sizes.push_back(std::max(Offsets[I + 1], Offsets[I] + 1) - Offsets[I]);
+    TotalSize += Sizes.back();
+  }
+
+  std::vector<std::vector<Decl *>> Shards(1);
+  size_t ShardSize = 0;
+  for (size_t I = 0; I < Decls.size(); ++I) {
+    if (ShardSize * NumShards >= TotalSize) {
+      Shards.emplace_back();
+      ShardSize = 0;
+    }
+    Shards.back().push_back(Decls[I]);
+    ShardSize += Sizes[I];
+  }
+  return Shards;
+}
+
+void matchScope(ASTContext &Context, const std::vector<Decl *> &Scope,
+                Instrumenter &Instr) {
+  Context.setTraversalScope(Scope);
+  MatchFinder Finder;
+  Instr.registerMatchers(Finder);
+  Finder.matchAST(Context);
+}
+
+// The shard of a worker, which parses the translation unit again with the
+// invocation and file system of the calling thread.
+struct ShardRequest {
+  unsigned NumShards;
+  size_t Index;
+  // The size of the traversal scope of the calling thread, a worker whose
+  // scope differs does not match.
+  size_t ScopeSize;
+  std::shared_ptr<CompilerInvocation> Invocation;
+  std::shared_ptr<PCHContainerOperations> PCHContainerOps;
+  FileSystemOptions FileSystemOpts;
+  llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS;
+};
+
+// Matches the shard of the request in the translation unit it parses, the
+// shards are made from the traversal scope after the same restrictions as in
+// the calling thread.
+class ShardConsumer : public ASTConsumer {
+public:
+  ShardConsumer(const ShardRequest &Request, Instrumenter &Instr,
+                bool &Matched)
+      : Request{Request}, Instr{Instr}, Matched{Matched} {}
+
+  void HandleTranslationUnit(ASTContext &Context) override {
+    if (Context.getDiagnostics().hasErrorOccurred())
+      return;
+    ContextCaches Caches(Context);
+    restrictTraversalScopeToMainFile(Context);
+    restrictTraversalScopeToEligibleFunctions(Context);
+    auto Scope = Context.getTraversalScope();
+    if (Scope.size() != Request.ScopeSize)
+      return;
+    auto Shards =
+        makeShards(Scope, Request.NumShards, Context.getSourceManager());
+    if (Request.Index >= Shards.size())
+      return;
+    matchScope(Context, Shards[Request.Index], Instr);
+    Matched = true;
+  }
+
+private:
+  const ShardRequest &Request;
+  Instrumenter &Instr;
+  bool &Matched;
+};
+
+class ShardAction : public ASTFrontendAction {
+public:
+  ShardAction(const ShardRequest &Request, Instrumenter &Instr, bool &Matched)
+      : Request{Request}, Instr{Instr}, Matched{Matched} {}
+
+protected:
+  std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &,
+                                                 StringRef) override {
+    return std::make_unique<ShardConsumer>(Request, Instr, Matched);
+  }
+
+private:
+  const ShardRequest &Request;
+  Instrumenter &Instr;
+  bool &Matched;
+};
+
+// Parses the translation unit of the request with a compiler instance of its
+// own and matches its shard, returns whether it was matched.
+bool matchShard(const ShardRequest &Request, bool IgnoreFunctionsWithMacros,
+                Instrumenter &Instr) {
+  // The eligible functions depend on the setting of the calling thread.
+  ScopedIgnoreFunctionsWithMacros Ignore(IgnoreFunctionsWithMacros);
+  CompilerInstance Clang(Request.PCHContainerOps);
+  Clang.setInvocation(Request.Invocation);
+  // The diagnostics are reported by the parse of the calling thread.
+  Clang.createDiagnostics(new IgnoringDiagConsumer, /*ShouldOwnClient=*/true);
+  Clang.setFileManager(new FileManager(Request.FileSystemOpts, Request.FS));
+  Clang.createSourceManager(Clang.getFileManager());
+  bool Matched = false;
+  ShardAction Action(Request, Instr, Matched);
+  return Clang.ExecuteAction(Action) && Matched;
+}
+
+} // namespace
+
+void matchSharded(CompilerInstance &CI, ASTContext &Context,
+                  unsigned NumThreads, InstrumenterMode Mode,
+                  Instrumenter &Instr) {
+  auto Strategy = llvm::hardware_concurrency(NumThreads);
+  auto NumShards = Strategy.compute_thread_count();
+  auto Scope = Context.getTraversalScope();
+  if (NumShards <= 1 || Scope.size() <= 1 || Context.getExternalSource() ||
+      !CI.getPreprocessorOpts().RemappedFiles.empty() ||
+      !CI.getPreprocessorOpts().RemappedFileBuffers.empty()) {
+    matchScope(Context, Scope, Instr);
+    return;
+  }
+
+  auto Shards = makeShards(Scope, NumShards, Context.getSourceManager());
+  // The invocations and instrumenters of the workers are created in the
+  // calling thread, the rules depend on its settings (see
+  // ScopedIgnoreFunctionsWithMacros).
+  std::vector<ShardRequest> Requests(Shards.size());
+  for (size_t I = 1; I < Shards.size(); ++I) {
+    auto Invocation = std::make_shared<CompilerInvocation>(CI.getInvocation());
+    // The calling thread writes the dependencies, if any.
+    Invocation->getDependencyOutputOpts() = DependencyOutputOptions();
+    Requests[I] = {NumShards,
+                   I,
+                   Scope.size(),
+                   std::move(Invocation),
+                   CI.getPCHContainerOperations(),
+                   CI.getFileSystemOpts(),
+                   CI.getFileManager().getVirtualFileSystemPtr()};
+  }
+  std::vector<std::map<std::string, tooling::Replacements>> Unused(
+      Shards.size());
+  std::vector<std::unique_ptr<Instrumenter>> ShardInstrs(Shards.size());
+  for (size_t I = 1; I < Shards.size(); ++I)
+    ShardInstrs[I] = makeInstrumenter(Mode, Unused[I]);
+  // std::vector<bool> packs its elements, which the workers write to.
+  std::unique_ptr<bool[]> Matched(new bool[Shards.size()]());
+
+  auto IgnoreFunctionsWithMacros = getIgnoreFunctionsWithMacros();
+  {
+    llvm::ThreadPool Pool(llvm::hardware_concurrency(NumShards - 1));
+    for (size_t I = 1; I < Shards.size(); ++I)
+      Pool.async([&, I] {
+        Matched[I] = matchShard(Requests[I], IgnoreFunctionsWithMacros,
+                                *ShardInstrs[I]);
+      });
+    matchScope(Context, Shards.front(), Instr);
+    Pool.wait();
+  }
+
+  auto NextID = Instr.numberMarkers(0);
+  for (size_t I = 1; I < Shards.size(); ++I) {
+    if (!Matched[I]) {
+      ShardInstrs[I] = makeInstrumenter(Mode, Unused[I]);
+      matchScope(Context, Shards[I], *ShardInstrs[I]);
+    }
+    NextID += ShardInstrs[I]->numberMarkers(NextID);
+    Instr.appendMoved(*ShardInstrs[I], 0);
+  }
+  Context.setTraversalScope(Scope);
+}
+
+} // namespace markers
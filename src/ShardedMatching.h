@@ -0,0 +1,33 @@
+#pragma once
+
+#include <clang/AST/ASTContext.h>
+#include <clang/Frontend/CompilerInstance.h>
+
+#include "Instrumentation.h"
+#include "Instrumenter.h"
+
+namespace markers {
+
+// Matches the rules of Instr, which must have been created for Mode, on the
+// traversal scope of Context, which CI parsed, with up to NumThreads threads
+// (0 uses all cores) and collects the edits and markers in Instr.
+//
+// The top-level declarations of the traversal scope are split into contiguous
+// shards of roughly equal source size, one per thread. The calling thread
+// matches the first shard on Context. Every other shard is matched by a
+// worker thread on its own parse of the translation unit, with its own
+// ASTContext, SourceManager and instrumenter, so the workers share no AST
+// state. The parsing is thus repeated, but in parallel, and only the matching
+// is split. The shards are appended to Instr in source order and renumbered,
+// so the result, including the marker IDs, is the same as the one of a
+// serial matchAST. A shard whose worker fails is matched by the calling
+// thread.
+//
+// Translation units with an external AST source (e.g., a PCH) or remapped
+// files, which the workers cannot parse in the same way, are matched
+// serially.
+void matchSharded(clang::CompilerInstance &CI, clang::ASTContext &Context,
+                  unsigned NumThreads, InstrumenterMode Mode,
+                  Instrumenter &Instr);
+
+} // namespace markers
@@ -0,0 +1,159 @@
+#include "Statistics.h"
+
+#include <clang/AST/RecursiveASTVisitor.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/Support/Format.h>
+
+#include <sys/resource.h>
+
+#include <vector>
+
+using namespace clang;
+
+namespace markers {
+
+namespace {
+
+void printTitle(llvm::raw_ostream &OS, llvm::StringRef Title) {
+  OS << "===" << std::string(73, '-') << "===\n";
+  OS.indent(Title.size() < 80 ? (80 - Title.size()) / 2 : 0) << Title << "\n";
+  OS << "===" << std::string(73, '-') << "===\n";
+}
+
+class NodeCounter : public RecursiveASTVisitor<NodeCounter> {
+public:
+  explicit NodeCounter(InstrumentationStats &Stats) : Stats{Stats} {}
+
+  bool shouldVisitTemplateInstantiations() const { return true; }
+  bool shouldVisitImplicitCode() const { return true; }
+
+  bool VisitDecl(Decl *) {
+    ++Stats.NumDecls;
+    return true;
+  }
+
+  bool VisitStmt(Stmt *) {
+    ++Stats.NumStmts;
+    return true;
+  }
+
+private:
+  InstrumentationStats &Stats;
+};
+
+} // namespace
+
+InstrumentationStats &
+InstrumentationStats::operator+=(const InstrumentationStats &Other) {
+  PeakRSS = std::max(PeakRSS, Other.PeakRSS);
+  ASTBytes += Other.ASTBytes;
+  NumDecls += Other.NumDecls;
+  NumStmts += Other.NumStmts;
+  NumTypes += Other.NumTypes;
+  NumLocalSLocEntries += Other.NumLocalSLocEntries;
+  for (const auto &[Rule, NumMatches] : Other.RuleMatches)
+    RuleMatches[Rule] += NumMatches;
+  NumReplacements += Other.NumReplacements;
+  ReplacementBytes += Other.ReplacementBytes;
+  return *this;
+}
+
+void InstrumentationStats::print(llvm::raw_ostream &OS,
+                                 llvm::StringRef Title) const {
+  printTitle(OS, Title);
+  auto PrintRow = [&](llvm::StringRef Name, uint64_t Value) {
+    OS << llvm::format("  %-28s %14llu\n", Name.str().c_str(),
+                       static_cast<unsigned long long>(Value));
+  };
+  PrintRow("peak RSS (bytes)", PeakRSS);
+  PrintRow("AST memory (bytes)", ASTBytes);
+  PrintRow("declarations", NumDecls);
+  PrintRow("statements", NumStmts);
+  PrintRow("types", NumTypes);
+  PrintRow("local SLoc entries", NumLocalSLocEntries);
+  for (const auto &[Rule, NumMatches] : RuleMatches)
+    PrintRow("matches of rule " + Rule, NumMatches);
+  PrintRow("replacements", NumReplacements);
+  PrintRow("replacement text (bytes)", ReplacementBytes);
+  OS << "\n";
+}
+
+llvm::json::Object InstrumentationStats::toJSON() const {
+  llvm::json::Object Matches;
+  for (const auto &[Rule, NumMatches] : RuleMatches)
+    Matches[Rule] = static_cast<int64_t>(NumMatches);
+  return llvm::json::Object{
+      {"peak_rss", static_cast<int64_t>(PeakRSS)},
+      {"ast_bytes", static_cast<int64_t>(ASTBytes)},
+      {"decls", static_cast<int64_t>(NumDecls)},
+      {"stmts", static_cast<int64_t>(NumStmts)},
+      {"types", static_cast<int64_t>(NumTypes)},
+      {"local_sloc_entries", static_cast<int64_t>(NumLocalSLocEntries)},
+      {"rule_matches", std::move(Matches)},
+      {"replacements", static_cast<int64_t>(NumReplacements)},
+      {"replacement_bytes", static_cast<int64_t>(ReplacementBytes)}};
+}
+
+MatcherProfile &MatcherProfile::operator+=(const MatcherProfile &Other) {
+  for (const auto &[Name, OtherEntry] : Other.Entries) {
+    auto &Entry = Entries[Name];
+    Entry.Time += OtherEntry.Time;
+    Entry.NumMatches += OtherEntry.NumMatches;
+  }
+  return *this;
+}
+
+void MatcherProfile::print(llvm::raw_ostream &OS,
+                           llvm::StringRef Title) const {
+  printTitle(OS, Title);
+  std::vector<std::pair<std::string, Entry>> Sorted(Entries.begin(),
+                                                    Entries.end());
+  llvm::stable_sort(Sorted, [](const auto &A, const auto &B) {
+    return A.second.Time.getWallTime() > B.second.Time.getWallTime();
+  });
+  OS << llvm::format("  %12s %12s %12s  %s\n", "wall (s)", "user+sys (s)",
+                     "matches", "rule");
+  for (const auto &[Name, Entry] : Sorted)
+    OS << llvm::format("  %12.4f %12.4f %12llu  %s\n",
+                       Entry.Time.getWallTime(), Entry.Time.getProcessTime(),
+                       static_cast<unsigned long long>(Entry.NumMatches),
+                       Name.c_str());
+  OS << "\n";
+}
+
+llvm::json::Object MatcherProfile::toJSON() const {
+  llvm::json::Object Rules;
+  for (const auto &[Name, Entry] : Entries)
+    Rules[Name] = llvm::json::Object{
+        {"wall", Entry.Time.getWallTime()},
+        {"user", Entry.Time.getUserTime()},
+        {"system", Entry.Time.getSystemTime()},
+        {"matches", static_cast<int64_t>(Entry.NumMatches)}};
+  return Rules;
+}
+
+void collectASTStats(ASTContext &Context, InstrumentationStats &Stats) {
+  Stats.ASTBytes =
+      Context.getASTAllocatedMemory() + Context.getSideTableAllocatedMemory();
+  Stats.NumTypes = Context.getTypes().size();
+  Stats.NumLocalSLocEntries =
+      Context.getSourceManager().local_sloc_entry_size();
+  // The declarations loaded from a PCH are not deserialized for counting.
+  NodeCounter Counter(Stats);
+  for (auto *D : Context.getTranslationUnitDecl()->noload_decls())
+    Counter.TraverseDecl(D);
+}
+
+uint64_t getPeakRSS() {
+  rusage Usage;
+  if (getrusage(RUSAGE_SELF, &Usage) != 0)
+    return 0;
+#ifdef __APPLE__
+  return Usage.ru_maxrss;
+#else
+  // Linux reports kilobytes.
+  return static_cast<uint64_t>(Usage.ru_maxrss) * 1024;
+#endif
+}
+
+} // namespace markers
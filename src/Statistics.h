@@ -0,0 +1,64 @@
+#pragma once
+
+#include <clang/AST/ASTContext.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/Timer.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+namespace markers {
+
+// The size of the inputs and outputs of instrumenting one or more files
+// (--print-stats), e.g., to size memory limits or to find the inputs on which
+// a rule matches unusually often.
+struct InstrumentationStats {
+  // The peak resident set size of the process, in bytes.
+  uint64_t PeakRSS = 0;
+  // The memory allocated for the AST, in bytes.
+  uint64_t ASTBytes = 0;
+  // The nodes of the whole translation unit, including the headers.
+  uint64_t NumDecls = 0;
+  uint64_t NumStmts = 0;
+  uint64_t NumTypes = 0;
+  uint64_t NumLocalSLocEntries = 0;
+  // The number of matches of each rule, by the name of the rule.
+  std::map<std::string, uint64_t> RuleMatches;
+  uint64_t NumReplacements = 0;
+  uint64_t ReplacementBytes = 0;
+
+  // Adds the counts of Other, the peak RSS is the maximum of both.
+  InstrumentationStats &operator+=(const InstrumentationStats &Other);
+
+  void print(llvm::raw_ostream &OS, llvm::StringRef Title) const;
+  llvm::json::Object toJSON() const;
+};
+
+// The time spent in the matchers and the callback of each rule, and its number
+// of matches, by the name of the function that makes the rule
+// (--profile-matchers). The time of the rules that a RuleDispatcher matches is
+// recorded under the name of the dispatcher.
+struct MatcherProfile {
+  struct Entry {
+    llvm::TimeRecord Time;
+    uint64_t NumMatches = 0;
+  };
+  std::map<std::string, Entry> Entries;
+
+  MatcherProfile &operator+=(const MatcherProfile &Other);
+
+  // Prints the entries by decreasing wall time.
+  void print(llvm::raw_ostream &OS, llvm::StringRef Title) const;
+  llvm::json::Object toJSON() const;
+};
+
+// Sets the AST statistics of Stats.
+void collectASTStats(clang::ASTContext &Context, InstrumentationStats &Stats);
+
+// The peak resident set size of the process so far, in bytes.
+uint64_t getPeakRSS();
+
+} // namespace markers
@@ -0,0 +1,83 @@
+#include "TraversalScope.h"
+
+#include <clang/AST/RecursiveASTVisitor.h>
+
+#include "CommandLine.h"
+#include "Matchers.h"
+
+using namespace clang;
+using namespace clang::ast_matchers;
+
+namespace markers {
+
+namespace {
+
+// Matches the statements of a declaration in the order in which
+// MatchFinder::matchAST visits them, i.e., a statement is matched when it is
+// traversed or, for the children of a statement, queued. All rules match with
+// TK_IgnoreUnlessSpelledInSource, so the code that is not spelled in the
+// source, which matchAST visits but does not match, is skipped.
+class StatementMatcher : public RecursiveASTVisitor<StatementMatcher> {
+public:
+  StatementMatcher(MatchFinder &Finder, ASTContext &Context)
+      : Finder{Finder}, Context{Context} {}
+
+  bool shouldVisitTemplateInstantiations() const { return false; }
+  bool shouldVisitImplicitCode() const { return false; }
+
+  bool TraverseDecl(Decl *D) {
+    if (const auto *FD = dyn_cast_or_null<FunctionDecl>(D))
+      if (FD->isDefaulted())
+        return true;
+    return RecursiveASTVisitor::TraverseDecl(D);
+  }
+
+  bool TraverseStmt(Stmt *S, DataRecursionQueue *Queue = nullptr) {
+    if (!S)
+      return true;
+    Finder.match(*S, Context);
+    return RecursiveASTVisitor::TraverseStmt(S, Queue);
+  }
+
+private:
+  MatchFinder &Finder;
+  ASTContext &Context;
+};
+
+} // namespace
+
+void restrictTraversalScopeToMainFile(ASTContext &Context) {
+  const auto &SM = Context.getSourceManager();
+  std::vector<Decl *> MainFileDecls;
+  for (auto *D : Context.getTranslationUnitDecl()->noload_decls()) {
+    auto Loc = D->getLocation();
+    if (Loc.isValid() && SM.isInMainFile(SM.getExpansionLoc(Loc)))
+      MainFileDecls.push_back(D);
+  }
+  Context.setTraversalScope(MainFileDecls);
+}
+
+void restrictTraversalScopeToEligibleFunctions(ASTContext &Context) {
+  if (Engine == MatchingEngine::Rules)
+    return;
+  SharedRuleChecks Checks;
+  std::vector<Decl *> Eligible;
+  auto Add = [&](Decl *D, const auto &Add) -> void {
+    if (isa<NamespaceDecl>(D) || isa<LinkageSpecDecl>(D)) {
+      for (auto *Child : cast<DeclContext>(D)->noload_decls())
+        Add(Child, Add);
+      return;
+    }
+    if (Checks.mayMatchIn(*D, Context))
+      Eligible.push_back(D);
+  };
+  for (auto *D : Context.getTraversalScope())
+    Add(D, Add);
+  Context.setTraversalScope(Eligible);
+}
+
+void matchStatements(MatchFinder &Finder, Decl *D, ASTContext &Context) {
+  StatementMatcher(Finder, Context).TraverseDecl(D);
+}
+
+} // namespace markers
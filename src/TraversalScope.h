@@ -0,0 +1,30 @@
+#pragma once
+
+#include <clang/AST/ASTContext.h>
+#include <clang/ASTMatchers/ASTMatchFinder.h>
+
+namespace markers {
+
+// The rules only instrument code in the main file, so the traversal is
+// limited to its top-level declarations and the declarations pulled in from
+// headers are never visited. The declarations loaded from a PCH all stem from
+// headers and are thus not deserialized.
+void restrictTraversalScopeToMainFile(clang::ASTContext &Context);
+
+// Removes the declarations of the traversal scope in which no rule can match
+// as none of their functions passes the function checks of the rules, e.g.,
+// constexpr functions or, with --ignore-functions-with-macros, functions with
+// macros. Their statements are thus never visited. Namespaces and linkage
+// specifications are replaced by their declarations, so that the functions in
+// them are filtered one by one. The functions are judged by their properties
+// alone, the bodies of the removed ones are never walked. With --engine=rules
+// the scope is kept.
+void restrictTraversalScopeToEligibleFunctions(clang::ASTContext &Context);
+
+// Runs the matchers of Finder on the statements of D in the order in which
+// MatchFinder::matchAST visits them. Only code that is spelled in the source
+// is visited, as all rules match with TK_IgnoreUnlessSpelledInSource.
+void matchStatements(clang::ast_matchers::MatchFinder &Finder, clang::Decl *D,
+                     clang::ASTContext &Context);
+
+} // namespace markers
@@ -1,11 +1,13 @@
 #include "ValueRangeInstrumenter.h"
 
+#include <clang/AST/RecursiveASTVisitor.h>
 #include <clang/ASTMatchers/ASTMatchers.h>
+#include <llvm/ADT/DenseMap.h>
 #include <llvm/Support/Error.h>
-#include <sstream>
 #include <string>
 
 #include "CommandLine.h"
+#include "ContextCache.h"
 #include "Matchers.h"
 #include "RangeSelectors.h"
 
@@ -53,46 +55,207 @@ AST_MATCHER(VarDecl, hasNotEnumType) {
   return !TD->isEnum();
 };
 
-auto valueRangeRule() {
-  auto matcher = stmt(
+namespace {
+
+// Whether the value range of VD can be tested, as checked by
+// referenceValueRangeRule: an integer but not an enum, and a parameter or
+// initialized.
+bool isRangeVariable(const VarDecl &VD) {
+  if (!VD.getType()->isIntegerType())
+    return false;
+  if (const auto *TD = VD.getType()->getAsTagDecl(); TD && TD->isEnum())
+    return false;
+  return isa<ParmVarDecl>(VD) || VD.getAnyInitializer();
+}
+
+// The range variables declared in a function and the variables referenced in
+// it, in traversal order, and for each statement the references and
+// declarations within it. Built in one walk over the function.
+class RangeVariableIndex : public RecursiveASTVisitor<RangeVariableIndex> {
+public:
+  explicit RangeVariableIndex(const FunctionDecl &FD) {
+    auto &Function = const_cast<FunctionDecl &>(FD);
+    for (auto *Param : Function.parameters())
+      TraverseDecl(Param);
+    TraverseStmt(Function.getBody());
+  }
+
+  bool shouldVisitTemplateInstantiations() const { return false; }
+  bool shouldVisitImplicitCode() const { return false; }
+
+  bool VisitVarDecl(VarDecl *VD) {
+    if (isRangeVariable(*VD) && Indexes.try_emplace(VD, Vars.size()).second)
+      Vars.push_back(VD);
+    return true;
+  }
+
+  // Every statement is traversed between these two calls, also those that are
+  // queued by the data recursion of RecursiveASTVisitor.
+  bool dataTraverseStmtPre(Stmt *S) {
+    // The reference of a DeclRefExpr is not within it.
+    if (const auto *Ref = dyn_cast<DeclRefExpr>(S))
+      if (const auto *VD = dyn_cast<VarDecl>(Ref->getDecl()))
+        Refs.push_back(VD);
+    Open.push_back({Refs.size(), Vars.size()});
+    return true;
+  }
+
+  bool dataTraverseStmtPost(Stmt *S) {
+    auto Range = Open.pop_back_val();
+    Ranges.try_emplace(S, Range.FirstRef, Refs.size(), Range.FirstVar,
+                       Vars.size());
+    return true;
+  }
+
+  // The range variables of the function that are referenced within S but not
+  // declared within it, in the order of their declarations.
+  std::vector<const VarDecl *> getReferencedVariables(const Stmt &S) const {
+    auto It = Ranges.find(&S);
+    if (It == Ranges.end())
+      return {};
+    const auto &Range = It->second;
+    std::vector<size_t> Found;
+    for (size_t I = Range.FirstRef; I < Range.EndRef; ++I) {
+      auto Index = Indexes.find(Refs[I]);
+      if (Index != Indexes.end() &&
+          (Index->second < Range.FirstVar || Index->second >= Range.EndVar))
+        Found.push_back(Index->second);
+    }
+    llvm::sort(Found);
+    Found.erase(std::unique(Found.begin(), Found.end()), Found.end());
+    std::vector<const VarDecl *> Referenced;
+    for (auto Index : Found)
+      Referenced.push_back(Vars[Index]);
+    return Referenced;
+  }
+
+private:
+  struct OpenStmt {
+    size_t FirstRef;
+    size_t FirstVar;
+  };
+  struct StmtRange {
+    StmtRange(size_t FirstRef, size_t EndRef, size_t FirstVar, size_t EndVar)
+        : FirstRef{FirstRef}, EndRef{EndRef}, FirstVar{FirstVar},
+          EndVar{EndVar} {}
+    size_t FirstRef, EndRef;
+    size_t FirstVar, EndVar;
+  };
+
+  std::vector<const VarDecl *> Vars;
+  llvm::DenseMap<const VarDecl *, size_t> Indexes;
+  std::vector<const VarDecl *> Refs;
+  llvm::SmallVector<OpenStmt, 32> Open;
+  llvm::DenseMap<const Stmt *, StmtRange> Ranges;
+};
+
+// The indexes of the functions of a translation unit.
+struct RangeVariableIndexes {
+  explicit RangeVariableIndexes(ASTContext &) {}
+  llvm::DenseMap<const FunctionDecl *, std::unique_ptr<RangeVariableIndex>>
+      Functions;
+};
+
+const RangeVariableIndex &getRangeVariableIndex(const FunctionDecl &FD,
+                                                ASTContext &Context) {
+  auto &Index = ContextCaches::of(Context)
+                    .get<RangeVariableIndexes>()
+                    .Functions[&FD];
+  if (!Index)
+    Index = std::make_unique<RangeVariableIndex>(FD);
+  return *Index;
+}
+
+// Binds "var" to each range variable that the statement references but does
+// not declare, in the innermost enclosing function with such variables, like
+// the hasAncestor(functionDecl(forEachDescendant(...))) of
+// referenceValueRangeRule but with one walk per function.
+AST_MATCHER(Stmt, forEachReferencedRangeVariable) {
+  auto &Context = Finder->getASTContext();
+  auto Functions = getEnclosingFunctions(Node, Context);
+  for (auto It = Functions.rbegin(); It != Functions.rend(); ++It) {
+    auto Vars =
+        getRangeVariableIndex(**It, Context).getReferencedVariables(Node);
+    if (Vars.empty())
+      continue;
+    clang::ast_matchers::internal::BoundNodesTreeBuilder Result;
+    for (const auto *VD : Vars) {
+      auto Match = *Builder;
+      Match.setBinding("var", DynTypedNode::create(*VD));
+      Result.addMatch(Match);
+    }
+    *Builder = std::move(Result);
+    return true;
+  }
+  return false;
+}
+
+// The statements before which value range markers may be inserted.
+auto valueRangeStatement() {
+  return stmt(
       isNotInConstexprOrConstevalFunction(), isNotInFunctionWithMacrosMatcher(),
-      inMainAndNotMacro(), stmt().bind("stmt"),
+      isInSelectedCode(), inMainAndNotMacro(), stmt().bind("stmt"),
       /*Restrict to statements within compounds or within case/default(s)
        * so that we don't need to worry about cases such as if(C) STMT;*/
       anyOf(hasParent(compoundStmt()), hasParent(switchCase())),
       unless(compoundStmt()),
       /* We don't want to instrument before a case/default */
-      unless(switchCase()),
-      hasAncestor(
-          /* Find all variables declared within the surrounding function*/
-          functionDecl(forEachDescendant(varDecl(
-              varDecl(hasType(isInteger()),
-                      anyOf(parmVarDecl(), hasInitializer(anything())))
-                  .bind("var"),
-              // Don't instrument enum variables
-              hasNotEnumType(),
-              hasAncestor(
-                  /* Filter for variables used in declRefExprs within the
-                   * matches statement, we need some shenanigans to add a
-                   * filter based on the original statement by finding it
-                   * via the surrounding function*/
-                  functionDecl(hasDescendant(stmt(
-                      equalsBoundNode("stmt"),
-                      /* We don't want variables that are declared within this
-                       * statement, e.g., for(int i = 0; i < N; ++i) */
-                      unless(hasDescendant(varDecl(equalsBoundNode("var")))),
-                      hasDescendant(
-                          declRefExpr(to(varDecl(equalsBoundNode("var"))))
-                              .bind("ref")))))))))));
-  return makeRule(matcher,
+      unless(switchCase()));
+}
+
+auto makeValueRangeRule(
+    clang::ast_matchers::internal::Matcher<Stmt> Variables) {
+  return makeRule(stmt(valueRangeStatement(), std::move(Variables)),
                   addVRMarkerBefore(statementWithMacrosExpanded("stmt"),
                                     makeVRMacroStencil()));
-};
+}
+
+auto valueRangeRule() {
+  return makeValueRangeRule(forEachReferencedRangeVariable());
+}
+
+// Finds the variables with matchers, which walk the function for every
+// statement and variable (--engine=rules).
+auto referenceValueRangeRule() {
+  return makeValueRangeRule(hasAncestor(
+      /* Find all variables declared within the surrounding function*/
+      functionDecl(forEachDescendant(varDecl(
+          varDecl(hasType(isInteger()),
+                  anyOf(parmVarDecl(), hasInitializer(anything())))
+              .bind("var"),
+          // Don't instrument enum variables
+          hasNotEnumType(),
+          hasAncestor(
+              /* Filter for variables used in declRefExprs within the
+               * matches statement, we need some shenanigans to add a
+               * filter based on the original statement by finding it
+               * via the surrounding function*/
+              functionDecl(hasDescendant(stmt(
+                  equalsBoundNode("stmt"),
+                  /* We don't want variables that are declared within this
+                   * statement, e.g., for(int i = 0; i < N; ++i) */
+                  unless(hasDescendant(varDecl(equalsBoundNode("var")))),
+                  hasDescendant(
+                      declRefExpr(to(varDecl(equalsBoundNode("var"))))
+                          .bind("ref")))))))))));
+}
+
+} // namespace
+
+RuleList ValueRangeInstrumenter::makeRules() {
+  if (!isRuleEnabled(RuleKind::VR))
+    return {};
+  if (Engine == MatchingEngine::Rules)
+    return {{RuleKind::VR, "referenceValueRangeRule",
+             referenceValueRangeRule()}};
+  return {{RuleKind::VR, "valueRangeRule", valueRangeRule()}};
+}
 
 ValueRangeInstrumenter::ValueRangeInstrumenter(
     std::map<std::string, clang::tooling::Replacements> &FileToReplacements)
-    : FileToReplacements{FileToReplacements},
-      Rules{{valueRangeRule(), Replacements, FileToNumberMarkerDecls}} {}
+    : Instrumenter{FileToReplacements} {
+  addRules(makeRules());
+}
 
 std::string ValueRangeInstrumenter::makeMarkerMacros(size_t MarkerID) {
   auto ID = std::to_string(MarkerID);
@@ -116,58 +279,25 @@ std::string ValueRangeInstrumenter::makeMarkerMacros(size_t MarkerID) {
          ID + "_\n#define VRMarkerUpperBound" + ID + "_ 0\n#endif\n";
 }
 
-void ValueRangeInstrumenter::applyReplacements() {
-  if (FileToReplacements.size() > 1)
-    llvm_unreachable("ValueRangeInstrumenter only supports one file");
-
-  if (NoPreprocessorDirectives) {
-    for (const auto &[File, NumberMarkerDecls] : FileToNumberMarkerDecls) {
-      llvm::outs() << "//MARKERS START\n";
-      for (size_t i = 0; i < NumberMarkerDecls; ++i)
-        llvm::outs() << "VRMarker" << i << "_\n";
-      llvm::outs() << "//MARKERS END\n";
-    }
-  } else
-    for (const auto &[File, NumberMarkerDecls] : FileToNumberMarkerDecls) {
-      std::stringstream ss;
-      auto gen = [i = 0]() mutable {
-        auto m = i++;
-        return makeMarkerMacros(m);
-      };
-      ss << "//MARKERS START\n";
-      std::generate_n(std::ostream_iterator<std::string>(ss), NumberMarkerDecls,
-                      gen);
-      ss << "//MARKERS END\n";
-      auto Decls = ss.str();
-      auto R = Replacement(File, 0, 0, Decls);
-      if (auto Err = FileToReplacements[File].add(R))
-        llvm_unreachable(llvm::toString(std::move(Err)).c_str());
-    }
-
-  for (auto Rit = Replacements.rbegin(); Rit != Replacements.rend(); ++Rit) {
-    auto &R = *Rit;
-    auto &Replacements = FileToReplacements[std::string(R.getFilePath())];
-    auto Err = Replacements.add(R);
-    if (Err) {
-      auto NewOffset = Replacements.getShiftedCodePosition(R.getOffset());
-      auto NewLength =
-          Replacements.getShiftedCodePosition(R.getOffset() + R.getLength()) -
-          NewOffset;
-      if (NewLength == R.getLength()) {
-        R = Replacement(R.getFilePath(), NewOffset, NewLength,
-                        R.getReplacementText());
-        Replacements = Replacements.merge(tooling::Replacements(R));
-      } else {
-        llvm_unreachable(llvm::toString(std::move(Err)).c_str());
-      }
-    }
-  }
+std::string ValueRangeInstrumenter::makeCompactMarkerMacros(size_t MarkerID) {
+  auto ID = std::to_string(MarkerID);
+  auto Macros = "void VRMarker" + ID + "_(void);\n#define VRMARKERMACRO" + ID +
+                "_(VAR, TYPE) MARKERS_VR(" + ID + ", VAR)\n";
+  // The bounds are plain values, whether they are overridden can thus only be
+  // tested with #ifndef.
+  for (const char *Bound : {"VRMarkerLowerBound", "VRMarkerUpperBound"})
+    Macros += "#ifndef " + (Bound + ID) + "_\n#define " + Bound + ID +
+              "_ 0\n#endif\n";
+  return Macros;
 }
 
-void ValueRangeInstrumenter::registerMatchers(
-    clang::ast_matchers::MatchFinder &Finder) {
-  for (auto &Rule : Rules)
-    Rule.registerMatchers(Finder);
+std::string ValueRangeInstrumenter::makeDispatchMacro() {
+  return "#define MARKERS_VR(ID, VAR)"
+         " MARKERS_IF(MARKERS_IS_SET(DisableVRMarker##ID##_), ,"
+         " if (!(VRMarkerLowerBound##ID##_ <= (VAR) &&"
+         " (VAR) <= VRMarkerUpperBound##ID##_))"
+         " MARKERS_IF(MARKERS_IS_SET(UnreachableVRMarker##ID##_),"
+         " __builtin_unreachable();, VRMarker##ID##_();))\n";
 }
 
 } // namespace markers
@@ -1,27 +1,21 @@
 #pragma once
 
-#include "ASTEdits.h"
+#include "Instrumenter.h"
 
 namespace markers {
 
-// TODO: Make a common parent class for all instrumenters?
-class ValueRangeInstrumenter {
+// Adds VRMarkers that test the value ranges of integer variables
+class ValueRangeInstrumenter : public Instrumenter {
 public:
   ValueRangeInstrumenter(
       std::map<std::string, clang::tooling::Replacements> &FileToReplacements);
-  ValueRangeInstrumenter(ValueRangeInstrumenter &&) = delete;
-  ValueRangeInstrumenter(const ValueRangeInstrumenter &) = delete;
-
-  void registerMatchers(clang::ast_matchers::MatchFinder &Finder);
-  void applyReplacements();
 
   static std::string makeMarkerMacros(size_t MarkerID);
-
-private:
-  std::map<std::string, clang::tooling::Replacements> &FileToReplacements;
-  std::vector<RuleActionEditCollector> Rules;
-  std::vector<clang::tooling::Replacement> Replacements;
-  std::map<std::string, size_t> FileToNumberMarkerDecls;
+  // The entry of the marker in the compact directives and the shared macro
+  // that these entries expand to (--directive-style=compact).
+  static std::string makeCompactMarkerMacros(size_t MarkerID);
+  static std::string makeDispatchMacro();
+  static RuleList makeRules();
 };
 
 } // namespace markers
@@ -0,0 +1,170 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <llvm/Support/Error.h>
+
+#include <string>
+#include <vector>
+
+#include <Instrumentation.h>
+#include <Instrumenter.h>
+
+namespace {
+
+// Every thread gets its own instrumenter (and header cache), so threads that
+// released the GIL can instrument concurrently.
+markers::CodeInstrumenter &getThreadInstrumenter() {
+  thread_local markers::CodeInstrumenter Instrumenter;
+  return Instrumenter;
+}
+
+// Sets Key to Value in Dict and releases Value.
+bool setItem(PyObject *Dict, const char *Key, PyObject *Value) {
+  if (!Value)
+    return false;
+  auto Result = PyDict_SetItemString(Dict, Key, Value);
+  Py_DECREF(Value);
+  return Result == 0;
+}
+
+PyObject *toPyString(const std::string &S) {
+  return PyUnicode_DecodeUTF8(S.data(), static_cast<Py_ssize_t>(S.size()),
+                              "surrogateescape");
+}
+
+// The same record as in the --manifest output of program-markers.
+PyObject *toPyDict(const markers::MarkerInfo &Info) {
+  PyObject *Dict = PyDict_New();
+  if (!Dict)
+    return nullptr;
+  auto IsVR = Info.Kind == markers::MarkerKind::VR;
+  if (!setItem(Dict, "kind", PyUnicode_FromString(IsVR ? "vr" : "dce")) ||
+      !setItem(Dict, "id", PyLong_FromSize_t(Info.ID)) ||
+      !setItem(Dict, "name",
+               toPyString(markers::makeMarkerName(Info.Kind, Info.ID))) ||
+      !setItem(Dict, "offset", PyLong_FromUnsignedLong(Info.Offset)) ||
+      !setItem(Dict, "line", PyLong_FromUnsignedLong(Info.Line)) ||
+      !setItem(Dict, "column", PyLong_FromUnsignedLong(Info.Column)) ||
+      !setItem(Dict, "function", toPyString(Info.Function)) ||
+      (IsVR && (!setItem(Dict, "variable", toPyString(Info.Variable)) ||
+                !setItem(Dict, "type", toPyString(Info.Type))))) {
+    Py_DECREF(Dict);
+    return nullptr;
+  }
+  return Dict;
+}
+
+bool parseFlags(PyObject *FlagsObject, std::vector<std::string> &Flags) {
+  if (!FlagsObject)
+    return true;
+  PyObject *Sequence =
+      PySequence_Fast(FlagsObject, "flags must be a sequence of strings");
+  if (!Sequence)
+    return false;
+  for (Py_ssize_t I = 0, E = PySequence_Fast_GET_SIZE(Sequence); I < E; ++I) {
+    Py_ssize_t Size;
+    const char *Flag =
+        PyUnicode_AsUTF8AndSize(PySequence_Fast_GET_ITEM(Sequence, I), &Size);
+    if (!Flag) {
+      Py_DECREF(Sequence);
+      return false;
+    }
+    Flags.emplace_back(Flag, static_cast<size_t>(Size));
+  }
+  Py_DECREF(Sequence);
+  return true;
+}
+
+PyObject *instrument(PyObject *, PyObject *Args, PyObject *Kwargs) {
+  const char *Code;
+  Py_ssize_t CodeSize;
+  PyObject *FlagsObject = nullptr;
+  const char *ModeName = "dce";
+  const char *FileName = "input.c";
+  int IgnoreFunctionsWithMacros = 0;
+  static const char *Keywords[] = {
+      "code", "flags", "mode", "file", "ignore_functions_with_macros", nullptr};
+  if (!PyArg_ParseTupleAndKeywords(
+          Args, Kwargs, "s#|Ossp", const_cast<char **>(Keywords), &Code,
+          &CodeSize, &FlagsObject, &ModeName, &FileName,
+          &IgnoreFunctionsWithMacros))
+    return nullptr;
+
+  std::vector<std::string> Flags;
+  if (!parseFlags(FlagsObject, Flags))
+    return nullptr;
+  auto Mode = markers::parseInstrumenterMode(ModeName);
+  if (!Mode) {
+    PyErr_Format(PyExc_ValueError, "unknown mode %s", ModeName);
+    return nullptr;
+  }
+
+  markers::InstrumentedFile Result;
+  std::string Error;
+  // The python side emits the marker directives itself.
+  markers::CodeInstrumenterOptions Options;
+  Options.IgnoreFunctionsWithMacros = IgnoreFunctionsWithMacros != 0;
+  Options.NoPreprocessorDirectives = true;
+  Py_BEGIN_ALLOW_THREADS;
+  auto Instrumented = getThreadInstrumenter().instrument(
+      llvm::StringRef(Code, static_cast<size_t>(CodeSize)), FileName, Flags,
+      *Mode, Options);
+  if (Instrumented)
+    Result = std::move(*Instrumented);
+  else
+    Error = llvm::toString(Instrumented.takeError());
+  Py_END_ALLOW_THREADS;
+
+  if (!Error.empty()) {
+    PyErr_SetString(PyExc_RuntimeError, Error.c_str());
+    return nullptr;
+  }
+
+  PyObject *Markers = PyList_New(0);
+  if (!Markers)
+    return nullptr;
+  for (const auto &Info : Result.Manifest) {
+    PyObject *Marker = toPyDict(Info);
+    if (!Marker || PyList_Append(Markers, Marker) != 0) {
+      Py_XDECREF(Marker);
+      Py_DECREF(Markers);
+      return nullptr;
+    }
+    Py_DECREF(Marker);
+  }
+  PyObject *InstrumentedCode = toPyString(Result.Code);
+  if (!InstrumentedCode) {
+    Py_DECREF(Markers);
+    return nullptr;
+  }
+  return Py_BuildValue("(NN)", InstrumentedCode, Markers);
+}
+
+PyMethodDef Methods[] = {
+    {"instrument",
+     reinterpret_cast<PyCFunction>(reinterpret_cast<void *>(instrument)),
+     METH_VARARGS | METH_KEYWORDS,
+     "instrument(code, flags=[], mode='dce', file='input.c', "
+     "ignore_functions_with_macros=False) -> (code, markers)\n\n"
+     "Instruments code, compiled with flags as a file named file, in "
+     "process. mode is 'dce', 'vr' or 'dce,vr'. Returns the instrumented "
+     "code without marker directives and a list with a manifest record "
+     "for each marker. The GIL is released while instrumenting."},
+    {nullptr, nullptr, 0, nullptr}};
+
+PyModuleDef Module = {PyModuleDef_HEAD_INIT,
+                      "_program_markers",
+                      "In-process bindings of the program-markers "
+                      "instrumenter.",
+                      -1,
+                      Methods,
+                      nullptr,
+                      nullptr,
+                      nullptr,
+                      nullptr};
+
+} // namespace
+
+PyMODINIT_FUNC PyInit__program_markers() {
+  return PyModule_Create(&Module);
+}
@@ -1,72 +1,399 @@
-#include "ValueRangeInstrumenter.h"
-#include <clang/Frontend/TextDiagnosticPrinter.h>
-#include <clang/Rewrite/Core/Rewriter.h>
+#include <clang/Tooling/AllTUsExecution.h>
 #include <clang/Tooling/CommonOptionsParser.h>
-#include <clang/Tooling/Refactoring.h>
+#include <clang/Tooling/Tooling.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
 #include <llvm/Support/raw_ostream.h>
-#include <type_traits>
+#include <algorithm>
+#include <iostream>
+#include <mutex>
+#include <optional>
 
 #include <CommandLine.h>
-#include <DCEInstrumenter.h>
-#include <ValueRangeInstrumenter.h>
+#include <IncrementalInstrumentation.h>
+#include <Instrumentation.h>
+#include <Matchers.h>
 
 using namespace llvm;
 using namespace clang;
 using namespace clang::tooling;
-using namespace clang::ast_matchers;
 
 namespace {
 
-enum class ToolMode { InstrumentBranches, InstrumentValueRanges };
-
-cl::opt<ToolMode>
-    Mode("mode", cl::desc("program-markers mode:"),
-         cl::values(clEnumValN(ToolMode::InstrumentBranches, "dce",
-                               "Only canonicalize and instrument branches with "
-                               "DCE markers (default)"),
-                    clEnumValN(ToolMode::InstrumentValueRanges, "vr",
-                               "Only instrument for value ranges")),
-         cl::init(ToolMode::InstrumentBranches),
-         cl::cat(markers::ProgramMarkersOptions));
-
-template <typename InstrTool> int runToolOnCode(RefactoringTool &Tool) {
-  InstrTool Instr(Tool.getReplacements());
-  ast_matchers::MatchFinder Finder;
-  Instr.registerMatchers(Finder);
-  std::unique_ptr<tooling::FrontendActionFactory> Factory =
-      tooling::newFrontendActionFactory(&Finder);
-
-  auto Ret = Tool.run(Factory.get());
-  if (!Ret)
-    Instr.applyReplacements();
-  return Ret;
+cl::opt<markers::InstrumenterMode> Mode(
+    "mode", cl::desc("program-markers mode:"),
+    cl::values(clEnumValN(markers::InstrumenterMode::DCE, "dce",
+                          "Only canonicalize and instrument branches with "
+                          "DCE markers (default)"),
+               clEnumValN(markers::InstrumenterMode::VR, "vr",
+                          "Only instrument for value ranges"),
+               clEnumValN(markers::InstrumenterMode::DCEAndVR, "dce,vr",
+                          "Instrument with DCE and value range markers in a "
+                          "single pass, the markers share one ID space")),
+    cl::init(markers::InstrumenterMode::DCE),
+    cl::cat(markers::ProgramMarkersOptions));
+
+cl::opt<bool>
+    AllTUs("all-tus",
+           cl::desc("Instrument every translation unit in the compilation "
+                    "database concurrently, the source paths are only used "
+                    "to locate the database (default: false)."),
+           cl::init(false), cl::cat(markers::ProgramMarkersOptions));
+
+cl::opt<unsigned> Jobs("jobs",
+                       cl::desc("The number of threads used with --all-tus, 0 "
+                                "uses all hardware threads (default: 0)."),
+                       cl::init(0), cl::cat(markers::ProgramMarkersOptions));
+
+cl::opt<bool> Server(
+    "server",
+    cl::desc("Run as a long-lived instrumentation server instead of "
+             "instrumenting the source paths: read one JSON request per line "
+             "from stdin and answer each with one JSON line on stdout "
+             "(default: false)."),
+    cl::init(false), cl::cat(markers::ProgramMarkersOptions));
+
+cl::opt<unsigned> MaxSessions(
+    "max-sessions",
+    cl::desc("The number of incremental sessions that the server keeps, the "
+             "least recently used one is closed to open another one "
+             "(default: 8)."),
+    cl::init(8), cl::cat(markers::ProgramMarkersOptions));
+
+cl::opt<bool> Stdin("stdin",
+                    cl::desc("Read the contents of the (single) source path "
+                             "from stdin instead of the file system, implies "
+                             "--stdout (default: false)."),
+                    cl::init(false), cl::cat(markers::ProgramMarkersOptions));
+
+cl::opt<bool>
+    Stdout("stdout",
+           cl::desc("Write the instrumented code of the (single) source path "
+                    "to stdout instead of overwriting it (default: false)."),
+           cl::init(false), cl::cat(markers::ProgramMarkersOptions));
+
+cl::opt<int> MarkersFD(
+    "markers-fd",
+    cl::desc("The file descriptor the marker names are written to with "
+             "--no-preprocessor-directives (default: 1, i.e., stdout)."),
+    cl::init(1), cl::cat(markers::ProgramMarkersOptions));
+
+cl::opt<std::string> ManifestPath(
+    "manifest",
+    cl::desc("Write a JSON manifest of the inserted markers to this path, "
+             "with the kind, ID, location, enclosing function and, for VR "
+             "markers, the variable and its type of each marker."),
+    cl::init(""), cl::cat(markers::ProgramMarkersOptions));
+
+enum class TimePhasesFormat { Table, JSON };
+
+cl::opt<TimePhasesFormat> TimePhasesFormatOption(
+    "time-phases-format", cl::desc("The format of the --time-phases report:"),
+    cl::values(clEnumValN(TimePhasesFormat::Table, "table",
+                          "A human readable table of the total times "
+                          "(default)"),
+               clEnumValN(TimePhasesFormat::JSON, "json",
+                          "A JSON object with the times of each file and the "
+                          "total times")),
+    cl::init(TimePhasesFormat::Table), cl::cat(markers::ProgramMarkersOptions));
+
+void printMarkerNames(llvm::raw_ostream &OS,
+                      const std::vector<std::string> &Markers) {
+  if (Markers.empty())
+    return;
+  OS << "//MARKERS START\n";
+  for (const auto &Marker : Markers)
+    OS << Marker << "\n";
+  OS << "//MARKERS END\n";
 }
 
-bool applyReplacements(RefactoringTool &Tool) {
-  LangOptions DefaultLangOptions;
-  IntrusiveRefCntPtr<DiagnosticOptions> DiagOpts = new DiagnosticOptions();
-  clang::TextDiagnosticPrinter DiagnosticPrinter(errs(), &*DiagOpts);
-  DiagnosticsEngine Diagnostics(
-      IntrusiveRefCntPtr<DiagnosticIDs>(new DiagnosticIDs()), &*DiagOpts,
-      &DiagnosticPrinter, false);
-  auto &FileMgr = Tool.getFiles();
-  SourceManager Sources(Diagnostics, FileMgr);
+// Like Rewriter::overwriteChangedFiles, a file is only written if its
+// contents change, so that unchanged files keep their modification times.
+bool writeFile(StringRef Path, StringRef Contents) {
+  if (auto Existing = llvm::MemoryBuffer::getFile(Path))
+    if ((*Existing)->getBuffer() == Contents)
+      return true;
+  std::error_code EC;
+  llvm::raw_fd_ostream OS(Path, EC, llvm::sys::fs::OF_None);
+  if (EC) {
+    llvm::errs() << "Could not open " << Path << ": " << EC.message() << "\n";
+    return false;
+  }
+  OS << Contents;
+  return true;
+}
 
-  Rewriter Rewrite(Sources, DefaultLangOptions);
+// Runs the actions of Inner only for the first compile command of each main
+// file. The instrumented file is written after its first command, so a later
+// command would instrument the already instrumented file again.
+class FirstCommandOnlyFactory : public FrontendActionFactory {
+public:
+  explicit FirstCommandOnlyFactory(std::unique_ptr<FrontendActionFactory> Inner)
+      : Inner{std::move(Inner)} {}
 
-  bool Result = true;
-  for (const auto &FileAndReplaces : groupReplacementsByFile(
-           Rewrite.getSourceMgr().getFileManager(), Tool.getReplacements())) {
-    auto &CurReplaces = FileAndReplaces.second;
+  std::unique_ptr<FrontendAction> create() override { return Inner->create(); }
 
-    Result = applyAllReplacements(CurReplaces, Rewrite) && Result;
+  bool runInvocation(std::shared_ptr<CompilerInvocation> Invocation,
+                     FileManager *Files,
+                     std::shared_ptr<PCHContainerOperations> PCHContainerOps,
+                     DiagnosticConsumer *DiagConsumer) override {
+    const auto &Inputs = Invocation->getFrontendOpts().Inputs;
+    if (!Inputs.empty() && Inputs.front().isFile()) {
+      SmallString<256> Path(Inputs.front().getFile());
+      Files->makeAbsolutePath(Path);
+      llvm::sys::path::remove_dots(Path, /*remove_dot_dot=*/true);
+      std::lock_guard<std::mutex> Lock(Mutex);
+      if (!Seen.insert(Path).second)
+        return true;
+    }
+    return Inner->runInvocation(std::move(Invocation), Files,
+                                std::move(PCHContainerOps), DiagConsumer);
   }
-  if (!Result) {
-    llvm::errs() << "Failed applying all replacements.\n";
+
+private:
+  std::unique_ptr<FrontendActionFactory> Inner;
+  std::mutex Mutex;
+  llvm::StringSet<> Seen;
+};
+
+llvm::json::Value toJSONString(StringRef S) {
+  if (llvm::json::isUTF8(S))
+    return S.str();
+  return llvm::json::fixUTF8(S);
+}
+
+llvm::json::Array
+manifestToJSON(const std::vector<markers::MarkerInfo> &Manifest) {
+  llvm::json::Array Markers;
+  for (const auto &Marker : Manifest)
+    Markers.push_back(Marker);
+  return Markers;
+}
+
+// The manifest is an object {"files": [{"file": ..., "markers": [...]}]},
+// the locations of the markers refer to the uninstrumented files.
+bool writeManifest(StringRef Path,
+                   const std::vector<markers::InstrumentedFile> &Files) {
+  llvm::json::Array FileManifests;
+  for (const auto &File : Files)
+    FileManifests.push_back(
+        llvm::json::Object{{"file", toJSONString(File.File)},
+                           {"markers", manifestToJSON(File.Manifest)}});
+
+  std::error_code EC;
+  llvm::raw_fd_ostream OS(Path, EC, llvm::sys::fs::OF_Text);
+  if (EC) {
+    llvm::errs() << "Could not open " << Path << ": " << EC.message() << "\n";
     return false;
   }
+  OS << llvm::json::Object{{"files", std::move(FileManifests)}} << "\n";
+  return true;
+}
+
+// The incremental instrumenters of the sessions of the server, by the names
+// of the sessions. At most --max-sessions are kept.
+class IncrementalSessions {
+public:
+  // The instrumenter of the session Name, which is reopened if it was created
+  // with other arguments.
+  markers::IncrementalInstrumenter &get(StringRef Name, StringRef FileName,
+                                        ArrayRef<std::string> Flags,
+                                        markers::InstrumenterMode Mode) {
+    auto &Session = Sessions[Name.str()];
+    Session.LastUse = ++Uses;
+    if (!Session.Instrumenter ||
+        !Session.Instrumenter->isFor(FileName, Flags, Mode))
+      Session.Instrumenter = std::make_unique<markers::IncrementalInstrumenter>(
+          FileName.str(), Flags, Mode);
+    while (Sessions.size() > std::max(MaxSessions.getValue(), 1u))
+      Sessions.erase(std::min_element(
+          Sessions.begin(), Sessions.end(), [](const auto &A, const auto &B) {
+            return A.second.LastUse < B.second.LastUse;
+          }));
+    return *Session.Instrumenter;
+  }
+
+  // Closes the session Name, returns whether it was open.
+  bool close(StringRef Name) { return Sessions.erase(Name.str()) != 0; }
+
+private:
+  struct Session {
+    std::unique_ptr<markers::IncrementalInstrumenter> Instrumenter;
+    uint64_t LastUse = 0;
+  };
+  std::map<std::string, Session> Sessions;
+  uint64_t Uses = 0;
+};
+
+// The options that incremental sessions do not support, as they would change
+// the IDs of the reused markers or are not measured, if any is set.
+std::optional<StringRef> getUnsupportedSessionOption() {
+  if (markers::MaxMarkers != 0)
+    return StringRef("--max-markers");
+  if (markers::SampleRate != 1.0)
+    return StringRef("--sample-rate");
+  if (markers::Numbering == markers::MarkerNumbering::Position)
+    return StringRef("--marker-numbering=position");
+  if (markers::PrintStats)
+    return StringRef("--print-stats");
+  if (markers::TimePhases)
+    return StringRef("--time-phases");
+  if (markers::ProfileMatchers)
+    return StringRef("--profile-matchers");
+  return std::nullopt;
+}
+
+// A request is an object with the keys:
+//   "code": the source code to instrument (required)
+//   "file": the file name, which determines the language (default: input.c)
+//   "flags": an array of compiler flags (default: [])
+//   "mode": "dce", "vr" or "dce,vr" (default: the --mode option)
+//   "ignore_functions_with_macros": a boolean (default: the command line
+//                                   option)
+//   "session": a name, the requests of a session are successive versions of
+//              one program that are instrumented incrementally (default: none)
+//   "close": true with "session" and without "code" closes the session
+// The response is either {"code": ..., "markers": [...], "manifest": [...]},
+// {"closed": <whether the session was open>} or {"error": ...}. With
+// --directives-out, the directives are returned in "directives" instead of
+// being part of "code", with --print-stats the statistics in "stats".
+llvm::json::Value handleRequest(markers::CodeInstrumenter &Instrumenter,
+                                IncrementalSessions &Sessions,
+                                StringRef Line) {
+  auto MakeError = [](const Twine &Message) -> llvm::json::Value {
+    return llvm::json::Object{{"error", toJSONString(Message.str())}};
+  };
+
+  auto Request = llvm::json::parse(Line);
+  if (!Request)
+    return MakeError(llvm::toString(Request.takeError()));
+  const auto *Object = Request->getAsObject();
+  if (!Object)
+    return MakeError("the request is not an object");
+
+  auto Session = Object->getString("session");
+  auto Close = Object->getBoolean("close");
+  if (Session && Close && *Close) {
+    if (Object->get("code"))
+      return MakeError("a \"close\" request has no \"code\"");
+    return llvm::json::Object{{"closed", Sessions.close(*Session)}};
+  }
+  if (Session)
+    if (auto Option = getUnsupportedSessionOption())
+      return MakeError("sessions do not support " + *Option);
+
+  auto Code = Object->getString("code");
+  if (!Code)
+    return MakeError("the request has no \"code\"");
+  auto File = Object->getString("file");
+  StringRef FileName = File ? *File : "input.c";
+
+  std::vector<std::string> Flags;
+  if (const auto *FlagArray = Object->getArray("flags"))
+    for (const auto &Flag : *FlagArray) {
+      auto FlagString = Flag.getAsString();
+      if (!FlagString)
+        return MakeError("\"flags\" must only contain strings");
+      Flags.push_back(FlagString->str());
+    }
+
+  auto RequestMode = Mode.getValue();
+  if (auto ModeName = Object->getString("mode")) {
+    auto ParsedMode = markers::parseInstrumenterMode(*ModeName);
+    if (!ParsedMode)
+      return MakeError("unknown mode " + *ModeName);
+    RequestMode = *ParsedMode;
+  }
+
+  auto IgnoreFunctionsWithMacros = markers::getIgnoreFunctionsWithMacros();
+  if (auto Ignore = Object->getBoolean("ignore_functions_with_macros"))
+    markers::setIgnoreFunctionsWithMacros(*Ignore);
+  auto Instrument = [&]() -> llvm::Expected<markers::InstrumentedFile> {
+    if (!Session)
+      return Instrumenter.instrument(*Code, FileName, Flags, RequestMode);
+    return Sessions.get(*Session, FileName, Flags, RequestMode)
+        .instrument(*Code);
+  };
+  auto Result = Instrument();
+  markers::setIgnoreFunctionsWithMacros(IgnoreFunctionsWithMacros);
+  if (!Result)
+    return MakeError(llvm::toString(Result.takeError()));
+
+  llvm::json::Array Markers;
+  for (const auto &Marker : Result->Markers)
+    Markers.push_back(Marker);
+  llvm::json::Object Response{{"code", toJSONString(Result->Code)},
+                              {"markers", std::move(Markers)},
+                              {"manifest", manifestToJSON(Result->Manifest)}};
+  if (!markers::DirectivesOutput.empty())
+    Response["directives"] = toJSONString(Result->Directives);
+  if (markers::PrintStats)
+    Response["stats"] = Result->Stats.toJSON();
+  if (markers::ProfileMatchers)
+    Response["matcher_profile"] = Result->Profile.toJSON();
+  return std::move(Response);
+}
+
+int runServer() {
+  markers::CodeInstrumenter Instrumenter;
+  IncrementalSessions Sessions;
+  std::string Line;
+  while (std::getline(std::cin, Line)) {
+    if (Line.empty())
+      continue;
+    llvm::outs() << handleRequest(Instrumenter, Sessions, Line) << "\n";
+    llvm::outs().flush();
+  }
+  return 0;
+}
 
-  return !Rewrite.overwriteChangedFiles();
+void printPhaseTimes(
+    llvm::raw_ostream &OS,
+    const std::vector<std::pair<std::string, markers::PhaseTimes>> &FileTimes) {
+  markers::PhaseTimes Total;
+  for (const auto &[File, Times] : FileTimes)
+    Total += Times;
+
+  if (TimePhasesFormatOption == TimePhasesFormat::Table) {
+    Total.print(OS, "program-markers phase timing");
+    return;
+  }
+  llvm::json::Array Files;
+  for (const auto &[File, Times] : FileTimes)
+    Files.push_back(llvm::json::Object{{"file", toJSONString(File)},
+                                       {"phases", Times.toJSON()}});
+  OS << llvm::json::Object{{"files", std::move(Files)},
+                           {"total", Total.toJSON()}}
+     << "\n";
+}
+
+void printStats(llvm::raw_ostream &OS,
+                const std::vector<std::pair<std::string,
+                                            markers::InstrumentationStats>>
+                    &FileStats) {
+  markers::InstrumentationStats Total;
+  for (const auto &[File, Stats] : FileStats) {
+    Stats.print(OS, "program-markers statistics: " + File);
+    Total += Stats;
+  }
+  if (FileStats.size() > 1)
+    Total.print(OS, "program-markers statistics: total");
+}
+
+void printMatcherProfiles(
+    llvm::raw_ostream &OS,
+    const std::vector<std::pair<std::string, markers::MatcherProfile>>
+        &FileProfiles) {
+  markers::MatcherProfile Total;
+  for (const auto &[File, Profile] : FileProfiles) {
+    Profile.print(OS, "program-markers matcher profile: " + File);
+    Total += Profile;
+  }
+  if (FileProfiles.size() > 1)
+    Total.print(OS, "program-markers matcher profile: total");
 }
 
 void versionPrinter(llvm::raw_ostream &S) { S << "v0.5.4\n"; }
@@ -75,36 +402,144 @@ void versionPrinter(llvm::raw_ostream &S) { S << "v0.5.4\n"; }
 
 int main(int argc, const char **argv) {
   cl::SetVersionPrinter(versionPrinter);
-  auto ExpectedParser =
-      CommonOptionsParser::create(argc, argv, markers::ProgramMarkersOptions);
+  auto ExpectedParser = CommonOptionsParser::create(
+      argc, argv, markers::ProgramMarkersOptions, cl::ZeroOrMore);
   if (!ExpectedParser) {
     llvm::errs() << ExpectedParser.takeError();
     return 1;
   }
   CommonOptionsParser &OptionsParser = ExpectedParser.get();
 
+  if (!markers::DirectivesOutput.empty() && markers::NoPreprocessorDirectives) {
+    llvm::errs() << "--directives-out and --no-preprocessor-directives "
+                    "conflict.\n";
+    return 1;
+  }
+  if (Server)
+    return runServer();
+  if (OptionsParser.getSourcePathList().empty()) {
+    llvm::errs() << "No source paths given.\n";
+    return 1;
+  }
+
   const auto &Compilations = OptionsParser.getCompilations();
-  const auto &Files = OptionsParser.getSourcePathList();
-  if (ToolMode::InstrumentBranches == Mode) {
-    RefactoringTool Tool(Compilations, Files);
-    if (int Result = runToolOnCode<markers::DCEInstrumenter>(Tool)) {
-      llvm::errs() << "Something went wrong...\n";
-      return Result;
+  auto Files = OptionsParser.getSourcePathList();
+
+  if ((Stdin || Stdout) && (AllTUs || Files.size() != 1)) {
+    llvm::errs() << "--stdin and --stdout require exactly one source path.\n";
+    return 1;
+  }
+  if (!markers::DirectivesOutput.empty() && (AllTUs || Files.size() != 1)) {
+    llvm::errs() << "--directives-out requires exactly one source path.\n";
+    return 1;
+  }
+  // The file named on the command line is only a name with --stdin, so it is
+  // never overwritten.
+  bool ToStdout = Stdin || Stdout;
+  if (ToStdout && markers::NoPreprocessorDirectives && MarkersFD == 1) {
+    llvm::errs() << "--stdin and --stdout require a --markers-fd other than "
+                    "stdout.\n";
+    return 1;
+  }
+
+  std::unique_ptr<llvm::raw_fd_ostream> MarkersFile;
+  llvm::raw_ostream *MarkersOS = &llvm::outs();
+  if (MarkersFD != 1) {
+    MarkersFile = std::make_unique<llvm::raw_fd_ostream>(
+        MarkersFD, /*shouldClose=*/false);
+    MarkersOS = MarkersFile.get();
+  }
+
+  std::unique_ptr<llvm::MemoryBuffer> StdinBuffer;
+  if (Stdin) {
+    auto Buffer = llvm::MemoryBuffer::getSTDIN();
+    if (!Buffer) {
+      llvm::errs() << "Could not read stdin: " << Buffer.getError().message()
+                   << "\n";
+      return 1;
     }
-    if (!applyReplacements(Tool)) {
-      llvm::errs() << "Failed to overwrite the input files.\n";
+    StdinBuffer = std::move(*Buffer);
+    SmallString<256> AbsolutePath(Files.front());
+    llvm::sys::fs::make_absolute(AbsolutePath);
+    Files.front() = std::string(AbsolutePath);
+  }
+
+  std::mutex OutputMutex;
+  bool WriteFailed = false;
+  std::vector<std::pair<std::string, markers::PhaseTimes>> FileTimes;
+  std::vector<std::pair<std::string, markers::InstrumentationStats>> FileStats;
+  std::vector<std::pair<std::string, markers::MatcherProfile>> FileProfiles;
+  std::vector<markers::InstrumentedFile> Manifests;
+  auto Factory = markers::newInstrumentationActionFactory(
+      Mode, [&](markers::InstrumentedFile File) {
+        auto *Times = markers::TimePhases ? &File.Times : nullptr;
+        bool Written;
+        {
+          markers::ScopedPhaseTimer Timer(Times, markers::Phase::Writing);
+          Written = ToStdout || writeFile(File.File, File.Code);
+          if (!markers::DirectivesOutput.empty())
+            Written &= writeFile(markers::DirectivesOutput, File.Directives);
+        }
+        std::lock_guard<std::mutex> Lock(OutputMutex);
+        {
+          markers::ScopedPhaseTimer Timer(Times, markers::Phase::Writing);
+          if (markers::NoPreprocessorDirectives) {
+            printMarkerNames(*MarkersOS, File.Markers);
+            MarkersOS->flush();
+          }
+          if (ToStdout)
+            llvm::outs() << File.Code;
+        }
+        WriteFailed |= !Written;
+        if (Times)
+          FileTimes.emplace_back(File.File, File.Times);
+        if (markers::PrintStats)
+          FileStats.emplace_back(File.File, File.Stats);
+        if (markers::ProfileMatchers)
+          FileProfiles.emplace_back(File.File, File.Profile);
+        if (!ManifestPath.empty()) {
+          File.Code.clear();
+          Manifests.push_back(std::move(File));
+        }
+      });
+  auto FirstCommands =
+      std::make_unique<FirstCommandOnlyFactory>(std::move(Factory));
+
+  if (AllTUs) {
+    std::unique_ptr<ToolExecutor> Executor =
+        std::make_unique<AllTUsToolExecutor>(Compilations, Jobs);
+    if (auto Err = Executor->execute(std::move(FirstCommands))) {
+      llvm::errs() << llvm::toString(std::move(Err)) << "\n";
+      llvm::errs() << "Something went wrong...\n";
       return 1;
     }
   } else {
-    RefactoringTool Tool(Compilations, Files);
-    if (int Result = runToolOnCode<markers::ValueRangeInstrumenter>(Tool)) {
+    ClangTool Tool(Compilations, Files);
+    if (StdinBuffer)
+      Tool.mapVirtualFile(Files.front(), StdinBuffer->getBuffer());
+    if (int Result = Tool.run(FirstCommands.get())) {
       llvm::errs() << "Something went wrong...\n";
       return Result;
     }
-    if (!applyReplacements(Tool)) {
-      llvm::errs() << "Failed to overwrite the input files.\n";
-      return 1;
-    }
+  }
+
+  if (markers::TimePhases)
+    printPhaseTimes(llvm::errs(), FileTimes);
+  if (markers::PrintStats)
+    printStats(llvm::errs(), FileStats);
+  if (markers::ProfileMatchers)
+    printMatcherProfiles(llvm::errs(), FileProfiles);
+  if (!ManifestPath.empty() && !writeManifest(ManifestPath, Manifests))
+    return 1;
+
+  if (WriteFailed) {
+    llvm::errs() << "Failed to write the instrumented files.\n";
+    return 1;
+  }
+  if (MarkersFile && MarkersFile->has_error()) {
+    MarkersFile->clear_error();
+    llvm::errs() << "Failed to write the markers to --markers-fd.\n";
+    return 1;
   }
 
   return 0;
@@ -0,0 +1,645 @@
+#include <clang/Frontend/TextDiagnosticPrinter.h>
+#include <clang/Tooling/CompilationDatabase.h>
+#include <clang/Tooling/Tooling.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/LineIterator.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <set>
+
+#include <CommandLine.h>
+#include <Instrumentation.h>
+
+extern char **environ;
+
+using namespace llvm;
+using namespace clang;
+using namespace clang::tooling;
+
+namespace {
+
+cl::OptionCategory BatchOptions("program-markers-batch options");
+
+cl::list<std::string> Inputs(cl::Positional,
+                             cl::desc("<directory or source file>..."),
+                             cl::ZeroOrMore, cl::cat(BatchOptions));
+
+cl::opt<std::string>
+    FileList("file-list",
+             cl::desc("Also instrument the source files listed in this file, "
+                      "one path per line."),
+             cl::init(""), cl::cat(BatchOptions));
+
+cl::opt<std::string> OutputDirectory(
+    "output-dir",
+    cl::desc("Write the instrumented files, their manifests (<file>.json) and "
+             "the progress journal (journal.jsonl) to this directory. The "
+             "files of an input directory keep their path relative to it, "
+             "the other files only keep their name, clashing names get a "
+             "-<n> suffix (required)."),
+    cl::init(""), cl::cat(BatchOptions));
+
+cl::opt<markers::InstrumenterMode> Mode(
+    "mode", cl::desc("program-markers mode:"),
+    cl::values(clEnumValN(markers::InstrumenterMode::DCE, "dce",
+                          "Only canonicalize and instrument branches with "
+                          "DCE markers (default)"),
+               clEnumValN(markers::InstrumenterMode::VR, "vr",
+                          "Only instrument for value ranges"),
+               clEnumValN(markers::InstrumenterMode::DCEAndVR, "dce,vr",
+                          "Instrument with DCE and value range markers in a "
+                          "single pass, the markers share one ID space")),
+    cl::init(markers::InstrumenterMode::DCE), cl::cat(BatchOptions));
+
+cl::opt<unsigned> Jobs("jobs",
+                       cl::desc("The number of worker processes, 0 uses all "
+                                "hardware threads (default: 0)."),
+                       cl::init(0), cl::cat(BatchOptions));
+
+cl::opt<unsigned>
+    Timeout("timeout",
+            cl::desc("Give up on a file after this many seconds of wall-clock "
+                     "time, 0 waits forever (default: 60)."),
+            cl::init(60), cl::cat(BatchOptions));
+
+cl::opt<unsigned> MemoryLimit(
+    "memory-limit",
+    cl::desc("Limit the address space of each worker process to this many "
+             "megabytes, a file that needs more crashes its worker, 0 sets "
+             "no limit (default: 0)."),
+    cl::init(0), cl::cat(BatchOptions));
+
+cl::opt<bool> Worker("worker",
+                     cl::desc("Run as a worker process of the batch driver."),
+                     cl::init(false), cl::Hidden, cl::cat(BatchOptions));
+
+const char *SourceExtensions[] = {".c", ".cc", ".cpp", ".cxx"};
+
+struct Task {
+  std::string Input;
+  std::string Output;
+};
+
+// The source files of the directories and the files given on the command
+// line, with their output paths. Each file is only instrumented once and
+// files whose output paths clash, e.g., files with the same name in
+// different directories, get the output path <stem>-<n><extension> with the
+// smallest free n.
+std::vector<Task> collectTasks() {
+  std::vector<Task> Tasks;
+  std::set<std::string> SeenInputs;
+  std::set<std::string> Outputs;
+  auto AddFile = [&](StringRef Input, StringRef RelativeOutput) {
+    if (!SeenInputs.insert(Input.str()).second)
+      return;
+    SmallString<256> Output(OutputDirectory);
+    sys::path::append(Output, RelativeOutput);
+    for (unsigned N = 1; Outputs.count(std::string(Output)); ++N) {
+      Output = OutputDirectory;
+      sys::path::append(Output, sys::path::parent_path(RelativeOutput),
+                        sys::path::stem(RelativeOutput) + "-" + Twine(N) +
+                            sys::path::extension(RelativeOutput));
+    }
+    Outputs.insert(std::string(Output));
+    Tasks.push_back({Input.str(), std::string(Output)});
+  };
+
+  std::vector<std::string> Paths(Inputs.begin(), Inputs.end());
+  if (!FileList.empty()) {
+    auto Buffer = MemoryBuffer::getFile(FileList);
+    if (!Buffer)
+      errs() << "Could not read " << FileList << ": "
+             << Buffer.getError().message() << "\n";
+    else
+      for (auto It = line_iterator(**Buffer); !It.is_at_end(); ++It)
+        Paths.push_back(It->trim().str());
+  }
+
+  for (const auto &Path : Paths) {
+    if (!sys::fs::is_directory(Path)) {
+      AddFile(Path, sys::path::filename(Path));
+      continue;
+    }
+    std::vector<std::string> Files;
+    std::error_code EC;
+    for (sys::fs::recursive_directory_iterator It(Path, EC), End;
+         It != End && !EC; It.increment(EC))
+      if (is_contained(SourceExtensions, sys::path::extension(It->path())))
+        Files.push_back(It->path());
+    if (EC)
+      errs() << "Could not list " << Path << ": " << EC.message() << "\n";
+    std::sort(Files.begin(), Files.end());
+    for (const auto &File : Files)
+      AddFile(File, StringRef(File).drop_front(Path.size()).ltrim("/"));
+  }
+  return Tasks;
+}
+
+bool writeFile(StringRef Path, StringRef Contents) {
+  if (sys::fs::create_directories(sys::path::parent_path(Path)))
+    return false;
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC, sys::fs::OF_None);
+  if (EC)
+    return false;
+  OS << Contents;
+  OS.close();
+  return !OS.has_error();
+}
+
+json::Value toJSONString(StringRef S) {
+  if (json::isUTF8(S))
+    return S.str();
+  return json::fixUTF8(S);
+}
+
+std::string toLine(const json::Value &Value) {
+  std::string Line;
+  raw_string_ostream OS(Line);
+  OS << Value;
+  return OS.str();
+}
+
+// A worker request is {"file": ..., "output": ...}, the response is either
+// {"markers": <the number of markers>, "stats": ... (with --print-stats)} or
+// {"error": ...}.
+json::Value instrumentFile(const CompilationDatabase &Compilations,
+                           FrontendActionFactory &Factory,
+                           std::optional<markers::InstrumentedFile> &Result,
+                           StringRef Line) {
+  auto MakeError = [](const Twine &Message) -> json::Value {
+    return json::Object{{"error", toJSONString(Message.str())}};
+  };
+  auto Request = json::parse(Line);
+  if (!Request)
+    return MakeError(toString(Request.takeError()));
+  const auto *Object = Request->getAsObject();
+  if (!Object)
+    return MakeError("malformed request");
+  auto File = Object->getString("file");
+  auto Output = Object->getString("output");
+  if (!File || !Output)
+    return MakeError("malformed request");
+
+  std::string Diagnostics;
+  raw_string_ostream DiagnosticsOS(Diagnostics);
+  IntrusiveRefCntPtr<DiagnosticOptions> DiagOpts = new DiagnosticOptions();
+  TextDiagnosticPrinter DiagnosticPrinter(DiagnosticsOS, &*DiagOpts);
+  ClangTool Tool(Compilations, {File->str()});
+  Tool.setDiagnosticConsumer(&DiagnosticPrinter);
+  Result.reset();
+  if (Tool.run(&Factory) != 0 || !Result) {
+    DiagnosticsOS.flush();
+    return MakeError(Diagnostics.empty() ? "instrumentation failed"
+                                         : Diagnostics);
+  }
+
+  json::Array Markers;
+  for (const auto &Marker : Result->Manifest)
+    Markers.push_back(Marker);
+  auto Manifest = toLine(json::Object{{"file", toJSONString(*File)},
+                                      {"markers", std::move(Markers)}});
+  if (!writeFile(*Output, Result->Code) ||
+      !writeFile((*Output + ".json").str(), Manifest + "\n"))
+    return MakeError("could not write " + *Output);
+  json::Object Response{
+      {"markers", static_cast<int64_t>(Result->Markers.size())}};
+  if (markers::PrintStats)
+    Response["stats"] = Result->Stats.toJSON();
+  return std::move(Response);
+}
+
+// Reads the lines of stdin as they arrive. MemoryBuffer::getSTDIN reads up to
+// the end of the input, but the driver only sends the next request once the
+// previous one is answered, so the lines are read with the same primitive.
+class StdinLineReader {
+public:
+  // Returns false at the end of the input.
+  bool next(std::string &Line) {
+    while (true) {
+      auto NewLine = Buffer.find('\n');
+      if (NewLine != std::string::npos) {
+        Line = Buffer.substr(0, NewLine);
+        Buffer.erase(0, NewLine + 1);
+        return true;
+      }
+      char Chunk[4096];
+      auto N = sys::fs::readNativeFile(sys::fs::getStdinHandle(), Chunk);
+      if (!N) {
+        consumeError(N.takeError());
+        return false;
+      }
+      if (*N == 0) {
+        Line = std::move(Buffer);
+        Buffer.clear();
+        return !Line.empty();
+      }
+      Buffer.append(Chunk, *N);
+    }
+  }
+
+private:
+  std::string Buffer;
+};
+
+// Instruments the files requested on stdin, one per line, with one set of
+// rules.
+int runWorker(const CompilationDatabase &Compilations) {
+  if (MemoryLimit != 0) {
+    rlimit Limit;
+    Limit.rlim_cur = Limit.rlim_max = static_cast<rlim_t>(MemoryLimit) << 20;
+    setrlimit(RLIMIT_AS, &Limit);
+  }
+
+  std::map<std::string, tooling::Replacements> FileToReplacements;
+  auto Instr = markers::makeInstrumenter(Mode, FileToReplacements);
+  std::optional<markers::InstrumentedFile> Result;
+  auto Factory = markers::newInstrumentationActionFactory(
+      Mode, *Instr,
+      [&](markers::InstrumentedFile File) { Result = std::move(File); });
+  StdinLineReader Reader;
+  std::string Line;
+  while (Reader.next(Line)) {
+    outs() << instrumentFile(Compilations, *Factory, Result, Line) << "\n";
+    outs().flush();
+  }
+  return 0;
+}
+
+enum class WorkerStatus { OK, Timeout, Crash };
+
+// A worker process, which is (re)started on demand and killed when it
+// exceeds the timeout.
+class WorkerProcess {
+public:
+  explicit WorkerProcess(std::vector<std::string> Args)
+      : Args{std::move(Args)} {}
+  WorkerProcess(const WorkerProcess &) = delete;
+  ~WorkerProcess() { stop(/*Kill=*/false); }
+
+  // Sends Request and waits for the response line, at most TimeoutSeconds
+  // (0: no limit). On a timeout or a crash, Response describes the failure.
+  WorkerStatus request(StringRef Request, unsigned TimeoutSeconds,
+                       std::string &Response) {
+    if (Pid < 0 && !start()) {
+      Response = "could not start a worker";
+      return WorkerStatus::Crash;
+    }
+    auto Message = Request.str() + "\n";
+    for (size_t Written = 0; Written < Message.size();) {
+      auto N = write(ToWorker, Message.data() + Written,
+                     Message.size() - Written);
+      if (N < 0 && errno == EINTR)
+        continue;
+      if (N < 0) {
+        Response = describeExit(stop(/*Kill=*/true));
+        return WorkerStatus::Crash;
+      }
+      Written += N;
+    }
+
+    auto Deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(TimeoutSeconds);
+    while (true) {
+      auto NewLine = Buffer.find('\n');
+      if (NewLine != std::string::npos) {
+        Response = Buffer.substr(0, NewLine);
+        Buffer.erase(0, NewLine + 1);
+        return WorkerStatus::OK;
+      }
+
+      int WaitMs = -1;
+      if (TimeoutSeconds != 0)
+        WaitMs = std::max<long>(
+            0, std::chrono::duration_cast<std::chrono::milliseconds>(
+                   Deadline - std::chrono::steady_clock::now())
+                   .count());
+      pollfd Poll{FromWorker, POLLIN, 0};
+      int Ready = poll(&Poll, 1, WaitMs);
+      if (Ready < 0 && errno == EINTR)
+        continue;
+      if (Ready == 0) {
+        stop(/*Kill=*/true);
+        Response = "timed out after " + std::to_string(TimeoutSeconds) + "s";
+        return WorkerStatus::Timeout;
+      }
+      char Chunk[4096];
+      auto N = Ready < 0 ? -1 : read(FromWorker, Chunk, sizeof(Chunk));
+      if (N < 0 && errno == EINTR)
+        continue;
+      if (N <= 0) {
+        Response = describeExit(stop(/*Kill=*/true));
+        return WorkerStatus::Crash;
+      }
+      Buffer.append(Chunk, N);
+    }
+  }
+
+private:
+  bool start() {
+    // The pipes of one worker must not be inherited by the workers started
+    // concurrently, or its end of file would never be seen.
+    static std::mutex SpawnMutex;
+    std::lock_guard<std::mutex> Lock(SpawnMutex);
+    int In[2], Out[2];
+    if (pipe(In) != 0)
+      return false;
+    if (pipe(Out) != 0) {
+      close(In[0]);
+      close(In[1]);
+      return false;
+    }
+    for (int FD : {In[1], Out[0]})
+      fcntl(FD, F_SETFD, FD_CLOEXEC);
+
+    posix_spawn_file_actions_t Actions;
+    posix_spawn_file_actions_init(&Actions);
+    posix_spawn_file_actions_adddup2(&Actions, In[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&Actions, Out[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&Actions, In[0]);
+    posix_spawn_file_actions_addclose(&Actions, Out[1]);
+    // The diagnostics are part of the responses.
+    posix_spawn_file_actions_addopen(&Actions, STDERR_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+    std::vector<char *> Argv;
+    for (auto &Arg : Args)
+      Argv.push_back(Arg.data());
+    Argv.push_back(nullptr);
+    int Error = posix_spawn(&Pid, Argv[0], &Actions, nullptr, Argv.data(),
+                            environ);
+    posix_spawn_file_actions_destroy(&Actions);
+    close(In[0]);
+    close(Out[1]);
+    if (Error != 0) {
+      close(In[1]);
+      close(Out[0]);
+      Pid = -1;
+      return false;
+    }
+    ToWorker = In[1];
+    FromWorker = Out[0];
+    Buffer.clear();
+    return true;
+  }
+
+  // Stops the worker, which exits by itself when its stdin is closed, and
+  // returns its wait status.
+  int stop(bool Kill) {
+    if (Pid < 0)
+      return 0;
+    close(ToWorker);
+    close(FromWorker);
+    if (Kill)
+      kill(Pid, SIGKILL);
+    int Status = 0;
+    while (waitpid(Pid, &Status, 0) < 0 && errno == EINTR)
+      ;
+    Pid = -1;
+    return Status;
+  }
+
+  static std::string describeExit(int Status) {
+    if (WIFSIGNALED(Status))
+      return "the worker was killed by signal " +
+             std::to_string(WTERMSIG(Status));
+    return "the worker exited with code " + std::to_string(WEXITSTATUS(Status));
+  }
+
+  std::vector<std::string> Args;
+  pid_t Pid = -1;
+  int ToWorker = -1;
+  int FromWorker = -1;
+  std::string Buffer;
+};
+
+// The tasks are split into one contiguous range per worker. A worker takes
+// its tasks from the front of its own queue and, once it is empty, steals
+// from the back of the queues of the others, so that a worker that is stuck
+// on a slow file does not hold up the rest of its range.
+class WorkStealingQueues {
+public:
+  WorkStealingQueues(size_t NumTasks, size_t NumWorkers) : Queues(NumWorkers) {
+    for (size_t I = 0; I < NumWorkers; ++I)
+      for (size_t T = I * NumTasks / NumWorkers;
+           T < (I + 1) * NumTasks / NumWorkers; ++T)
+        Queues[I].Tasks.push_back(T);
+  }
+
+  std::optional<size_t> pop(size_t Worker) {
+    for (size_t I = 0; I < Queues.size(); ++I) {
+      auto &Queue = Queues[(Worker + I) % Queues.size()];
+      std::lock_guard<std::mutex> Lock(Queue.Mutex);
+      if (Queue.Tasks.empty())
+        continue;
+      size_t Task;
+      if (I == 0) {
+        Task = Queue.Tasks.front();
+        Queue.Tasks.pop_front();
+      } else {
+        Task = Queue.Tasks.back();
+        Queue.Tasks.pop_back();
+      }
+      return Task;
+    }
+    return std::nullopt;
+  }
+
+private:
+  struct Queue {
+    std::mutex Mutex;
+    std::deque<size_t> Tasks;
+  };
+  std::vector<Queue> Queues;
+};
+
+// The journal has one JSON object per line and finished file:
+// {"file": ..., "output": ..., "status": "ok", "error", "timeout" or "crash",
+//  "seconds": ..., "markers": ... and, with --print-stats, "stats": ... (if
+//  ok) or "error": ... (otherwise)}.
+// Returns the files that were instrumented successfully, the failed ones are
+// tried again.
+std::set<std::string> readJournal(StringRef Path) {
+  std::set<std::string> Done;
+  auto Buffer = MemoryBuffer::getFile(Path);
+  if (!Buffer)
+    return Done;
+  for (auto It = line_iterator(**Buffer); !It.is_at_end(); ++It) {
+    // The last line is incomplete if the driver was killed while writing it.
+    auto Entry = json::parse(*It);
+    if (!Entry) {
+      consumeError(Entry.takeError());
+      continue;
+    }
+    if (const auto *Object = Entry->getAsObject())
+      if (auto File = Object->getString("file"))
+        if (Object->getString("status") == StringRef("ok"))
+          Done.insert(File->str());
+  }
+  return Done;
+}
+
+// Adds the result or the error of a worker response to the journal Entry and
+// returns the status of the file.
+StringRef parseResponse(StringRef Response, json::Object &Entry) {
+  auto Reply = json::parse(Response);
+  if (!Reply) {
+    Entry["error"] = toString(Reply.takeError());
+    return "error";
+  }
+  const auto *Object = Reply->getAsObject();
+  if (!Object) {
+    Entry["error"] = "malformed response";
+    return "error";
+  }
+  if (auto Error = Object->getString("error")) {
+    Entry["error"] = toJSONString(*Error);
+    return "error";
+  }
+  if (auto Markers = Object->getInteger("markers"))
+    Entry["markers"] = *Markers;
+  if (const auto *Stats = Object->get("stats"))
+    Entry["stats"] = *Stats;
+  return "ok";
+}
+
+int runBatch(std::vector<std::string> WorkerArgs) {
+  if (OutputDirectory.empty()) {
+    errs() << "--output-dir is required.\n";
+    return 1;
+  }
+  if (!markers::DirectivesOutput.empty()) {
+    errs() << "--directives-out is not supported, use --output-dir.\n";
+    return 1;
+  }
+  if (auto EC = sys::fs::create_directories(OutputDirectory)) {
+    errs() << "Could not create " << OutputDirectory << ": " << EC.message()
+           << "\n";
+    return 1;
+  }
+
+  SmallString<256> JournalPath(OutputDirectory);
+  sys::path::append(JournalPath, "journal.jsonl");
+  auto Done = readJournal(JournalPath);
+  std::vector<Task> Tasks;
+  size_t NumSkipped = 0;
+  for (auto &Task : collectTasks()) {
+    if (Done.count(Task.Input))
+      ++NumSkipped;
+    else
+      Tasks.push_back(std::move(Task));
+  }
+
+  std::error_code EC;
+  raw_fd_ostream Journal(JournalPath, EC, sys::fs::OF_Append);
+  if (EC) {
+    errs() << "Could not open " << JournalPath << ": " << EC.message() << "\n";
+    return 1;
+  }
+
+  // A worker that dies while a request is written must not kill the driver.
+  signal(SIGPIPE, SIG_IGN);
+  auto Strategy = hardware_concurrency(Jobs);
+  auto NumWorkers = std::max<size_t>(
+      1, std::min<size_t>(Strategy.compute_thread_count(), Tasks.size()));
+  WorkStealingQueues Queues(Tasks.size(), NumWorkers);
+  std::mutex JournalMutex;
+  std::map<std::string, size_t> StatusCounts;
+  {
+    ThreadPool Pool(Strategy);
+    for (size_t I = 0; I < NumWorkers; ++I)
+      Pool.async([&, I] {
+        WorkerProcess Process(WorkerArgs);
+        while (auto T = Queues.pop(I)) {
+          const auto &Task = Tasks[*T];
+          auto Start = std::chrono::steady_clock::now();
+          json::Object Entry{{"file", toJSONString(Task.Input)},
+                             {"output", toJSONString(Task.Output)}};
+          std::string Response;
+          auto Status = Process.request(toLine(json::Object(Entry)), Timeout,
+                                        Response);
+          std::chrono::duration<double> Seconds =
+              std::chrono::steady_clock::now() - Start;
+
+          Entry["seconds"] = Seconds.count();
+          StringRef StatusName;
+          switch (Status) {
+          case WorkerStatus::OK:
+            StatusName = parseResponse(Response, Entry);
+            break;
+          case WorkerStatus::Timeout:
+            StatusName = "timeout";
+            Entry["error"] = Response;
+            break;
+          case WorkerStatus::Crash:
+            StatusName = "crash";
+            Entry["error"] = Response;
+            break;
+          }
+          Entry["status"] = StatusName;
+
+          std::lock_guard<std::mutex> Lock(JournalMutex);
+          Journal << json::Value(std::move(Entry)) << "\n";
+          Journal.flush();
+          ++StatusCounts[StatusName.str()];
+        }
+      });
+    Pool.wait();
+  }
+
+  errs() << "Instrumented " << Tasks.size() << " files (" << NumSkipped
+         << " already instrumented):";
+  for (const auto &[Status, Count] : StatusCounts)
+    errs() << " " << Count << " " << Status;
+  errs() << "\n";
+  return StatusCounts["ok"] == Tasks.size() ? 0 : 1;
+}
+
+} // namespace
+
+int main(int argc, const char **argv) {
+  // The workers are started with the same options and compiler flags.
+  static int StaticSymbol;
+  std::vector<std::string> WorkerArgs(argv, argv + argc);
+  WorkerArgs[0] = sys::fs::getMainExecutable(argv[0], &StaticSymbol);
+  WorkerArgs.insert(WorkerArgs.begin() + 1, "--worker");
+
+  std::string ErrorMessage;
+  std::unique_ptr<CompilationDatabase> Compilations =
+      FixedCompilationDatabase::loadFromCommandLine(argc, argv, ErrorMessage);
+  if (!ErrorMessage.empty()) {
+    errs() << ErrorMessage << "\n";
+    return 1;
+  }
+  if (!Compilations)
+    Compilations = std::make_unique<FixedCompilationDatabase>(
+        ".", std::vector<std::string>());
+
+  cl::HideUnrelatedOptions({&BatchOptions, &markers::ProgramMarkersOptions});
+  if (!cl::ParseCommandLineOptions(
+          argc, argv,
+          "Instruments every source file of the given directories and files "
+          "with program markers, each with the compiler flags after --.\n"))
+    return 1;
+
+  if (Worker)
+    return runWorker(*Compilations);
+  return runBatch(std::move(WorkerArgs));
+}
@@ -0,0 +1,152 @@
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/LineIterator.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+namespace {
+
+// A directory with the inputs and the output directory of a batch.
+class BatchDirectory {
+public:
+  BatchDirectory() {
+    REQUIRE(!llvm::sys::fs::createUniqueDirectory("program-markers-batch",
+                                                   Root));
+    Output = path("out");
+  }
+  ~BatchDirectory() { llvm::sys::fs::remove_directories(Root); }
+
+  std::string path(llvm::StringRef Relative) const {
+    llvm::SmallString<256> Path(Root);
+    llvm::sys::path::append(Path, Relative);
+    return std::string(Path);
+  }
+
+  std::string write(llvm::StringRef Relative, llvm::StringRef Code) const {
+    auto Path = path(Relative);
+    REQUIRE(!llvm::sys::fs::create_directories(
+        llvm::sys::path::parent_path(Path)));
+    std::error_code EC;
+    llvm::raw_fd_ostream OS(Path, EC);
+    REQUIRE(!EC);
+    OS << Code;
+    return Path;
+  }
+
+  // Runs program-markers-batch on Inputs and returns its exit code.
+  int run(const std::vector<std::string> &Inputs,
+          const std::vector<std::string> &Options = {},
+          const std::vector<std::string> &Flags = {}) const {
+    std::vector<std::string> Args{PROGRAM_MARKERS_BATCH,
+                                  "--output-dir=" + Output};
+    Args.insert(Args.end(), Options.begin(), Options.end());
+    Args.insert(Args.end(), Inputs.begin(), Inputs.end());
+    if (!Flags.empty()) {
+      Args.push_back("--");
+      Args.insert(Args.end(), Flags.begin(), Flags.end());
+    }
+    std::vector<llvm::StringRef> ArgRefs(Args.begin(), Args.end());
+    return llvm::sys::ExecuteAndWait(PROGRAM_MARKERS_BATCH, ArgRefs);
+  }
+
+  // The status of each entry of the journal, in their order.
+  std::vector<std::pair<std::string, std::string>> journal() const {
+    std::vector<std::pair<std::string, std::string>> Entries;
+    auto Buffer = llvm::MemoryBuffer::getFile(path("out/journal.jsonl"));
+    REQUIRE(Buffer);
+    for (auto It = llvm::line_iterator(**Buffer); !It.is_at_end(); ++It) {
+      auto Entry = llvm::json::parse(*It);
+      REQUIRE(static_cast<bool>(Entry));
+      const auto *Object = Entry->getAsObject();
+      REQUIRE(Object);
+      Entries.emplace_back(Object->getString("file")->str(),
+                           Object->getString("status")->str());
+    }
+    return Entries;
+  }
+
+  llvm::SmallString<256> Root;
+  std::string Output;
+};
+
+const char *Valid =
+    "int foo(int a){\n  if (a)\n    return 1;\n  return 0;\n}\n";
+
+} // namespace
+
+TEST_CASE("program-markers-batch duplicate names", "[batch]") {
+  BatchDirectory Directory;
+  auto First = Directory.write("a/test.c", Valid);
+  auto Second = Directory.write("b/test.c", Valid);
+
+  // A file given twice is only instrumented once.
+  REQUIRE(Directory.run({First, Second, First}) == 0);
+  REQUIRE(Directory.journal().size() == 2);
+  for (const auto *Output : {"out/test.c", "out/test-1.c"}) {
+    REQUIRE(llvm::sys::fs::exists(Directory.path(Output)));
+    REQUIRE(llvm::sys::fs::exists(Directory.path(Output) + ".json"));
+  }
+  REQUIRE(!llvm::sys::fs::exists(Directory.path("out/test-2.c")));
+}
+
+TEST_CASE("program-markers-batch resume", "[batch]") {
+  BatchDirectory Directory;
+  auto Good = Directory.write("good.c", Valid);
+  auto Bad = Directory.write("bad.c", "int foo(int a){ return a + ; }\n");
+
+  REQUIRE(Directory.run({Good, Bad}) != 0);
+  std::map<std::string, std::string> Status;
+  for (const auto &[File, FileStatus] : Directory.journal())
+    Status[File] = FileStatus;
+  REQUIRE(Status.size() == 2);
+  REQUIRE(Status[Good] == "ok");
+  REQUIRE(Status[Bad] == "error");
+
+  // Only the failed file is tried again, and it succeeds once it is fixed.
+  Directory.write("bad.c", Valid);
+  REQUIRE(Directory.run({Good, Bad}) == 0);
+  auto Journal = Directory.journal();
+  REQUIRE(Journal.size() == 3);
+  REQUIRE(Journal.back() == std::pair<std::string, std::string>{Bad, "ok"});
+
+  REQUIRE(Directory.run({Good, Bad}) == 0);
+  REQUIRE(Directory.journal().size() == 3);
+}
+
+TEST_CASE("program-markers-batch timeout", "[batch]") {
+  BatchDirectory Directory;
+  // Evaluating the constant takes far longer than the timeout.
+  auto Slow = Directory.write("slow.cpp", R"code(constexpr long sum() {
+  long S = 0;
+  for (long I = 0; I < 2000000000; ++I)
+    S += I;
+  return S;
+}
+static_assert(sum() != 0, "");
+int foo(int a){
+  if (a)
+    return 1;
+  return 0;
+}
+)code");
+  auto Fast = Directory.write("fast.cpp", Valid);
+
+  REQUIRE(Directory.run({Slow, Fast}, {"--timeout=1", "--jobs=1"},
+                        {"-std=c++17", "-fconstexpr-steps=2147483647"}) != 0);
+  std::map<std::string, std::string> Status;
+  for (const auto &[File, FileStatus] : Directory.journal())
+    Status[File] = FileStatus;
+  REQUIRE(Status[Slow] == "timeout");
+  // The worker is restarted for the remaining files.
+  REQUIRE(Status[Fast] == "ok");
+}
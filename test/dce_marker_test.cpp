@@ -1,3 +1,4 @@
+#include <CommandLine.h>
 #include <DCEInstrumenter.h>
 
 #include "test_tool.h"
@@ -1579,3 +1580,73 @@ TEST_CASE("DCEInstrumenter switch if with return and macro",
   compare_code(formatCode(ExpectedCode), runDCEInstrumenterOnCode(Code, false));
   compare_code(formatCode(Code), runDCEInstrumenterOnCode(Code, true));
 }
+
+TEST_CASE("DCEInstrumenter engines", "[if][loop][switch][macro]") {
+  auto Code = GENERATE(R"code(int foo(int a) {
+        if (a > 0)
+          a = 1;
+        else if (a < -10) {
+          a = 2;
+        } else
+          a = 3;
+        if (a)
+          return a;
+        return 0;
+        })code",
+                       R"code(int foo(int a) {
+        int b = 0;
+        for (int i = 0; i < a; ++i)
+          b += i;
+        while (b > 10) {
+          b -= a;
+        }
+        do
+          ++b;
+        while (b < 0);
+        do {
+          --b;
+        } while (b > 100);
+        return b;
+        })code",
+                       R"code(int foo(int a) {
+        switch (a) {
+        case 1:
+        case 2:
+          a = 3;
+          break;
+        case 3:
+          switch (a + 1) {
+          case 4:
+            return 4;
+          default:
+            break;
+          }
+        default:
+          a = 0;
+        }
+        return a;
+        })code",
+                       R"code(#define RET return 1;
+        #define COND(x) (x > 0)
+        #define BODY { a++; }
+        int foo(int a) {
+          if (COND(a))
+            RET
+          if (a)
+            RET
+          else
+            a = 2;
+          while (a < 5)
+            BODY
+          return a;
+        })code");
+
+  auto Visitor = runDCEInstrumenterOnCode(Code, false);
+  markers::Engine = markers::MatchingEngine::Rules;
+  auto Rules = runDCEInstrumenterOnCode(Code, false);
+  markers::Engine = markers::MatchingEngine::Visitor;
+
+  CAPTURE(Code);
+  REQUIRE(Visitor != formatCode(formatCode(Code)));
+  compare_code(Rules, Visitor);
+}
@@ -0,0 +1,157 @@
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/LineIterator.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <string>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+namespace {
+
+// A directory with the inputs of program-markers and the files that its
+// standard streams are redirected to.
+class DriverDirectory {
+public:
+  DriverDirectory() {
+    REQUIRE(!llvm::sys::fs::createUniqueDirectory("program-markers-driver",
+                                                   Root));
+  }
+  ~DriverDirectory() { llvm::sys::fs::remove_directories(Root); }
+
+  std::string path(llvm::StringRef Relative) const {
+    llvm::SmallString<256> Path(Root);
+    llvm::sys::path::append(Path, Relative);
+    return std::string(Path);
+  }
+
+  std::string write(llvm::StringRef Relative, llvm::StringRef Code) const {
+    auto Path = path(Relative);
+    std::error_code EC;
+    llvm::raw_fd_ostream OS(Path, EC);
+    REQUIRE(!EC);
+    OS << Code;
+    return Path;
+  }
+
+  std::string read(llvm::StringRef Relative) const {
+    auto Buffer = llvm::MemoryBuffer::getFile(path(Relative));
+    REQUIRE(Buffer);
+    return (*Buffer)->getBuffer().str();
+  }
+
+  // Runs program-markers with Args and the contents of Stdin on its standard
+  // input and returns its exit code, its standard output is then in "stdout".
+  int run(const std::vector<std::string> &Args,
+          llvm::StringRef Stdin = "") const {
+    auto StdinPath = write("stdin", Stdin);
+    auto StdoutPath = path("stdout");
+    std::vector<llvm::StringRef> ArgRefs{PROGRAM_MARKERS};
+    ArgRefs.insert(ArgRefs.end(), Args.begin(), Args.end());
+    return llvm::sys::ExecuteAndWait(
+        PROGRAM_MARKERS, ArgRefs, {},
+        {llvm::StringRef(StdinPath), llvm::StringRef(StdoutPath),
+         llvm::StringRef()});
+  }
+
+  llvm::SmallString<256> Root;
+};
+
+const char *Valid =
+    "int foo(int a){\n  if (a)\n    return 1;\n  return 0;\n}\n";
+
+} // namespace
+
+TEST_CASE("program-markers stdin", "[driver]") {
+  DriverDirectory Directory;
+  auto File = Directory.write("test.c", Valid);
+
+  // The path only names the file, --stdin implies --stdout so that it is not
+  // overwritten.
+  REQUIRE(Directory.run({"--stdin", File, "--"},
+                        "int bar(int b){\n  if (b)\n    return 2;\n"
+                        "  return 0;\n}\n") == 0);
+  REQUIRE(Directory.read("test.c") == Valid);
+  auto Instrumented = Directory.read("stdout");
+  REQUIRE(Instrumented.find("int bar(int b)") != std::string::npos);
+  REQUIRE(Instrumented.find("DCEMarker1_") != std::string::npos);
+
+  REQUIRE(Directory.run({"--stdout", File, "--"}) == 0);
+  REQUIRE(Directory.read("test.c") == Valid);
+  REQUIRE(Directory.read("stdout").find("DCEMarker1_") != std::string::npos);
+
+  REQUIRE(Directory.run({"--stdin", File, File, "--"}, Valid) != 0);
+}
+
+TEST_CASE("program-markers manifest", "[driver]") {
+  DriverDirectory Directory;
+  auto File = Directory.write("test.c", Valid);
+  auto ManifestPath = Directory.path("manifest.json");
+
+  REQUIRE(Directory.run({"--manifest=" + ManifestPath, File, "--"}) == 0);
+  REQUIRE(Directory.read("test.c").find("DCEMarker1_") != std::string::npos);
+  auto Manifest = llvm::json::parse(Directory.read("manifest.json"));
+  REQUIRE(static_cast<bool>(Manifest));
+  const auto *Files = Manifest->getAsObject()->getArray("files");
+  REQUIRE(Files);
+  REQUIRE(Files->size() == 1);
+  const auto *Markers = (*Files)[0].getAsObject()->getArray("markers");
+  REQUIRE(Markers);
+  REQUIRE(Markers->size() == 2);
+  for (const auto &Marker : *Markers)
+    REQUIRE(Marker.getAsObject()->getString("function") ==
+            llvm::StringRef("foo"));
+}
+
+TEST_CASE("program-markers all translation units", "[driver]") {
+  DriverDirectory Directory;
+  auto First = Directory.write("a.c", Valid);
+  Directory.write("b.c", Valid);
+  llvm::json::Array Commands;
+  for (const auto *Name : {"a.c", "b.c"})
+    Commands.push_back(llvm::json::Object{
+        {"directory", Directory.Root.str()},
+        {"file", Name},
+        {"arguments", llvm::json::Array{"clang", "-c", Name}}});
+  std::string Database;
+  llvm::raw_string_ostream(Database) << llvm::json::Value(std::move(Commands));
+  Directory.write("compile_commands.json", Database);
+
+  REQUIRE(Directory.run({"--all-tus", "--jobs=2",
+                         "-p=" + Directory.Root.str().str(), First}) == 0);
+  for (const auto *Name : {"a.c", "b.c"})
+    REQUIRE(Directory.read(Name).find("DCEMarker1_") != std::string::npos);
+}
+
+TEST_CASE("program-markers server", "[driver]") {
+  DriverDirectory Directory;
+  std::string Requests;
+  llvm::raw_string_ostream OS(Requests);
+  OS << llvm::json::Object{{"code", Valid}, {"file", "test.c"}} << "\n"
+     << "not json\n"
+     << llvm::json::Object{{"code", Valid}, {"session", "s"}} << "\n"
+     << llvm::json::Object{{"session", "s"}, {"close", true}} << "\n";
+  OS.flush();
+
+  REQUIRE(Directory.run({"--server"}, Requests) == 0);
+  std::vector<llvm::json::Value> Responses;
+  auto Output = llvm::MemoryBuffer::getMemBufferCopy(Directory.read("stdout"));
+  for (auto It = llvm::line_iterator(*Output); !It.is_at_end(); ++It) {
+    auto Response = llvm::json::parse(*It);
+    REQUIRE(static_cast<bool>(Response));
+    Responses.push_back(std::move(*Response));
+  }
+  REQUIRE(Responses.size() == 4);
+  for (size_t I : {0, 2}) {
+    const auto *Markers = Responses[I].getAsObject()->getArray("markers");
+    REQUIRE(Markers);
+    REQUIRE(Markers->size() == 2);
+  }
+  REQUIRE(static_cast<bool>(Responses[1].getAsObject()->getString("error")));
+  REQUIRE(Responses[3].getAsObject()->getBoolean("closed") == true);
+}
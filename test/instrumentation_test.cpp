@@ -0,0 +1,1082 @@
+#include <DCEInstrumenter.h>
+#include <CommandLine.h>
+#include <ContextCache.h>
+#include <IncrementalInstrumentation.h>
+#include <Instrumentation.h>
+#include <Instrumenter.h>
+#include <Matchers.h>
+#include <ValueRangeInstrumenter.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <utility>
+
+#include "test_tool.h"
+#include <catch2/catch.hpp>
+
+TEST_CASE("InstrumentationAction DCE", "[action]") {
+  auto Code = std::string{R"code(int foo(int a){
+        if (a > 0)
+            return 1;
+        while (a < 10)
+            ++a;
+        return a;
+    }
+    )code"};
+
+  auto Result =
+      runInstrumentationActionOnCode(Code, markers::InstrumenterMode::DCE);
+
+  CAPTURE(Code);
+  compare_code(runDCEInstrumenterOnCode(Code),
+               formatCode(formatCode(Result.Code)));
+  REQUIRE(Result.Markers ==
+          std::vector<std::string>{"DCEMarker0_", "DCEMarker1_",
+                                   "DCEMarker2_"});
+}
+
+TEST_CASE("InstrumentationAction VR", "[action]") {
+  auto Code = std::string{R"code(int foo(int a, int b){
+        return a+b;
+    }
+    )code"};
+
+  auto Result =
+      runInstrumentationActionOnCode(Code, markers::InstrumenterMode::VR);
+
+  CAPTURE(Code);
+  compare_code(runVRInstrumenterOnCode(Code),
+               formatCode(formatCode(Result.Code)));
+  REQUIRE(Result.Markers ==
+          std::vector<std::string>{"VRMarker0_", "VRMarker1_"});
+}
+
+TEST_CASE("InstrumentationAction manifest", "[action]") {
+  auto Code = std::string{R"code(int foo(int a, unsigned char b){
+    if (a)
+        return b;
+    return 0;
+}
+)code"};
+
+  auto Result = runInstrumentationActionOnCode(
+      Code, markers::InstrumenterMode::DCEAndVR);
+
+  const auto &Manifest = Result.Manifest;
+  REQUIRE(Manifest.size() == Result.Markers.size());
+  REQUIRE(Manifest.size() == 4);
+  for (size_t I = 0; I < Manifest.size(); ++I) {
+    REQUIRE(Manifest[I].ID == I);
+    REQUIRE(Manifest[I].Function == "foo");
+  }
+
+  REQUIRE(Manifest[0].Kind == markers::MarkerKind::VR);
+  REQUIRE(Manifest[0].Variable == "a");
+  REQUIRE(Manifest[0].Type == "int");
+  REQUIRE(Manifest[0].Offset == Code.find("if"));
+  REQUIRE(Manifest[0].Line == 2);
+  REQUIRE(Manifest[0].Column == 5);
+  REQUIRE(Manifest[1].Kind == markers::MarkerKind::VR);
+  REQUIRE(Manifest[1].Variable == "b");
+  REQUIRE(Manifest[1].Type == "unsigned char");
+  REQUIRE(Manifest[1].Offset == Code.find("if"));
+
+  REQUIRE(Manifest[2].Kind == markers::MarkerKind::DCE);
+  REQUIRE(Manifest[2].Variable.empty());
+  REQUIRE(Manifest[3].Kind == markers::MarkerKind::DCE);
+  REQUIRE(Manifest[3].Offset == Code.find("return b"));
+  REQUIRE(Manifest[3].Line == 3);
+
+  auto JSON = llvm::json::Value(Manifest[0]);
+  REQUIRE(JSON.getAsObject()->getString("name") == "VRMarker0_");
+  REQUIRE(JSON.getAsObject()->getString("kind") == "vr");
+  REQUIRE(JSON.getAsObject()->getString("type") == "int");
+}
+
+TEST_CASE("InstrumentationAction DCE and VR", "[action][vr]") {
+  markers::setIgnoreFunctionsWithMacros(false);
+  auto Code = std::string{R"code(int foo(int a){
+        if (a > 0)
+            return 1;
+        return 0;
+    }
+    )code"};
+
+  auto Result =
+      runInstrumentationActionOnCode(Code, markers::InstrumenterMode::DCEAndVR);
+
+  auto ExpectedCode =
+      "// MARKERS START\n" +
+      markers::ValueRangeInstrumenter::makeMarkerMacros(0) +
+      markers::DCEInstrumenter::makeMarkerMacros(1) +
+      markers::DCEInstrumenter::makeMarkerMacros(2) + "// MARKERS END\n" +
+      R"code(int foo(int a){
+        VRMARKERMACRO0_(a,"int")
+        if ( a > 0)
+
+        {
+
+            DCEMARKERMACRO2_
+
+            return 1;
+
+        }
+
+        else {
+            DCEMARKERMACRO1_
+        }
+
+        return 0;
+    }
+    )code";
+
+  CAPTURE(Code);
+  compare_code(formatCode(ExpectedCode), formatCode(formatCode(Result.Code)));
+  REQUIRE(Result.Markers == std::vector<std::string>{"VRMarker0_",
+                                                     "DCEMarker1_",
+                                                     "DCEMarker2_"});
+}
+
+TEST_CASE("InstrumentationAction compact directives", "[action][vr]") {
+  markers::setIgnoreFunctionsWithMacros(false);
+  auto Code = std::string{R"code(int foo(int a){
+        if (a > 0)
+            return 1;
+        return 0;
+    }
+    )code"};
+
+  auto Full =
+      runInstrumentationActionOnCode(Code, markers::InstrumenterMode::DCEAndVR);
+  markers::Directives = markers::DirectiveStyle::Compact;
+  auto Compact =
+      runInstrumentationActionOnCode(Code, markers::InstrumenterMode::DCEAndVR);
+  markers::Directives = markers::DirectiveStyle::Full;
+  REQUIRE(Compact.Markers == Full.Markers);
+  REQUIRE(Compact.Code.find("#define DCEMARKERMACRO1_ MARKERS_DCE(1)\n") !=
+          std::string::npos);
+  REQUIRE(Compact.Code.size() < Full.Code.size());
+
+  // The full directives only declare the functions of the enabled markers.
+  auto Preprocess = [](const std::string &Code,
+                       const std::vector<std::string> &Args) {
+    auto Tokens = preprocessCode(Code, Args);
+    std::vector<std::string> Kept;
+    for (size_t I = 0; I < Tokens.size(); ++I) {
+      if (Tokens[I] == "void" && I + 5 < Tokens.size() &&
+          llvm::StringRef(Tokens[I + 1]).contains("Marker") &&
+          Tokens[I + 3] == "void" && Tokens[I + 5] == ";") {
+        I += 5;
+        continue;
+      }
+      Kept.push_back(Tokens[I]);
+    }
+    return Kept;
+  };
+  for (const auto &Args : std::vector<std::vector<std::string>>{
+           {},
+           {"-DDisableDCEMarker1_", "-DUnreachableVRMarker0_",
+            "-DVRMarkerLowerBound0_=-5", "-DVRMarkerUpperBound0_=5"},
+           {"-DUnreachableDCEMarker2_", "-DDisableVRMarker0_"}}) {
+    CAPTURE(Args);
+    REQUIRE(Preprocess(Compact.Code, Args) == Preprocess(Full.Code, Args));
+  }
+}
+
+TEST_CASE("CodeInstrumenter compact directives in C89", "[action]") {
+  markers::setIgnoreFunctionsWithMacros(false);
+  auto Code = std::string{R"code(int foo(int a){
+        if (a > 0)
+            return 1;
+        return 0;
+    }
+    )code"};
+
+  markers::CodeInstrumenter Instrumenter;
+  markers::Directives = markers::DirectiveStyle::Compact;
+  auto C89 = Instrumenter.instrument(Code, "input.c", {"-std=c89"},
+                                     markers::InstrumenterMode::DCE);
+  auto C99 = Instrumenter.instrument(Code, "input.c", {"-std=c99"},
+                                     markers::InstrumenterMode::DCE);
+  markers::Directives = markers::DirectiveStyle::Full;
+  REQUIRE(C89);
+  REQUIRE(C99);
+  // C89 has neither variadic macros nor empty macro arguments.
+  REQUIRE(C89->Code.find("MARKERS_DCE(") == std::string::npos);
+  REQUIRE(C89->Code.find("#if defined DisableDCEMarker0_") !=
+          std::string::npos);
+  REQUIRE(C99->Code.find("#define DCEMARKERMACRO0_ MARKERS_DCE(0)\n") !=
+          std::string::npos);
+}
+
+TEST_CASE("InstrumentationAction directives output", "[action]") {
+  auto Code = std::string{R"code(int foo(int a){
+        if (a > 0)
+            return 1;
+        return 0;
+    }
+    )code"};
+
+  auto Inline =
+      runInstrumentationActionOnCode(Code, markers::InstrumenterMode::DCE);
+  REQUIRE(Inline.Directives.empty());
+
+  markers::DirectivesOutput = "markers.h";
+  auto Separate =
+      runInstrumentationActionOnCode(Code, markers::InstrumenterMode::DCE);
+  markers::DirectivesOutput = "";
+  REQUIRE(Separate.Code.find("MARKERS START") == std::string::npos);
+  REQUIRE(Separate.Code.find("DCEMARKERMACRO1_") != std::string::npos);
+  REQUIRE(Separate.Directives ==
+          markers::makeMarkerDirectiveBlock(Separate.Manifest,
+                                            markers::Directives));
+  REQUIRE(Separate.Directives + Separate.Code == Inline.Code);
+}
+
+TEST_CASE("InstrumentationAction position numbering", "[action][vr]") {
+  markers::setIgnoreFunctionsWithMacros(false);
+  auto Code = std::string{R"code(int foo(int a){
+        if (a > 0)
+            return 1;
+        return 0;
+    }
+    )code"};
+
+  markers::Numbering = markers::MarkerNumbering::Position;
+  auto Result =
+      runInstrumentationActionOnCode(Code, markers::InstrumenterMode::DCEAndVR);
+  markers::Numbering = markers::MarkerNumbering::Traversal;
+
+  REQUIRE(Result.Markers == std::vector<std::string>{"VRMarker0_",
+                                                     "DCEMarker1_",
+                                                     "DCEMarker2_"});
+  REQUIRE(Result.Manifest.size() == 3);
+  for (size_t I = 0; I < Result.Manifest.size(); ++I) {
+    REQUIRE(Result.Manifest[I].ID == I);
+    if (I > 0)
+      REQUIRE(Result.Manifest[I - 1].Offset < Result.Manifest[I].Offset);
+  }
+  REQUIRE(Result.Code.find("else {\nDCEMARKERMACRO2_") != std::string::npos);
+}
+
+TEST_CASE("InstrumentationAction position numbering ties", "[action][vr]") {
+  markers::setIgnoreFunctionsWithMacros(false);
+  // The VR markers of b and a are inserted at the same offset by the same
+  // rule for the same statement.
+  auto Code = std::string{R"code(int foo(int b, int a){
+        return b + a;
+    }
+    )code"};
+
+  markers::Numbering = markers::MarkerNumbering::Position;
+  auto Result =
+      runInstrumentationActionOnCode(Code, markers::InstrumenterMode::VR);
+  markers::Numbering = markers::MarkerNumbering::Traversal;
+
+  REQUIRE(Result.Manifest.size() == 2);
+  REQUIRE(Result.Manifest[0].Offset == Result.Manifest[1].Offset);
+  REQUIRE(Result.Manifest[0].Variable == "a");
+  REQUIRE(Result.Manifest[1].Variable == "b");
+}
+
+TEST_CASE("InstrumentationAction marker sampling", "[action][vr]") {
+  markers::setIgnoreFunctionsWithMacros(false);
+  auto Code = std::string{R"code(int foo(int a, int b, int c){
+    if (a)
+        return b;
+    if (b)
+        return c;
+    return 0;
+}
+)code"};
+
+  auto All =
+      runInstrumentationActionOnCode(Code, markers::InstrumenterMode::DCEAndVR);
+  REQUIRE(All.Markers.size() > 3);
+
+  markers::MaxMarkers = 3;
+  markers::SampleSeed = 42;
+  auto Limited =
+      runInstrumentationActionOnCode(Code, markers::InstrumenterMode::DCEAndVR);
+  auto Again =
+      runInstrumentationActionOnCode(Code, markers::InstrumenterMode::DCEAndVR);
+  markers::MaxMarkers = 0;
+  REQUIRE(Limited.Markers.size() == 3);
+  for (size_t I = 0; I < Limited.Manifest.size(); ++I)
+    REQUIRE(Limited.Manifest[I].ID == I);
+  REQUIRE(Limited.Code == Again.Code);
+
+  markers::SampleRate = 0;
+  auto None =
+      runInstrumentationActionOnCode(Code, markers::InstrumenterMode::DCEAndVR);
+  markers::SampleRate = 1;
+  markers::SampleSeed = 0;
+  REQUIRE(None.Markers.empty());
+  REQUIRE(None.Code.find("MARKERMACRO") == std::string::npos);
+  // The braces of the DCE rules are still inserted.
+  REQUIRE(std::count(None.Code.begin(), None.Code.end(), '{') >
+          std::count(Code.begin(), Code.end(), '{'));
+}
+
+TEST_CASE("InstrumentationAction filters", "[action]") {
+  auto Code = std::string{R"code(int foo(int a){
+    if (a)
+        return 1;
+    return 0;
+}
+namespace ns {
+int bar(int a){
+    for (int i = 0; i < a; ++i)
+        a--;
+    return a;
+}
+}
+)code"};
+  auto &Options = cl::getRegisteredOptions();
+  auto Instrument = [&](llvm::StringRef Option, llvm::StringRef Value) {
+    REQUIRE(!Options[Option]->addOccurrence(1, Option, Value));
+    auto Result =
+        runInstrumentationActionOnCode(Code, markers::InstrumenterMode::DCE);
+    Options[Option]->reset();
+    return Result;
+  };
+
+  auto All =
+      runInstrumentationActionOnCode(Code, markers::InstrumenterMode::DCE);
+  REQUIRE(All.Manifest.size() == 3);
+
+  auto Functions = Instrument("functions", "ns::.*");
+  REQUIRE(Functions.Manifest.size() == 1);
+  REQUIRE(Functions.Manifest[0].Function == "ns::bar");
+
+  auto Rules = Instrument("rules", "if");
+  REQUIRE(Rules.Manifest.size() == 2);
+  for (const auto &Marker : Rules.Manifest)
+    REQUIRE(Marker.Function == "foo");
+
+  auto Lines = Instrument("lines", "input.cc:7-12");
+  REQUIRE(Lines.Manifest.size() == 1);
+  REQUIRE(Lines.Manifest[0].Function == "ns::bar");
+
+  REQUIRE(Options["lines"]->addOccurrence(1, "lines", "input.cc:7"));
+  for (auto Rate : {"-0.5", "1.5", "nan", "a"})
+    REQUIRE(Options["sample-rate"]->addOccurrence(1, "sample-rate", Rate));
+  REQUIRE(!Options["sample-rate"]->addOccurrence(1, "sample-rate", "0.5"));
+  Options["sample-rate"]->reset();
+  REQUIRE(Options["functions"]->addOccurrence(1, "functions", "foo("));
+  Options["lines"]->reset();
+  Options["functions"]->reset();
+}
+
+TEST_CASE("InstrumentationAction main file declarations", "[action]") {
+  auto Code = std::string{R"code(#define DEFINE_FUNCTION(NAME) int NAME(int a) { if (a) return 1; return 0; }
+    namespace ns {
+    int foo(int a){
+        if (a > 0)
+            return 1;
+        return 0;
+    }
+    }
+    extern "C" {
+    int bar(int a){
+        while (a < 10)
+            ++a;
+        return a;
+    }
+    }
+    DEFINE_FUNCTION(baz)
+    struct S {
+      int get(int a) {
+        if (a)
+          return a;
+        return 0;
+      }
+    };
+    )code"};
+
+  auto Result =
+      runInstrumentationActionOnCode(Code, markers::InstrumenterMode::DCE);
+
+  CAPTURE(Code);
+  compare_code(runDCEInstrumenterOnCode(Code),
+               formatCode(formatCode(Result.Code)));
+  REQUIRE(Result.Markers.size() == 5);
+}
+
+TEST_CASE("InstrumentationAction ignore functions with macros", "[action]") {
+  auto Code = std::string{R"code(#define ONE 1
+    int foo(int a){
+        if (a > 0)
+            return 1;
+        return 0;
+    }
+    int bar(int a){
+        if (a > 0)
+            return ONE;
+        return 0;
+    }
+    int baz(int a){
+        if (a > 0)
+            return 1;
+        return 0;
+    }
+    )code"};
+
+  auto All =
+      runInstrumentationActionOnCode(Code, markers::InstrumenterMode::DCE);
+  auto WithoutMacros = runInstrumentationActionOnCode(
+      Code, markers::InstrumenterMode::DCE, true);
+  // A new translation unit gets its own index of the macro expansions.
+  auto Again = runInstrumentationActionOnCode(
+      Code, markers::InstrumenterMode::DCE, true);
+  markers::setIgnoreFunctionsWithMacros(false);
+
+  REQUIRE(All.Manifest.size() % 3 == 0);
+  REQUIRE(WithoutMacros.Manifest.size() == All.Manifest.size() / 3 * 2);
+  for (const auto &Marker : WithoutMacros.Manifest)
+    REQUIRE((Marker.Line < 7 || Marker.Line > 11));
+  REQUIRE(Again.Code == WithoutMacros.Code);
+}
+
+TEST_CASE("InstrumentationAction eligible functions", "[action]") {
+  auto Code = std::string{R"code(#define ONE 1
+    constexpr int foo(int a){
+        if (a > 0)
+            return 1;
+        return 0;
+    }
+    namespace n {
+    int bar(int a){
+        auto f = [](int b) {
+            if (b > 0)
+                return 2;
+            return 0;
+        };
+        if (a > 0)
+            return ONE;
+        return f(a);
+    }
+    }
+    extern "C" int baz(int a){
+        if (a > 0)
+            return 1;
+        return 0;
+    }
+    auto g = [](int a) {
+        if (a > 0)
+            return 1;
+        return 0;
+    };
+    int qux(int a){
+        struct S {
+            int m(int b) {
+                if (b > 0)
+                    return 3;
+                return 0;
+            }
+        };
+        if (a > ONE)
+            return S().m(a);
+        return 0;
+    }
+    )code"};
+
+  for (bool IgnoreFunctionsWithMacros : {false, true}) {
+    auto Filtered = runInstrumentationActionOnCode(
+        Code, markers::InstrumenterMode::DCEAndVR, IgnoreFunctionsWithMacros);
+    markers::Engine = markers::MatchingEngine::Rules;
+    auto Unfiltered = runInstrumentationActionOnCode(
+        Code, markers::InstrumenterMode::DCEAndVR, IgnoreFunctionsWithMacros);
+    markers::Engine = markers::MatchingEngine::Visitor;
+
+    CAPTURE(IgnoreFunctionsWithMacros);
+    REQUIRE(!Filtered.Manifest.empty());
+    for (const auto &Marker : Filtered.Manifest)
+      REQUIRE(Marker.Line > 6);
+    REQUIRE(Filtered.Code == Unfiltered.Code);
+  }
+  markers::setIgnoreFunctionsWithMacros(false);
+}
+
+TEST_CASE("InstrumentationAction enclosing functions", "[action]") {
+  auto Code = std::string{R"code(constexpr int foo(int a){
+    if (a > 0)
+        return 1;
+    return 0;
+}
+namespace ns {
+int bar(int a){
+    auto f = [](int b) {
+        if (b > 0)
+            return 1;
+        return 0;
+    };
+    return f(a);
+}
+}
+int baz(int a){
+    if (a > 0)
+        return 1;
+    return 0;
+}
+)code"};
+
+  // Statements are instrumented if any enclosing function qualifies, so the
+  // lambda in bar is instrumented and foo is not.
+  auto All =
+      runInstrumentationActionOnCode(Code, markers::InstrumenterMode::DCE);
+  REQUIRE(!All.Manifest.empty());
+  REQUIRE(All.Manifest.size() % 2 == 0);
+  for (const auto &Marker : All.Manifest)
+    REQUIRE(Marker.Line > 5);
+
+  auto &Option = *cl::getRegisteredOptions()["functions"];
+  REQUIRE(!Option.addOccurrence(1, "functions", "ns::bar"));
+  auto Bar =
+      runInstrumentationActionOnCode(Code, markers::InstrumenterMode::DCE);
+  Option.reset();
+  REQUIRE(Bar.Manifest.size() == All.Manifest.size() / 2);
+  for (const auto &Marker : Bar.Manifest)
+    REQUIRE((Marker.Line >= 8 && Marker.Line <= 12));
+}
+
+TEST_CASE("MainFileLocations", "[matchers]") {
+  auto Code = GENERATE(std::string{R"code(#include "header.h"
+    #define ID(x) x
+    int foo(int a){ return ID(a) + bar(a); }
+    )code"},
+                       std::string{R"code(#include "header.h"
+    int foo(int a){ return bar(a); }
+    # 1 "other.h" 1
+    int baz(int a){ return a; }
+    # 4 "input.c" 2
+    int qux(int a){ return a; }
+    )code"});
+
+  auto AST = clang::tooling::buildASTFromCodeWithArgs(
+      Code, {}, "input.c", "program-markers-test",
+      std::make_shared<clang::PCHContainerOperations>(),
+      clang::tooling::getClangStripDependencyFileAdjuster(),
+      {{"header.h", "int bar(int a){ return a; }\n"}});
+  REQUIRE(AST);
+  auto &Context = AST->getASTContext();
+  const auto &SM = Context.getSourceManager();
+  markers::ContextCaches Caches(Context);
+  const auto &Locations = markers::getMainFileLocations(Context);
+
+  // Compares all locations of the files of the translation unit.
+  unsigned NumInMain = 0, NumNotInMain = 0, NumDifferent = 0;
+  for (unsigned I = 0, E = SM.local_sloc_entry_size(); I != E; ++I) {
+    const auto &Entry = SM.getLocalSLocEntry(I);
+    if (!Entry.isFile())
+      continue;
+    auto End = I + 1 < E ? SM.getLocalSLocEntry(I + 1).getOffset()
+                         : SM.getNextLocalOffset();
+    for (auto Offset = std::max<clang::SourceLocation::UIntTy>(
+             Entry.getOffset(), 1);
+         Offset < End; ++Offset) {
+      auto Loc = clang::SourceLocation::getFromRawEncoding(Offset);
+      bool InMain = SM.isInMainFile(Loc);
+      (InMain ? NumInMain : NumNotInMain)++;
+      NumDifferent += Locations.contains(Loc) != InMain;
+    }
+  }
+  CAPTURE(Code);
+  REQUIRE(NumInMain > 0);
+  REQUIRE(NumNotInMain > 0);
+  REQUIRE(NumDifferent == 0);
+  REQUIRE(!Locations.contains(clang::SourceLocation()));
+}
+
+TEST_CASE("ContextCaches", "[matchers]") {
+  auto BuildAST = [] {
+    auto AST = clang::tooling::buildASTFromCode(
+        "int foo(int a){ return a; }\n", "input.c");
+    REQUIRE(AST);
+    return AST;
+  };
+  auto Outer = BuildAST();
+  auto Inner = BuildAST();
+  auto &OuterContext = Outer->getASTContext();
+  auto &InnerContext = Inner->getASTContext();
+
+  markers::ContextCaches OuterCaches(OuterContext);
+  const auto *Locations = &markers::getMainFileLocations(OuterContext);
+  REQUIRE(&markers::getMainFileLocations(OuterContext) == Locations);
+  {
+    markers::ContextCaches InnerCaches(InnerContext);
+    REQUIRE(&markers::ContextCaches::of(InnerContext) == &InnerCaches);
+    REQUIRE(&markers::getMainFileLocations(InnerContext) != Locations);
+  }
+  REQUIRE(&markers::ContextCaches::of(OuterContext) == &OuterCaches);
+
+  // Each thread has its own current caches.
+  bool FoundThreadCaches = false;
+  std::thread([&] {
+    markers::ContextCaches Caches(InnerContext);
+    FoundThreadCaches = &markers::ContextCaches::of(InnerContext) == &Caches;
+  }).join();
+  REQUIRE(FoundThreadCaches);
+  REQUIRE(&markers::ContextCaches::of(OuterContext) == &OuterCaches);
+  REQUIRE(&markers::getMainFileLocations(OuterContext) == Locations);
+}
+
+TEST_CASE("InstrumentationAction match threads", "[action][vr]") {
+  std::string Code = "#define ID(x) x\nnamespace ns {\n";
+  for (int I = 0; I < 16; ++I) {
+    auto N = std::to_string(I);
+    // With --ignore-functions-with-macros, every other function is skipped.
+    Code += "int foo" + N + "(int a){\n"
+            "  int b = " + (I % 2 ? "a" : "ID(a)") + ";\n"
+            "  for (int i = 0; i < a; ++i)\n"
+            "    if (a > " + N + ")\n"
+            "      b++;\n"
+            "  return b;\n"
+            "}\n";
+    if (I == 7)
+      Code += "}\n";
+  }
+
+  for (auto Mode :
+       {markers::InstrumenterMode::DCE, markers::InstrumenterMode::VR,
+        markers::InstrumenterMode::DCEAndVR}) {
+    for (bool IgnoreFunctionsWithMacros : {false, true}) {
+      auto Serial = runInstrumentationActionOnCode(Code, Mode,
+                                                   IgnoreFunctionsWithMacros);
+      markers::MatchThreads = 4;
+      auto Sharded = runInstrumentationActionOnCode(Code, Mode,
+                                                    IgnoreFunctionsWithMacros);
+      markers::MatchThreads = 1;
+
+      REQUIRE(Sharded.Code == Serial.Code);
+      REQUIRE(Sharded.Markers == Serial.Markers);
+      REQUIRE(Sharded.Manifest.size() == Serial.Manifest.size());
+      for (size_t I = 0; I < Serial.Manifest.size(); ++I) {
+        REQUIRE(Sharded.Manifest[I].ID == Serial.Manifest[I].ID);
+        REQUIRE(Sharded.Manifest[I].Offset == Serial.Manifest[I].Offset);
+        REQUIRE(Sharded.Manifest[I].Function == Serial.Manifest[I].Function);
+      }
+    }
+  }
+}
+
+TEST_CASE("InstrumentationAction phase times", "[action]") {
+  auto Code = std::string{R"code(int foo(int a){
+        if (a > 0)
+            return 1;
+        return 0;
+    }
+    )code"};
+
+  markers::TimePhases = true;
+  auto Result =
+      runInstrumentationActionOnCode(Code, markers::InstrumenterMode::DCE);
+  markers::TimePhases = false;
+
+  REQUIRE(Result.Times.get(markers::Phase::Parse).getWallTime() > 0);
+  REQUIRE(Result.Times.get(markers::Phase::Matching).getWallTime() > 0);
+  REQUIRE(Result.Times.get(markers::Phase::EditCollection).getWallTime() > 0);
+  REQUIRE(Result.Times.get(markers::Phase::Writing).getWallTime() == 0);
+  auto JSON = Result.Times.toJSON();
+  for (auto Phase : {"parse", "matching", "edit_collection",
+                     "replacement_merging", "rewriting", "writing"})
+    REQUIRE(JSON.getObject(Phase));
+
+  auto Untimed =
+      runInstrumentationActionOnCode(Code, markers::InstrumenterMode::DCE);
+  REQUIRE(Untimed.Times.get(markers::Phase::Parse).getWallTime() == 0);
+}
+
+TEST_CASE("InstrumentationAction statistics", "[action][vr]") {
+  markers::setIgnoreFunctionsWithMacros(false);
+  auto Code = std::string{R"code(int foo(int a){
+        if (a > 0)
+            return 1;
+        return 0;
+    }
+    )code"};
+
+  markers::PrintStats = true;
+  auto Result = runInstrumentationActionOnCode(
+      Code, markers::InstrumenterMode::DCEAndVR);
+  markers::PrintStats = false;
+
+  const auto &Stats = Result.Stats;
+  REQUIRE(Stats.PeakRSS > 0);
+  REQUIRE(Stats.ASTBytes > 0);
+  REQUIRE(Stats.NumDecls > 0);
+  REQUIRE(Stats.NumStmts > 0);
+  REQUIRE(Stats.NumTypes > 0);
+  REQUIRE(Stats.NumLocalSLocEntries > 0);
+  REQUIRE(Stats.RuleMatches.at("if") == 1);
+  REQUIRE(Stats.RuleMatches.at("vr") >= 1);
+  REQUIRE(Stats.RuleMatches.at("while") == 0);
+  REQUIRE(Stats.NumReplacements > 0);
+  REQUIRE(Stats.ReplacementBytes > 0);
+  auto JSON = Stats.toJSON();
+  for (auto Key : {"peak_rss", "ast_bytes", "decls", "stmts", "types",
+                   "local_sloc_entries", "replacements", "replacement_bytes"})
+    REQUIRE(JSON.getInteger(Key));
+  REQUIRE(JSON.getObject("rule_matches"));
+
+  auto Unrecorded = runInstrumentationActionOnCode(
+      Code, markers::InstrumenterMode::DCEAndVR);
+  REQUIRE(Unrecorded.Stats.NumDecls == 0);
+  REQUIRE(Unrecorded.Stats.RuleMatches.empty());
+}
+
+TEST_CASE("InstrumentationAction matcher profile", "[action][vr]") {
+  markers::setIgnoreFunctionsWithMacros(false);
+  auto Code = std::string{R"code(int foo(int a){
+        if (a > 0)
+            return 1;
+        return 0;
+    }
+    )code"};
+
+  markers::ProfileMatchers = true;
+  auto Result = runInstrumentationActionOnCode(
+      Code, markers::InstrumenterMode::DCEAndVR);
+  markers::ProfileMatchers = false;
+
+  const auto &Entries = Result.Profile.Entries;
+  REQUIRE(Entries.at("handleIfStmt").NumMatches == 1);
+  REQUIRE(Entries.at("handleWhile").NumMatches == 0);
+  REQUIRE(Entries.at("valueRangeRule").NumMatches >= 1);
+  // The DCE rules are matched by their dispatcher, which holds their time.
+  REQUIRE(Entries.count("DCERuleDispatcher"));
+  auto JSON = Result.Profile.toJSON();
+  REQUIRE(JSON.getObject("handleIfStmt"));
+  REQUIRE(JSON.getObject("handleIfStmt")->getInteger("matches") == 1);
+
+  auto Unrecorded = runInstrumentationActionOnCode(
+      Code, markers::InstrumenterMode::DCEAndVR);
+  REQUIRE(Unrecorded.Profile.Entries.empty());
+}
+
+TEST_CASE("CodeInstrumenter reuse", "[action]") {
+  markers::setIgnoreFunctionsWithMacros(false);
+  markers::CodeInstrumenter Instrumenter;
+
+  auto DCECode = std::string{R"code(int foo(int a){
+        if (a > 0)
+            return 1;
+        return 0;
+    }
+    )code"};
+  auto VRCode = std::string{R"code(int foo(int a, int b){
+        return a+b;
+    }
+    )code"};
+
+  for (int i = 0; i < 2; ++i) {
+    auto DCEResult = Instrumenter.instrument(DCECode, "input.cc", {},
+                                             markers::InstrumenterMode::DCE);
+    REQUIRE(static_cast<bool>(DCEResult));
+    compare_code(runDCEInstrumenterOnCode(DCECode),
+                 formatCode(formatCode(DCEResult->Code)));
+    REQUIRE(DCEResult->Markers ==
+            std::vector<std::string>{"DCEMarker0_", "DCEMarker1_"});
+
+    auto VRResult = Instrumenter.instrument(VRCode, "input.cc", {},
+                                            markers::InstrumenterMode::VR);
+    REQUIRE(static_cast<bool>(VRResult));
+    compare_code(runVRInstrumenterOnCode(VRCode),
+                 formatCode(formatCode(VRResult->Code)));
+  }
+
+  auto Error = Instrumenter.instrument("int foo( {", "input.cc", {},
+                                       markers::InstrumenterMode::DCE);
+  REQUIRE(!Error);
+  llvm::consumeError(Error.takeError());
+
+  // The edits of the failed program are not carried over.
+  auto Again = Instrumenter.instrument(DCECode, "input.cc", {},
+                                       markers::InstrumenterMode::DCE);
+  REQUIRE(static_cast<bool>(Again));
+  REQUIRE(Again->Markers ==
+          std::vector<std::string>{"DCEMarker0_", "DCEMarker1_"});
+}
+
+TEST_CASE("CodeInstrumenter options", "[action]") {
+  markers::setIgnoreFunctionsWithMacros(false);
+  markers::CodeInstrumenter Instrumenter;
+  auto Code = std::string{R"code(#define ONE 1
+    int foo(int a){
+        if (a > 0)
+            return ONE;
+        return 0;
+    }
+    )code"};
+
+  markers::CodeInstrumenterOptions Options;
+  Options.IgnoreFunctionsWithMacros = true;
+  Options.NoPreprocessorDirectives = true;
+  auto Ignored = Instrumenter.instrument(
+      Code, "input.c", {}, markers::InstrumenterMode::DCE, Options);
+  REQUIRE(static_cast<bool>(Ignored));
+  REQUIRE(Ignored->Markers.empty());
+  REQUIRE(Ignored->Code.find("#define DCEMARKERMACRO") == std::string::npos);
+
+  // The options only apply to their call.
+  REQUIRE(!markers::getIgnoreFunctionsWithMacros());
+  auto Default = Instrumenter.instrument(Code, "input.c", {},
+                                         markers::InstrumenterMode::DCE);
+  REQUIRE(static_cast<bool>(Default));
+  REQUIRE(Default->Markers ==
+          std::vector<std::string>{"DCEMarker0_", "DCEMarker1_"});
+  REQUIRE(Default->Code.find("#define DCEMARKERMACRO") != std::string::npos);
+}
+
+TEST_CASE("IncrementalInstrumenter", "[action]") {
+  markers::setIgnoreFunctionsWithMacros(false);
+  auto Foo = std::string{R"code(int foo(int a){
+  if (a > 0)
+    return 1;
+  return 0;
+}
+)code"};
+  auto Bar = [](const std::string &Bound) {
+    return "int bar(int a){\n  if (a > " + Bound +
+           ")\n    return 1;\n  return 0;\n}\n";
+  };
+
+  markers::IncrementalInstrumenter Instrumenter("input.c", {},
+                                                markers::InstrumenterMode::DCE);
+  auto First = Instrumenter.instrument(Foo + Bar("0"));
+  REQUIRE(First);
+  REQUIRE(Instrumenter.getNumMatched() == 2);
+  REQUIRE(First->Markers ==
+          std::vector<std::string>{"DCEMarker0_", "DCEMarker1_",
+                                   "DCEMarker2_", "DCEMarker3_"});
+
+  // Only bar changed, the markers of foo keep their IDs.
+  auto Second = Instrumenter.instrument("\n" + Foo + Bar("1"));
+  REQUIRE(Second);
+  REQUIRE(Instrumenter.getNumMatched() == 1);
+  REQUIRE(Instrumenter.getNumReused() == 1);
+  REQUIRE(Second->Markers ==
+          std::vector<std::string>{"DCEMarker0_", "DCEMarker1_",
+                                   "DCEMarker4_", "DCEMarker5_"});
+  for (const auto &Marker : Second->Manifest)
+    REQUIRE(Marker.Function == (Marker.ID < 2 ? "foo" : "bar"));
+  REQUIRE(Second->Manifest[0].Line == First->Manifest[0].Line + 1);
+
+  markers::CodeInstrumenter Fresh;
+  auto Expected = Fresh.instrument("\n" + Foo + Bar("1"), "input.c", {},
+                                   markers::InstrumenterMode::DCE);
+  REQUIRE(Expected);
+  // Apart from the fresh IDs of the markers of bar, the code is the same as
+  // when instrumenting from scratch.
+  const std::pair<const char *, const char *> NewIDs[] = {
+      {"Marker2_", "Marker4_"},
+      {"MACRO2_", "MACRO4_"},
+      {"Marker3_", "Marker5_"},
+      {"MACRO3_", "MACRO5_"}};
+  auto Renumbered = Expected->Code;
+  for (auto [From, To] : NewIDs)
+    for (auto Pos = Renumbered.find(From); Pos != std::string::npos;
+         Pos = Renumbered.find(From, Pos))
+      Renumbered.replace(Pos, std::strlen(From), To);
+  REQUIRE(Second->Code == Renumbered);
+
+  auto Error = Instrumenter.instrument("int baz(int a){ return a + ; }");
+  REQUIRE(!Error);
+  llvm::consumeError(Error.takeError());
+  Instrumenter.reset();
+  auto Reset = Instrumenter.instrument(Foo);
+  REQUIRE(Reset);
+  REQUIRE(Reset->Markers ==
+          std::vector<std::string>{"DCEMarker0_", "DCEMarker1_"});
+}
+
+TEST_CASE("IncrementalInstrumenter dependencies", "[action][vr]") {
+  markers::setIgnoreFunctionsWithMacros(false);
+  auto Foo = std::string{R"code(T foo(T a){
+  if (a > LIMIT)
+    return 1;
+  return a;
+}
+)code"};
+
+  markers::IncrementalInstrumenter Instrumenter(
+      "input.c", {}, markers::InstrumenterMode::DCEAndVR);
+  auto First =
+      Instrumenter.instrument("typedef int T;\n#define LIMIT 0\n" + Foo);
+  REQUIRE(First);
+  REQUIRE(Instrumenter.getNumMatched() == 1);
+  auto Same =
+      Instrumenter.instrument("typedef int T;\n#define LIMIT 0\n" + Foo);
+  REQUIRE(Same);
+  REQUIRE(Instrumenter.getNumReused() == 1);
+
+  // The text of foo is unchanged, but the macro and the type it uses are not.
+  auto Macro =
+      Instrumenter.instrument("typedef int T;\n#define LIMIT (0)\n" + Foo);
+  REQUIRE(Macro);
+  REQUIRE(Instrumenter.getNumReused() == 0);
+  auto Type =
+      Instrumenter.instrument("typedef long T;\n#define LIMIT (0)\n" + Foo);
+  REQUIRE(Type);
+  REQUIRE(Instrumenter.getNumReused() == 0);
+  for (const auto &Marker : Type->Manifest)
+    if (Marker.Kind == markers::MarkerKind::VR)
+      REQUIRE(Marker.Type == "long");
+}
+
+TEST_CASE("IncrementalInstrumenter lines", "[action]") {
+  markers::setIgnoreFunctionsWithMacros(false);
+  auto Foo = std::string{R"code(int foo(int a){
+  if (a > 0)
+    return 1;
+  return 0;
+}
+)code"};
+  auto &Options = cl::getRegisteredOptions();
+  REQUIRE(!Options["lines"]->addOccurrence(1, "lines", "input.c:1-5"));
+
+  markers::IncrementalInstrumenter Instrumenter("input.c", {},
+                                                markers::InstrumenterMode::DCE);
+  auto Inside = Instrumenter.instrument(Foo);
+  REQUIRE(Inside);
+  REQUIRE(Inside->Markers.size() == 2);
+  REQUIRE(Instrumenter.getNumMatched() == 1);
+
+  // The text of foo is unchanged, but it moved out of the selected lines.
+  auto Outside = Instrumenter.instrument("\n\n\n\n\n" + Foo);
+  REQUIRE(Outside);
+  REQUIRE(Instrumenter.getNumReused() == 0);
+  REQUIRE(Outside->Markers.empty());
+
+  auto Back = Instrumenter.instrument(Foo);
+  REQUIRE(Back);
+  REQUIRE(Instrumenter.getNumReused() == 0);
+  REQUIRE(Back->Markers.size() == 2);
+  Options["lines"]->reset();
+}
+
+TEST_CASE("CodeInstrumenter builtin headers", "[action]") {
+  markers::setIgnoreFunctionsWithMacros(false);
+  markers::CodeInstrumenter Instrumenter;
+  auto Result = Instrumenter.instrument(R"code(#include <stddef.h>
+    size_t foo(size_t a){
+        if (a > 0)
+            return 1;
+        return 0;
+    }
+    )code",
+                                        "input.c", {},
+                                        markers::InstrumenterMode::DCE);
+  REQUIRE(static_cast<bool>(Result));
+  REQUIRE(Result->Markers ==
+          std::vector<std::string>{"DCEMarker0_", "DCEMarker1_"});
+}
+
+TEST_CASE("CodeInstrumenter preamble cache", "[action][pch]") {
+  markers::setIgnoreFunctionsWithMacros(false);
+  llvm::SmallString<256> Directory;
+  REQUIRE(!llvm::sys::fs::createUniqueDirectory("program-markers-test",
+                                                 Directory));
+  llvm::SmallString<256> HeaderPath(Directory);
+  llvm::sys::path::append(HeaderPath, "header.h");
+  {
+    std::error_code EC;
+    llvm::raw_fd_ostream OS(HeaderPath, EC);
+    REQUIRE(!EC);
+    OS << "#ifndef HEADER_H\n#define HEADER_H\n#define ONE 1\n"
+          "int bar(int);\n#endif\n";
+  }
+  llvm::SmallString<256> CacheDirectory(Directory);
+  llvm::sys::path::append(CacheDirectory, "cache");
+  std::vector<std::string> Args{"-I" + std::string(Directory)};
+
+  // Only the leading comments differ, both programs share one PCH.
+  auto Code = std::string{R"code(
+    #include "header.h"
+    int foo(int a){
+        if (a > ONE)
+            return bar(a);
+        return 0;
+    }
+    )code"};
+
+  markers::CodeInstrumenter Instrumenter;
+  for (auto Comment : {"/* seed: 1 */", "// seed: 2"}) {
+    auto Program = Comment + Code;
+    markers::PreambleCacheDirectory = "";
+    auto Expected = Instrumenter.instrument(Program, "input.c", Args,
+                                            markers::InstrumenterMode::DCE);
+    markers::PreambleCacheDirectory = std::string(CacheDirectory);
+    auto Result = Instrumenter.instrument(Program, "input.c", Args,
+                                          markers::InstrumenterMode::DCE);
+    markers::PreambleCacheDirectory = "";
+    REQUIRE(static_cast<bool>(Expected));
+    REQUIRE(static_cast<bool>(Result));
+    REQUIRE(Expected->Code == Result->Code);
+    REQUIRE(Expected->Markers == Result->Markers);
+  }
+
+  unsigned NumPCHs = 0;
+  std::error_code EC;
+  for (llvm::sys::fs::directory_iterator It(CacheDirectory, EC), End;
+       It != End && !EC; It.increment(EC))
+    NumPCHs += llvm::sys::path::extension(It->path()) == ".pch";
+  REQUIRE(NumPCHs == 1);
+
+  llvm::sys::fs::remove_directories(Directory);
+}
+
+TEST_CASE("CodeInstrumenter preamble cache header changes", "[action][pch]") {
+  markers::setIgnoreFunctionsWithMacros(false);
+  llvm::SmallString<256> Directory;
+  REQUIRE(!llvm::sys::fs::createUniqueDirectory("program-markers-test",
+                                                 Directory));
+  llvm::SmallString<256> HeaderPath(Directory);
+  llvm::sys::path::append(HeaderPath, "header.h");
+  // The header has no include guard, it must only be parsed once.
+  auto WriteHeader = [&](llvm::StringRef Contents) {
+    std::error_code EC;
+    llvm::raw_fd_ostream OS(HeaderPath, EC);
+    REQUIRE(!EC);
+    OS << Contents;
+  };
+  llvm::SmallString<256> CacheDirectory(Directory);
+  llvm::sys::path::append(CacheDirectory, "cache");
+  std::vector<std::string> Args{"-I" + std::string(Directory)};
+
+  auto Code = std::string{R"code(#include "header.h"
+    int foo(struct S s){
+        if (s.a > LIMIT)
+            return 1;
+        return 0;
+    }
+    )code"};
+  // A fresh instrumenter per run, as the file manager of an instrumenter
+  // caches the headers.
+  auto Instrument = [&](llvm::StringRef Cache) {
+    markers::PreambleCacheDirectory = std::string(Cache);
+    markers::CodeInstrumenter Instrumenter;
+    auto Result = Instrumenter.instrument(Code, "input.c", Args,
+                                          markers::InstrumenterMode::DCE);
+    markers::PreambleCacheDirectory = "";
+    REQUIRE(static_cast<bool>(Result));
+    return Result->Code;
+  };
+
+  WriteHeader("struct S { int a; };\n#define LIMIT 1\n");
+  auto Expected = Instrument("");
+  REQUIRE(Instrument(CacheDirectory) == Expected);
+  REQUIRE(Instrument(CacheDirectory) == Expected);
+  REQUIRE(llvm::StringRef(Expected).contains("#include \"header.h\""));
+
+  // The PCH of the old header is stale and rebuilt.
+  WriteHeader("struct S { int a; int b; };\nint bar(int);\n#define LIMIT 2\n");
+  Expected = Instrument("");
+  REQUIRE(Instrument(CacheDirectory) == Expected);
+
+  llvm::sys::fs::remove_directories(Directory);
+}
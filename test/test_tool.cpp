@@ -2,11 +2,16 @@
 
 #include "print_diff.h"
 
+#include <ContextCache.h>
 #include <DCEInstrumenter.h>
 #include <Matchers.h>
 #include <ValueRangeInstrumenter.h>
 
+#include <clang/AST/ASTConsumer.h>
 #include <clang/Format/Format.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/FrontendAction.h>
+#include <clang/Lex/Preprocessor.h>
 #include <clang/Tooling/Core/Replacement.h>
 #include <clang/Tooling/Refactoring.h>
 #include <clang/Tooling/Tooling.h>
@@ -15,6 +20,7 @@
 
 #include <catch2/catch.hpp>
 #include <memory>
+#include <optional>
 #include <type_traits>
 
 using namespace clang;
@@ -34,6 +40,33 @@ void compare_code(const std::string &code1, const std::string &code2) {
   REQUIRE(!diff);
 }
 
+namespace {
+
+// Runs the matchers of Finder with the caches of the context, as the
+// instrumentation consumer does.
+class MatchConsumer : public ASTConsumer {
+public:
+  explicit MatchConsumer(ast_matchers::MatchFinder &Finder) : Finder{Finder} {}
+
+  void HandleTranslationUnit(ASTContext &Context) override {
+    markers::ContextCaches Caches(Context);
+    Finder.matchAST(Context);
+  }
+
+private:
+  ast_matchers::MatchFinder &Finder;
+};
+
+struct MatchConsumerFactory {
+  std::unique_ptr<ASTConsumer> newASTConsumer() {
+    return std::make_unique<MatchConsumer>(Finder);
+  }
+
+  ast_matchers::MatchFinder &Finder;
+};
+
+} // namespace
+
 template <typename Tool> std::string runToolOnCode(llvm::StringRef Code) {
   clang::RewriterTestContext Context;
   clang::FileID ID = Context.createInMemoryFile("input.cc", Code);
@@ -42,8 +75,9 @@ template <typename Tool> std::string runToolOnCode(llvm::StringRef Code) {
   Tool InstrumenterTool{FileToReplacements};
   ast_matchers::MatchFinder Finder;
   InstrumenterTool.registerMatchers(Finder);
+  MatchConsumerFactory ConsumerFactory{Finder};
   std::unique_ptr<tooling::FrontendActionFactory> Factory =
-      tooling::newFrontendActionFactory(&Finder);
+      tooling::newFrontendActionFactory(&ConsumerFactory);
   REQUIRE(tooling::runToolOnCode(Factory->create(), Code, "input.cc"));
   InstrumenterTool.applyReplacements();
   formatAndApplyAllReplacements(FileToReplacements, Context.Rewrite);
@@ -61,3 +95,47 @@ std::string runVRInstrumenterOnCode(llvm::StringRef Code,
   markers::setIgnoreFunctionsWithMacros(ignore_functions_with_macros);
   return runToolOnCode<markers::ValueRangeInstrumenter>(Code);
 }
+
+markers::InstrumentedFile
+runInstrumentationActionOnCode(llvm::StringRef Code,
+                               markers::InstrumenterMode Mode,
+                               bool ignore_functions_with_macros) {
+  markers::setIgnoreFunctionsWithMacros(ignore_functions_with_macros);
+  std::optional<markers::InstrumentedFile> Result;
+  auto Factory = markers::newInstrumentationActionFactory(
+      Mode, [&](markers::InstrumentedFile File) { Result = std::move(File); });
+  REQUIRE(tooling::runToolOnCode(Factory->create(), Code, "input.cc"));
+  REQUIRE(Result.has_value());
+  return *Result;
+}
+
+namespace {
+
+class TokenSpellingAction : public PreprocessorFrontendAction {
+public:
+  explicit TokenSpellingAction(std::vector<std::string> &Spellings)
+      : Spellings{Spellings} {}
+
+protected:
+  void ExecuteAction() override {
+    auto &PP = getCompilerInstance().getPreprocessor();
+    PP.EnterMainSourceFile();
+    Token Tok;
+    for (PP.Lex(Tok); Tok.isNot(tok::eof); PP.Lex(Tok))
+      Spellings.push_back(PP.getSpelling(Tok));
+  }
+
+private:
+  std::vector<std::string> &Spellings;
+};
+
+} // namespace
+
+std::vector<std::string> preprocessCode(llvm::StringRef Code,
+                                        const std::vector<std::string> &Args) {
+  std::vector<std::string> Spellings;
+  REQUIRE(tooling::runToolOnCodeWithArgs(
+      std::make_unique<TokenSpellingAction>(Spellings), Code, Args,
+      "input.cc"));
+  return Spellings;
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <Instrumentation.h>
 #include <llvm/ADT/StringRef.h>
 
 std::string formatCode(llvm::StringRef Code);
@@ -8,5 +9,13 @@ std::string runDCEInstrumenterOnCode(llvm::StringRef Code,
 std::string runVRInstrumenterOnCode(llvm::StringRef Code,
                                     bool ignore_functions_with_macros = false);
 std::string runMakeGlobalsStaticOnCode(llvm::StringRef Code);
+markers::InstrumentedFile
+runInstrumentationActionOnCode(llvm::StringRef Code,
+                               markers::InstrumenterMode Mode,
+                               bool ignore_functions_with_macros = false);
+
+// The spellings of the tokens of Code after preprocessing it with Args.
+std::vector<std::string> preprocessCode(llvm::StringRef Code,
+                                        const std::vector<std::string> &Args);
 
 void compare_code(const std::string &code1, const std::string &code2);
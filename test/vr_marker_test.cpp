@@ -1,5 +1,6 @@
 #include <catch2/catch.hpp>
 
+#include <CommandLine.h>
 #include <ValueRangeInstrumenter.h>
 
 #include "test_tool.h"
@@ -219,3 +220,54 @@ TEST_CASE("VRMarkers enums", "[vr]") {
   CAPTURE(Code);
   compare_code(formatCode(Code), runVRInstrumenterOnCode(Code, false));
 }
+
+TEST_CASE("VRMarkers engines", "[vr]") {
+  auto Code = GENERATE(R"code(int foo(int a, int b){
+        for (int i = 0; i < a; ++i) {
+          int c = i * b;
+          if (c > a)
+            return c;
+          b += c;
+        }
+        return a + b;
+        })code",
+                       R"code(int foo(int a){
+        unsigned b = a, c;
+        c = b;
+        switch (a) {
+        case 1:
+          b = a + 1;
+          break;
+        default:
+          while (b < 10) {
+            int a = b;
+            b += a;
+          }
+        }
+        return b + c;
+        })code",
+                       R"code(int foo(int a){
+        int b = 2;
+        auto f = [b](int c) {
+          int d = c + b;
+          return d;
+        };
+        return f(a);
+        })code",
+                       R"code(#define TWICE(x) ((x) * 2)
+        char foo(char a, bool b, long c){
+          long d = TWICE(c);
+          if (b)
+            d += a;
+          return d;
+        })code");
+
+  auto Visitor = runVRInstrumenterOnCode(Code, false);
+  markers::Engine = markers::MatchingEngine::Rules;
+  auto Rules = runVRInstrumenterOnCode(Code, false);
+  markers::Engine = markers::MatchingEngine::Visitor;
+
+  CAPTURE(Code);
+  REQUIRE(Visitor != formatCode(formatCode(Code)));
+  compare_code(Rules, Visitor);
+}